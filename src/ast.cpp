@@ -13,8 +13,11 @@
 // PERFORMANCE OF THIS SOFTWARE.
 
 #include <iostream>
+#include <algorithm>
+#include "str.h"
 #include "enum.h"
 #include "context.h"
+#include "define.h"
 #include "ast.h"
 
 namespace as64
@@ -44,6 +47,13 @@ template<typename T> static void dumpList(std::ostream& s, const std::vector<std
   }
 }
 
+static void dumpValues(std::ostream& s, const std::vector<Byte>& values)
+{
+  s << "Packed:";
+  for (const auto& value: values)
+    s << ' ' << static_cast<int>(value);
+}
+
 // ----------------------------------------------------------------------------
 //      Node
 // ----------------------------------------------------------------------------
@@ -86,6 +96,22 @@ void EmptyStatement::dump(std::ostream& s, int level) const noexcept
   s << "Empty Statement";
 }
 
+// ----------------------------------------------------------------------------
+//      MacroCall
+// ----------------------------------------------------------------------------
+
+void MacroCall::accept(StatementVisitor& visitor)
+{
+  visitor.visit(*this);
+}
+
+void MacroCall::dump(std::ostream& s, int level) const noexcept
+{
+  indent(s, level);
+  prefixLabel(s);
+  s << "Macro Call: " << name_;
+}
+
 // ----------------------------------------------------------------------------
 //      SymbolDefinition
 // ----------------------------------------------------------------------------
@@ -304,6 +330,22 @@ void ObjectFileDirective::dump(std::ostream& s, int level) const noexcept
   s << "Object File Directive: \"" << filename_ << '"';
 }
 
+// ----------------------------------------------------------------------------
+//      SegmentDirective
+// ----------------------------------------------------------------------------
+
+void SegmentDirective::accept(StatementVisitor& visitor)
+{
+  visitor.visit(*this);
+}
+
+void SegmentDirective::dump(std::ostream& s, int level) const noexcept
+{
+  indent(s, level);
+  prefixLabel(s);
+  s << "Segment Directive: " << name_;
+}
+
 // ----------------------------------------------------------------------------
 //      ByteDirective
 // ----------------------------------------------------------------------------
@@ -317,8 +359,14 @@ void ByteDirective::dump(std::ostream& s, int level) const noexcept
 {
   indent(s, level);
   prefixLabel(s);
-  s << args_.size() << " byte(s)" << g_byteSelectorTags.fromValue(selector_) << ':' << std::endl;
-  dumpList(s, args_, level + 2);
+  s << byteLength() << " byte(s)" << g_byteSelectorTags.fromValue(selector_) << ':' << std::endl;
+  if (isPacked())
+  {
+    indent(s, level + 2);
+    dumpValues(s, values_);
+  }
+  else
+    dumpList(s, args_, level + 2);
 }
 
 // ----------------------------------------------------------------------------
@@ -334,8 +382,14 @@ void WordDirective::dump(std::ostream& s, int level) const noexcept
 {
   indent(s, level);
   prefixLabel(s);
-  s << args_.size() << " word(s):" << std::endl;
-  dumpList(s, args_, level + 2);
+  s << byteLength() / 2 << " word(s):" << std::endl;
+  if (isPacked())
+  {
+    indent(s, level + 2);
+    dumpValues(s, values_);
+  }
+  else
+    dumpList(s, args_, level + 2);
 }
 
 // ----------------------------------------------------------------------------
@@ -372,6 +426,79 @@ void BitmapDirective::dump(std::ostream& s, int level) const noexcept
   s << "Bitmap: " << args_.size() << " byte(s)";
 }
 
+// ----------------------------------------------------------------------------
+//      FillDirective
+// ----------------------------------------------------------------------------
+
+void FillDirective::accept(StatementVisitor& visitor)
+{
+  visitor.visit(*this);
+}
+
+void FillDirective::dump(std::ostream& s, int level) const noexcept
+{
+  indent(s, level);
+  prefixLabel(s);
+  s << "Fill Directive: " << index_ << g_byteSelectorTags.fromValue(selector_) << std::endl;
+  count_->dump(s, level + 2);
+  s << std::endl;
+  value_->dump(s, level + 2);
+}
+
+// ----------------------------------------------------------------------------
+//      TableDirective
+// ----------------------------------------------------------------------------
+
+static EnumTags<TableFunction> g_tableFunctionTags =
+{
+  { TableFunction::Sine,              "sin" },
+  { TableFunction::Cosine,            "cos" }
+};
+
+Maybe<TableFunction> tableFunctionNamed(const std::string& name) noexcept
+{
+  auto function = g_tableFunctionTags.fromName(toLowerCase(name), TableFunction::_End);
+  if (function == TableFunction::_End)
+    return nullptr;
+  return function;
+}
+
+void TableDirective::accept(StatementVisitor& visitor)
+{
+  visitor.visit(*this);
+}
+
+void TableDirective::dump(std::ostream& s, int level) const noexcept
+{
+  indent(s, level);
+  prefixLabel(s);
+  s << "Table Directive: " << g_tableFunctionTags.fromValue(function_) << std::endl;
+  count_->dump(s, level + 2);
+  s << std::endl;
+  amplitude_->dump(s, level + 2);
+  if (offset_)
+  {
+    s << std::endl;
+    offset_->dump(s, level + 2);
+  }
+}
+
+// ----------------------------------------------------------------------------
+//      IncbinDirective
+// ----------------------------------------------------------------------------
+
+void IncbinDirective::accept(StatementVisitor& visitor)
+{
+  visitor.visit(*this);
+}
+
+void IncbinDirective::dump(std::ostream& s, int level) const noexcept
+{
+  indent(s, level);
+  prefixLabel(s);
+  s << "Incbin Directive: " << file_->filename() << ", offset " << offset_ << ", " << length_ << " byte(s)";
+}
+
 // ----------------------------------------------------------------------------
 //      IfDirective
 // ----------------------------------------------------------------------------
@@ -453,6 +580,71 @@ void EndDirective::dump(std::ostream& s, int level) const noexcept
   s << "End Directive";
 }
 
+// ----------------------------------------------------------------------------
+//      OptimizeDirective
+// ----------------------------------------------------------------------------
+
+void OptimizeDirective::accept(StatementVisitor& visitor)
+{
+  visitor.visit(*this);
+}
+
+void OptimizeDirective::dump(std::ostream& s, int level) const noexcept
+{
+  indent(s, level);
+  prefixLabel(s);
+  s << "Optimize Directive: " << (enabled_ ? "" : "no") << option_;
+}
+
+// ----------------------------------------------------------------------------
+//      CpuDirective
+// ----------------------------------------------------------------------------
+
+void CpuDirective::accept(StatementVisitor& visitor)
+{
+  visitor.visit(*this);
+}
+
+void CpuDirective::dump(std::ostream& s, int level) const noexcept
+{
+  indent(s, level);
+  prefixLabel(s);
+  s << "Cpu Directive: " << toString(cpu_);
+}
+
+// ----------------------------------------------------------------------------
+//      BudgetBeginDirective
+// ----------------------------------------------------------------------------
+
+void BudgetBeginDirective::accept(StatementVisitor& visitor)
+{
+  visitor.visit(*this);
+}
+
+void BudgetBeginDirective::dump(std::ostream& s, int level) const noexcept
+{
+  indent(s, level);
+  prefixLabel(s);
+  s << "Budget Begin Directive" << std::endl;
+  expr_->dump(s, level + 2);
+}
+
+// ----------------------------------------------------------------------------
+//      BudgetEndDirective
+// ----------------------------------------------------------------------------
+
+void BudgetEndDirective::accept(StatementVisitor& visitor)
+{
+  visitor.visit(*this);
+}
+
+void BudgetEndDirective::dump(std::ostream& s, int level) const noexcept
+{
+  indent(s, level);
+  prefixLabel(s);
+  s << "Budget End Directive";
+}
+
 // ----------------------------------------------------------------------------
 //      StatementList
 // ----------------------------------------------------------------------------
@@ -462,6 +654,13 @@ void StatementList::add(std::unique_ptr<Statement> statement) noexcept
   statements_.push_back(std::move(statement));
 }
 
+void StatementList::remove(const std::unordered_set<const Statement *>& statements) noexcept
+{
+  statements_.erase(std::remove_if(std::begin(statements_), std::end(statements_),
+                                   [&](const auto& statement) { return statements.count(statement.get()) != 0; }),
+                    std::end(statements_));
+}
+
 void StatementList::accept(StatementVisitor& visitor) const
 {
   for (const auto& statement: statements_)
@@ -489,20 +688,31 @@ void StatementList::dump(std::ostream& s, int level) const noexcept
 //      Expression
 // ----------------------------------------------------------------------------
 
-Maybe<Address> Expression::tryEval(Context& context)
+Maybe<Address> Expression::value() const noexcept
 {
-  auto root = root_->eval(context, false);
-  if (root)
-    root_ = std::move(root);
   return root_->value();
 }
 
-Address Expression::eval(Context& context)
+Maybe<Address> Expression::tryEval(Context& context) const
+{
+  auto root = root_->eval(context, false);
+  return root ? root->value() : root_->value();
+}
+
+Address Expression::eval(Context& context) const
 {
   auto root = root_->eval(context, true);
-  if (root)
-    root_ = std::move(root);
-  return root_->value().value();
+  return root ? root->value().value() : root_->value().value();
+}
+
+RelocationTerm Expression::term(Context& context) const
+{
+  return root_->term(context);
+}
+
+void Expression::walk(const std::function<void (const ExprNode& node)>& f) const
+{
+  root_->walk(f);
 }
 
 void Expression::dump(std::ostream& s, int level) const noexcept
@@ -526,9 +736,13 @@ void ExprConstant::dump(std::ostream& s, int level) const noexcept
 //      ExprSymbol
 // ----------------------------------------------------------------------------
 
-std::unique_ptr<ExprNode> ExprSymbol::eval(Context& context, bool throwUndefined)
+std::unique_ptr<ExprNode> ExprSymbol::eval(Context& context, bool throwUndefined) const
 {
-  auto value = context.symbols.get(name_);
+  if (context.indexName && name_ == *context.indexName)
+    return std::make_unique<ExprConstant>(pos(), context.index);
+  auto value = lookupSymbol(context, name_, throwUndefined);
+  if (! value.hasValue() && context.importing)
+    return std::make_unique<ExprConstant>(pos(), ImportAddress);
   if (! value.hasValue())
   {
     if (! throwUndefined)
@@ -538,6 +752,19 @@ std::unique_ptr<ExprNode> ExprSymbol::eval(Context& context, bool throwUndefined
   return std::make_unique<ExprConstant>(pos(), *value);
 }
 
+RelocationTerm ExprSymbol::term(Context& context) const
+{
+  if (context.indexName && name_ == *context.indexName)
+    return {};
+  lookupSymbol(context, name_);
+  auto term = context.symbolTerms.find(name_);
+  if (term != std::end(context.symbolTerms))
+    return term->second;
+  if (! context.symbols.exists(name_))
+    return { TermType::Import, name_ };
+  return {};
+}
+
 void ExprSymbol::dump(std::ostream& s, int level) const noexcept
 {
   indent(s, level);
@@ -548,7 +775,7 @@ void ExprSymbol::dump(std::ostream& s, int level) const noexcept
 //      ExprTemporarySymbol
 // ----------------------------------------------------------------------------
 
-std::unique_ptr<ExprNode> ExprTemporarySymbol::eval(Context& context, bool throwUndefined)
+std::unique_ptr<ExprNode> ExprTemporarySymbol::eval(Context& context, bool throwUndefined) const
 {
   auto value = context.symbols.get(context.pc, labelDelta_);
   if (! value.hasValue())
@@ -560,6 +787,14 @@ std::unique_ptr<ExprNode> ExprTemporarySymbol::eval(Context& context, bool throw
   return std::make_unique<ExprConstant>(pos(), *value);
 }
 
+// Temporary labels always mark a place in the code, so they move with the current segment.
+RelocationTerm ExprTemporarySymbol::term(Context& context) const
+{
+  if (! context.segment)
+    return {};
+  return { TermType::Segment, context.segment->name };
+}
+
 void ExprTemporarySymbol::dump(std::ostream& s, int level) const noexcept
 {
   indent(s, level);
@@ -570,11 +805,18 @@ void ExprTemporarySymbol::dump(std::ostream& s, int level) const noexcept
 //      ExprProgramCounter
 // ----------------------------------------------------------------------------
 
-std::unique_ptr<ExprNode> ExprProgramCounter::eval(Context& context, bool throwUndefined)
+std::unique_ptr<ExprNode> ExprProgramCounter::eval(Context& context, bool throwUndefined) const
 {
   return std::make_unique<ExprConstant>(pos(), context.pc);
 }
 
+RelocationTerm ExprProgramCounter::term(Context& context) const
+{
+  if (! context.segment)
+    return {};
+  return { TermType::Segment, context.segment->name };
+}
+
 void ExprProgramCounter::dump(std::ostream& s, int level) const noexcept
 {
   indent(s, level);
@@ -585,16 +827,13 @@ void ExprProgramCounter::dump(std::ostream& s, int level) const noexcept
 //      ExprOperator
 // ----------------------------------------------------------------------------
 
-std::unique_ptr<ExprNode> ExprOperator::eval(Context& context, bool throwUndefined)
+std::unique_ptr<ExprNode> ExprOperator::eval(Context& context, bool throwUndefined) const
 {
   auto left = left_->eval(context, throwUndefined);
   auto right = right_->eval(context, throwUndefined);
-  if (left)
-    left_ = std::move(left);
-  if (right)
-    right_ = std::move(right);
 
-  auto a = left_->value(), b = right_->value();
+  auto a = left ? left->value() : left_->value();
+  auto b = right ? right->value() : right_->value();
   if (a.hasValue() && b.hasValue())
   {
     Address result;
@@ -629,6 +868,44 @@ std::unique_ptr<ExprNode> ExprOperator::eval(Context& context, bool throwUndefin
   return nullptr;
 }
 
+// A relocatable value is an address plus a constant. Such a value can be offset, and two addresses
+// within the same segment can be subtracted to give a constant, but nothing else can be done with it
+// until it is linked.
+RelocationTerm ExprOperator::term(Context& context) const
+{
+  auto left = left_->term(context);
+  auto right = right_->term(context);
+  switch (op_)
+  {
+    case '+':
+      if (right.isAbsolute())
+        return left;
+      if (left.isAbsolute())
+        return right;
+      break;
+
+    case '-':
+      if (left == right)
+        return {};
+      if (right.isAbsolute())
+        return left;
+      break;
+
+    default:
+      if (left.isAbsolute() && right.isAbsolute())
+        return {};
+      break;
+  }
+  throwSourceError(pos(), "Expression cannot be relocated");
+}
+
+void ExprOperator::walk(const std::function<void (const ExprNode& node)>& f) const
+{
+  f(*this);
+  left_->walk(f);
+  right_->walk(f);
+}
+
 void ExprOperator::dump(std::ostream& s, int level) const noexcept
 {
   indent(s, level);
@@ -4,12 +4,16 @@
 #include <string>
 #include <memory>
 #include <vector>
+#include <unordered_set>
 #include <ostream>
+#include <functional>
 #include "types.h"
 #include "str.h"
 #include "source.h"
 #include "buffer.h"
+#include "file.h"
 #include "instruction.h"
+#include "object.h"
 
 namespace as64
 {
@@ -49,8 +53,8 @@ private:
 class Statement: public Node
 {
 public:
-  Statement(SourcePos pos) noexcept : Node(pos), pc_(0) { }
-  Statement(SourcePos pos, const Label& label) noexcept : Node(pos), label_(label), pc_(0) { }
+  Statement(SourcePos pos) noexcept : Node(pos), pc_(0), skipped_(false) { }
+  Statement(SourcePos pos, const Label& label) noexcept : Node(pos), label_(label), pc_(0), skipped_(false) { }
 
   const Label& label() const noexcept { return label_; }
   void setLabel(const Label& label) noexcept { label_ = label; }
@@ -89,6 +93,26 @@ public:
   void dump(std::ostream& s, int level = 0) const noexcept override;
 };
 
+// ----------------------------------------------------------------------------
+//      MacroCall
+// ----------------------------------------------------------------------------
+
+// Marks the place of a macro call, so that a label on the call is defined there; the expanded statements
+// follow it.
+class MacroCall: public Statement
+{
+public:
+  MacroCall(SourcePos pos, const std::string& name) noexcept : Statement(pos), name_(name) { }
+
+  const std::string& name() const noexcept { return name_; }
+
+  void accept(StatementVisitor& visitor) override;
+  void dump(std::ostream& s, int level = 0) const noexcept override;
+
+private:
+  std::string name_;
+};
+
 // ----------------------------------------------------------------------------
 //      SymbolDefinition
 // ----------------------------------------------------------------------------
@@ -133,12 +157,13 @@ private:
 class Operation : public Statement
 {
 public:
-  Operation(SourcePos pos, Instruction& instruction) noexcept : Statement(pos), instruction_(instruction) { }
+  Operation(SourcePos pos, Instruction& instruction) noexcept : Statement(pos), instruction_(&instruction) { }
 
-  Instruction& instruction() const noexcept { return instruction_; }
+  Instruction& instruction() const noexcept { return *instruction_; }
+  void setInstruction(Instruction& instruction) noexcept { instruction_ = &instruction; }
 
 private:
-  Instruction& instruction_;
+  Instruction *instruction_;
 };
 
 // ----------------------------------------------------------------------------
@@ -349,20 +374,43 @@ private:
   std::string filename_;
 };
 
+// ----------------------------------------------------------------------------
+//      SegmentDirective
+// ----------------------------------------------------------------------------
+
+class SegmentDirective : public Directive
+{
+public:
+  SegmentDirective(SourcePos pos, const std::string& name) noexcept : Directive(pos), name_(name) { }
+
+  std::string name() const noexcept { return name_; }
+
+  void accept(StatementVisitor& visitor) override;
+  void dump(std::ostream& s, int level = 0) const noexcept override;
+
+private:
+  std::string name_;
+};
+
 // ----------------------------------------------------------------------------
 //      ByteDirective
 // ----------------------------------------------------------------------------
 
+// A list made up entirely of constants is packed into the bytes that it generates, and has no expressions.
 class ByteDirective : public Directive
 {
 public:
   ByteDirective(SourcePos pos, ByteSelector selector, std::vector<std::unique_ptr<Expression>> args) noexcept
     : Directive(pos), selector_(selector), args_(std::move(args)) { }
+  ByteDirective(SourcePos pos, ByteSelector selector, std::vector<Byte> values) noexcept
+    : Directive(pos), selector_(selector), values_(std::move(values)) { }
 
   ByteSelector selector() const noexcept { return selector_; }
-  ByteLength byteLength() const noexcept { return args_.size(); }
+  ByteLength byteLength() const noexcept { return isPacked() ? values_.size() : args_.size(); }
   const auto begin() const { return args_.begin(); }
   const auto end() const { return args_.end(); }
+  bool isPacked() const noexcept { return ! values_.empty(); }
+  const std::vector<Byte>& values() const noexcept { return values_; }
 
   void accept(StatementVisitor& visitor) override;
   void dump(std::ostream& s, int level = 0) const noexcept override;
@@ -370,27 +418,34 @@ public:
 private:
   ByteSelector selector_;
   std::vector<std::unique_ptr<Expression>> args_;
+  std::vector<Byte> values_;                  // Packed constants, already selected
 };
 
 // ----------------------------------------------------------------------------
 //      WordDirective
 // ----------------------------------------------------------------------------
 
+// As with ByteDirective, a list of constants is packed, here into little-endian bytes.
 class WordDirective : public Directive
 {
 public:
   WordDirective(SourcePos pos, std::vector<std::unique_ptr<Expression>> args) noexcept
     : Directive(pos), args_(std::move(args)) { }
+  WordDirective(SourcePos pos, std::vector<Byte> values) noexcept
+    : Directive(pos), values_(std::move(values)) { }
 
-  ByteLength byteLength() const noexcept { return args_.size() * 2; }
+  ByteLength byteLength() const noexcept { return isPacked() ? values_.size() : args_.size() * 2; }
   const auto begin() const { return args_.begin(); }
   const auto end() const { return args_.end(); }
+  bool isPacked() const noexcept { return ! values_.empty(); }
+  const std::vector<Byte>& values() const noexcept { return values_; }
 
   void accept(StatementVisitor& visitor) override;
   void dump(std::ostream& s, int level = 0) const noexcept override;
 
 private:
   std::vector<std::unique_ptr<Expression>> args_;
+  std::vector<Byte> values_;
 };
 
 // ----------------------------------------------------------------------------
@@ -436,6 +491,98 @@ private:
   std::vector<Byte> args_;
 };
 
+// ----------------------------------------------------------------------------
+//      FillDirective
+// ----------------------------------------------------------------------------
+
+// Generates count bytes from an expression in which the index symbol stands for the position of each
+// byte in the table.
+class FillDirective : public Directive
+{
+public:
+  FillDirective(SourcePos pos, ByteSelector selector, std::unique_ptr<Expression> count,
+                std::unique_ptr<Expression> value, const std::string& index) noexcept
+    : Directive(pos), selector_(selector), count_(std::move(count)), value_(std::move(value)), index_(index) { }
+
+  ByteSelector selector() const noexcept { return selector_; }
+  Expression& count() const noexcept { return *count_; }
+  Expression& value() const noexcept { return *value_; }
+  const std::string& index() const noexcept { return index_; }
+
+  void accept(StatementVisitor& visitor) override;
+  void dump(std::ostream& s, int level = 0) const noexcept override;
+
+private:
+  ByteSelector selector_;
+  std::unique_ptr<Expression> count_;
+  std::unique_ptr<Expression> value_;
+  std::string index_;
+};
+
+// ----------------------------------------------------------------------------
+//      TableDirective
+// ----------------------------------------------------------------------------
+
+enum class TableFunction
+{
+  Sine,
+  Cosine,
+
+  _End
+};
+
+Maybe<TableFunction> tableFunctionNamed(const std::string& name) noexcept;
+
+// Generates count bytes of offset + amplitude * f(2 * pi * index / count), rounded to the nearest integer.
+// Values from -128 to -1 are stored in two's complement, so that signed tables can be centered on zero.
+class TableDirective : public Directive
+{
+public:
+  TableDirective(SourcePos pos, TableFunction function, std::unique_ptr<Expression> count,
+                 std::unique_ptr<Expression> amplitude, std::unique_ptr<Expression> offset) noexcept
+    : Directive(pos), function_(function), count_(std::move(count)), amplitude_(std::move(amplitude)),
+      offset_(std::move(offset)) { }
+
+  TableFunction function() const noexcept { return function_; }
+  Expression& count() const noexcept { return *count_; }
+  Expression& amplitude() const noexcept { return *amplitude_; }
+  const Expression *offset() const noexcept { return offset_.get(); }
+
+  void accept(StatementVisitor& visitor) override;
+  void dump(std::ostream& s, int level = 0) const noexcept override;
+
+private:
+  TableFunction function_;
+  std::unique_ptr<Expression> count_;
+  std::unique_ptr<Expression> amplitude_;
+  std::unique_ptr<Expression> offset_;        // Optional
+};
+
+// ----------------------------------------------------------------------------
+//      IncbinDirective
+// ----------------------------------------------------------------------------
+
+// Copies length bytes, starting at offset, from a file that is mapped into memory.
+class IncbinDirective : public Directive
+{
+public:
+  IncbinDirective(SourcePos pos, std::shared_ptr<const MappedFile> file, size_t offset, ByteLength length) noexcept
+    : Directive(pos), file_(std::move(file)), offset_(offset), length_(length) { }
+
+  const MappedFile& file() const noexcept { return *file_; }
+  size_t offset() const noexcept { return offset_; }
+  ByteLength byteLength() const noexcept { return length_; }
+  const Byte *data() const noexcept { return file_->data() + offset_; }
+
+  void accept(StatementVisitor& visitor) override;
+  void dump(std::ostream& s, int level = 0) const noexcept override;
+
+private:
+  std::shared_ptr<const MappedFile> file_;    // Shared by every directive that includes the same file
+  size_t offset_;
+  ByteLength length_;
+};
+
 // ----------------------------------------------------------------------------
 //      IfDirective
 // ----------------------------------------------------------------------------
@@ -516,6 +663,94 @@ public:
   void dump(std::ostream& s, int level = 0) const noexcept override;
 };
 
+// ----------------------------------------------------------------------------
+//      OptimizeDirective
+// ----------------------------------------------------------------------------
+
+class OptimizeDirective : public Directive
+{
+public:
+  OptimizeDirective(SourcePos pos, const std::string& option, bool enabled) noexcept
+    : Directive(pos), option_(option), enabled_(enabled) { }
+
+  std::string option() const noexcept { return option_; }
+  bool isEnabled() const noexcept { return enabled_; }
+
+  void accept(StatementVisitor& visitor) override;
+  void dump(std::ostream& s, int level = 0) const noexcept override;
+
+private:
+  std::string option_;
+  bool enabled_;
+};
+
+// ----------------------------------------------------------------------------
+//      CpuDirective
+// ----------------------------------------------------------------------------
+
+class CpuDirective : public Directive
+{
+public:
+  CpuDirective(SourcePos pos, Cpu cpu) noexcept : Directive(pos), cpu_(cpu) { }
+
+  Cpu cpu() const noexcept { return cpu_; }
+
+  void accept(StatementVisitor& visitor) override;
+  void dump(std::ostream& s, int level = 0) const noexcept override;
+
+private:
+  Cpu cpu_;
+};
+
+// ----------------------------------------------------------------------------
+//      BudgetBeginDirective
+// ----------------------------------------------------------------------------
+
+class BudgetBeginDirective : public Directive
+{
+public:
+  BudgetBeginDirective(SourcePos pos, std::unique_ptr<Expression> expr) noexcept
+    : Directive(pos), expr_(std::move(expr)), budget_(0), cycles_(0), worstCase_(false), checked_(false) { }
+
+  Expression& expr() const noexcept { return *expr_; }
+
+  // Filled in by the budget check once the enclosed code has been generated.
+  void setResult(int budget, int cycles, bool worstCase) noexcept
+  {
+    budget_ = budget;
+    cycles_ = cycles;
+    worstCase_ = worstCase;
+    checked_ = true;
+  }
+  bool isChecked() const noexcept { return checked_; }
+  int budget() const noexcept { return budget_; }
+  int cycles() const noexcept { return cycles_; }
+  bool isWorstCase() const noexcept { return worstCase_; }
+
+  void accept(StatementVisitor& visitor) override;
+  void dump(std::ostream& s, int level = 0) const noexcept override;
+
+private:
+  std::unique_ptr<Expression> expr_;
+  int budget_;
+  int cycles_;
+  bool worstCase_;
+  bool checked_;
+};
+
+// ----------------------------------------------------------------------------
+//      BudgetEndDirective
+// ----------------------------------------------------------------------------
+
+class BudgetEndDirective : public Directive
+{
+public:
+  BudgetEndDirective(SourcePos pos) noexcept : Directive(pos) { }
+
+  void accept(StatementVisitor& visitor) override;
+  void dump(std::ostream& s, int level = 0) const noexcept override;
+};
+
 // ----------------------------------------------------------------------------
 //      StatementVisitor
 // ----------------------------------------------------------------------------
@@ -523,6 +758,7 @@ public:
 class StatementVisitor
 {
 public:
+  virtual void visit(MacroCall& node) { }
   virtual void visit(SymbolDefinition& node) { }
   virtual void visit(ProgramCounterAssignment& node) { }
   virtual void visit(ImpliedOperation& node) { }
@@ -536,15 +772,23 @@ public:
   virtual void visit(OffsetBeginDirective& node) { }
   virtual void visit(OffsetEndDirective& node) { }
   virtual void visit(ObjectFileDirective& node) { }
+  virtual void visit(SegmentDirective& node) { }
   virtual void visit(ByteDirective& node) { }
   virtual void visit(WordDirective& node) { }
   virtual void visit(StringDirective& node) { }
   virtual void visit(BitmapDirective& node) { }
+  virtual void visit(FillDirective& node) { }
+  virtual void visit(TableDirective& node) { }
+  virtual void visit(IncbinDirective& node) { }
   virtual void visit(IfDirective& node) { }
   virtual void visit(IfdefDirective& node) { }
   virtual void visit(ElseDirective& node) { }
   virtual void visit(EndifDirective& node) { }
   virtual void visit(EndDirective& node) { }
+  virtual void visit(OptimizeDirective& node) { }
+  virtual void visit(CpuDirective& node) { }
+  virtual void visit(BudgetBeginDirective& node) { }
+  virtual void visit(BudgetEndDirective& node) { }
 
   virtual bool before(Statement& node) { return true; }         // Return false to skip visitation for this node only
   virtual void after(Statement& node) { }
@@ -559,6 +803,7 @@ class StatementList
 {
 public:
   void add(std::unique_ptr<Statement> statement) noexcept;
+  void remove(const std::unordered_set<const Statement *>& statements) noexcept;
 
   void accept(StatementVisitor& visitor) const;
   void dump(std::ostream& s, int level = 0) const noexcept;
@@ -579,8 +824,11 @@ class Expression : public Node
 public:
   Expression(SourcePos pos, std::unique_ptr<ExprNode> root) : Node(pos), root_(std::move(root)) { }
 
-  Maybe<Address> tryEval(Context& context);
-  Address eval(Context& context);
+  Maybe<Address> value() const noexcept;       // Only for an expression that is a single constant
+  Maybe<Address> tryEval(Context& context) const;
+  Address eval(Context& context) const;
+  RelocationTerm term(Context& context) const;
+  void walk(const std::function<void (const ExprNode& node)>& f) const;
 
   void dump(std::ostream& s, int level = 0) const noexcept override;
 
@@ -597,8 +845,13 @@ class ExprNode : public Node
 public:
   ExprNode(SourcePos pos) : Node(pos) { }
 
+  // Evaluation never modifies the tree, so an expression may be evaluated again after the layout changes.
   virtual Maybe<Address> value() const noexcept { return nullptr; }
-  virtual std::unique_ptr<ExprNode> eval(Context& context, bool throwUndefined) { return nullptr; }
+  virtual std::unique_ptr<ExprNode> eval(Context& context, bool throwUndefined) const { return nullptr; }
+  virtual RelocationTerm term(Context& context) const { return {}; }
+
+  // Calls f for this node and then for each node beneath it.
+  virtual void walk(const std::function<void (const ExprNode& node)>& f) const { f(*this); }
 };
 
 // ----------------------------------------------------------------------------
@@ -626,7 +879,10 @@ class ExprSymbol : public ExprNode
 public:
   ExprSymbol(SourcePos pos, const std::string& name) : ExprNode(pos), name_(name) { }
 
-  std::unique_ptr<ExprNode> eval(Context& context, bool throwUndefined) override;
+  const std::string& name() const noexcept { return name_; }
+
+  std::unique_ptr<ExprNode> eval(Context& context, bool throwUndefined) const override;
+  RelocationTerm term(Context& context) const override;
   void dump(std::ostream& s, int indent = 0) const noexcept override;
 
 private:
@@ -643,7 +899,8 @@ public:
   ExprTemporarySymbol(SourcePos pos, int labelDelta)
     : ExprNode(pos), labelDelta_(labelDelta) { }
 
-  std::unique_ptr<ExprNode> eval(Context& context, bool throwUndefined) override;
+  std::unique_ptr<ExprNode> eval(Context& context, bool throwUndefined) const override;
+  RelocationTerm term(Context& context) const override;
   void dump(std::ostream& s, int indent = 0) const noexcept override;
 
 private:
@@ -659,7 +916,8 @@ class ExprProgramCounter : public ExprNode
 public:
   ExprProgramCounter(SourcePos pos) : ExprNode(pos) { }
 
-  std::unique_ptr<ExprNode> eval(Context& context, bool throwUndefined) override;
+  std::unique_ptr<ExprNode> eval(Context& context, bool throwUndefined) const override;
+  RelocationTerm term(Context& context) const override;
   void dump(std::ostream& s, int indent = 0) const noexcept override;
 };
 
@@ -673,7 +931,9 @@ public:
   ExprOperator(SourcePos pos, std::unique_ptr<ExprNode> left, std::unique_ptr<ExprNode> right, char op)
     : ExprNode(pos), left_(std::move(left)), right_(std::move(right)), op_(op) { }
 
-  std::unique_ptr<ExprNode> eval(Context& context, bool throwUndefined) override;
+  std::unique_ptr<ExprNode> eval(Context& context, bool throwUndefined) const override;
+  RelocationTerm term(Context& context) const override;
+  void walk(const std::function<void (const ExprNode& node)>& f) const override;
   void dump(std::ostream& s, int indent = 0) const noexcept override;
 
 private:
@@ -0,0 +1,307 @@
+// Copyright (c) 2018 Robert A. Stoerrle
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+// REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+// AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+// INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+// LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+// OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+#include <iostream>
+#include <algorithm>
+#include <unordered_map>
+#include "budget.h"
+#include "simulator.h"
+#include "context.h"
+#include "ast.h"
+
+namespace as64
+{
+
+constexpr uint64_t MaxSimulatedCycles = 10000000;
+
+// ----------------------------------------------------------------------------
+//      BudgetPass
+// ----------------------------------------------------------------------------
+
+class BudgetPass : public StatementVisitor
+{
+public:
+  BudgetPass(Context& context);
+
+  void run();
+
+  void visit(ImpliedOperation& node) override;
+  void visit(ImmediateOperation& node) override;
+  void visit(AccumulatorOperation& node) override;
+  void visit(DirectOperation& node) override;
+  void visit(IndirectOperation& node) override;
+  void visit(BranchOperation& node) override;
+  void visit(CpuDirective& node) override;
+  void visit(BudgetBeginDirective& node) override;
+  void visit(BudgetEndDirective& node) override;
+
+  bool before(Statement& node) override;
+  bool uncaught(SourceError& err) override;
+
+private:
+  struct Region
+  {
+    BudgetBeginDirective *node;
+    Cpu cpu;
+    std::vector<Operation *> operations;
+  };
+
+  void add(Operation& node) noexcept;
+  void check(Region& region, Address start, Address end);
+  Maybe<int> worstCase(const Region& region, Address start, Address end) const noexcept;
+  int simulate(Cpu cpu, Address start, Address end);
+
+  Context& context_;
+  Cpu cpu_;
+  std::vector<Region> regions_;
+};
+
+BudgetPass::BudgetPass(Context& context)
+  : context_(context), cpu_(context.cpu)
+{
+}
+
+void BudgetPass::run()
+{
+  context_.statements.accept(*this);
+  for (const auto& region: regions_)
+    context_.messages.error(region.node->pos(), "Missing .endbudget");
+}
+
+bool BudgetPass::before(Statement& node)
+{
+  context_.pc = node.pc();
+  return ! node.isSkipped();
+}
+
+void BudgetPass::visit(ImpliedOperation& node)
+{
+  add(node);
+}
+
+void BudgetPass::visit(ImmediateOperation& node)
+{
+  add(node);
+}
+
+void BudgetPass::visit(AccumulatorOperation& node)
+{
+  add(node);
+}
+
+void BudgetPass::visit(DirectOperation& node)
+{
+  add(node);
+}
+
+void BudgetPass::visit(IndirectOperation& node)
+{
+  add(node);
+}
+
+void BudgetPass::visit(BranchOperation& node)
+{
+  add(node);
+}
+
+void BudgetPass::visit(CpuDirective& node)
+{
+  cpu_ = node.cpu();
+}
+
+void BudgetPass::visit(BudgetBeginDirective& node)
+{
+  regions_.push_back({ &node, cpu_, { } });
+}
+
+void BudgetPass::visit(BudgetEndDirective& node)
+{
+  if (regions_.empty())
+    throwSourceError(node.pos(), "Missing .budget");
+
+  auto region = std::move(regions_.back());
+  regions_.pop_back();
+  check(region, region.node->pc(), node.pc());
+
+  // Enclosing regions include everything inside this one.
+  if (! regions_.empty())
+  {
+    auto& outer = regions_.back().operations;
+    outer.insert(std::end(outer), std::begin(region.operations), std::end(region.operations));
+  }
+}
+
+bool BudgetPass::uncaught(SourceError& err)
+{
+  context_.messages.add(err.isFatal() ? Severity::FatalError : Severity::Error, err.pos(), err.message());
+  return ! err.isFatal();
+}
+
+void BudgetPass::add(Operation& node) noexcept
+{
+  if (! regions_.empty())
+    regions_.back().operations.push_back(&node);
+}
+
+void BudgetPass::check(Region& region, Address start, Address end)
+{
+  context_.pc = region.node->pc();
+  int budget = region.node->expr().eval(context_);
+
+  // Straight-line code and forward branches get an exact worst case; anything with a loop or
+  // a subroutine call has to be run. A single run starts from whatever the simulator holds, so it
+  // can only show that the budget is exceeded, never that it is kept.
+  int cycles;
+  bool isWorstCase;
+  auto maximum = worstCase(region, start, end);
+  if (maximum.hasValue())
+  {
+    cycles = *maximum;
+    isWorstCase = true;
+  }
+  else
+  {
+    try
+    {
+      cycles = simulate(region.cpu, start, end);
+      isWorstCase = false;
+    }
+    catch (SimulationError& err)
+    {
+      throwSourceError(region.node->pos(), "%s", err.message().c_str());
+    }
+  }
+
+  region.node->setResult(budget, cycles, isWorstCase);
+  if (cycles > budget)
+  {
+    context_.messages.error(region.node->pos(), "Cycle budget exceeded: %d cycle(s) %s, budget is %d", cycles,
+                            isWorstCase ? "worst case" : "simulated", budget);
+  }
+  else if (! isWorstCase)
+  {
+    context_.messages.warning(region.node->pos(), "The worst case of a region with a loop, a subroutine call or "
+                              "an indirect jump is unknown; one simulated run took %d of %d cycle(s)", cycles, budget);
+  }
+}
+
+Maybe<int> BudgetPass::worstCase(const Region& region, Address start, Address end) const noexcept
+{
+  std::unordered_map<Address, size_t> indexOf;
+  for (size_t i = 0; i < region.operations.size(); ++ i)
+    indexOf[region.operations[i]->pc()] = i;
+
+  // Costs are accumulated backwards, so every forward edge already has the cost of the rest of the path.
+  std::vector<int> costs(region.operations.size());
+  auto costFrom = [&](Address addr) -> Maybe<int>
+  {
+    if (addr < start || addr >= end)
+      return 0;
+    auto i = indexOf.find(addr);
+    if (i == std::end(indexOf))
+      return nullptr;
+    return costs[i->second];
+  };
+
+  for (size_t i = region.operations.size(); i -- > 0;)
+  {
+    const auto *node = region.operations[i];
+    auto range = node->range();
+    if (! range.length())
+      return nullptr;
+
+    Opcode opcode = range[0];
+    auto name = node->instruction().name();
+    Address pc = node->pc();
+    Address next = pc + range.length();
+    int cost = cycleCount(opcode, region.cpu) + (hasPageCrossingPenalty(opcode, region.cpu) ? 1 : 0);
+
+    if (name == "jsr" || dynamic_cast<const IndirectOperation *>(node))
+      return nullptr;
+    if (name == "rts" || name == "rti" || name == "brk" || name == "rtl" || name == "stp")
+    {
+      costs[i] = cost;
+      continue;
+    }
+
+    Maybe<int> rest;
+    if (name == "bra")
+    {
+      Address target = next + static_cast<SByte>(range[1]);
+      if (target >= start && target <= pc)
+        return nullptr;
+      auto taken = costFrom(target);
+      if (! taken.hasValue())
+        return nullptr;
+      rest = *taken + ((target & 0xff00) != (next & 0xff00) ? 2 : 1);
+    }
+    else if (dynamic_cast<const BranchOperation *>(node))
+    {
+      Address target = next + static_cast<SByte>(range[1]);
+      if (target >= start && target <= pc)
+        return nullptr;
+      auto taken = costFrom(target);
+      auto notTaken = costFrom(next);
+      if (! taken.hasValue() || ! notTaken.hasValue())
+        return nullptr;
+      int penalty = (target & 0xff00) != (next & 0xff00) ? 2 : 1;
+      rest = std::max(*taken + penalty, *notTaken);
+    }
+    else if (name == "jmp")
+    {
+      Address target = range[1] | (range[2] << 8);
+      if (target >= start && target <= pc)
+        return nullptr;
+      rest = costFrom(target);
+    }
+    else
+      rest = costFrom(next);
+
+    if (! rest.hasValue())
+      return nullptr;
+    costs[i] = cost + *rest;
+  }
+
+  return costFrom(start);
+}
+
+int BudgetPass::simulate(Cpu cpu, Address start, Address end)
+{
+  Simulator sim(cpu);
+  for (const auto& buffer: context_.buffers)
+    sim.load(*buffer);
+
+  // Subroutines called from within the region are followed until they return to it.
+  auto jsr = instructionNamed("jsr", cpu)->opcode(AddrMode::Absolute);
+  sim.call(start);
+  while (! sim.isHalted() && sim.pc() >= start && sim.pc() < end)
+  {
+    auto s = sim.s();
+    bool isCall = sim.read(sim.pc()) == jsr;
+    sim.step();
+    while (isCall && ! sim.isHalted() && sim.s() < s && sim.cycles() <= MaxSimulatedCycles)
+      sim.step();
+    if (sim.cycles() > MaxSimulatedCycles)
+      throw SimulationError("Code did not leave the budget region within " + std::to_string(MaxSimulatedCycles) + " cycles");
+  }
+  return sim.cycles();
+}
+
+void checkBudgets(Context& context)
+{
+  BudgetPass pass(context);
+  pass.run();
+}
+
+}
@@ -0,0 +1,13 @@
+#ifndef _INCLUDED_AS64_BUDGET_H
+#define _INCLUDED_AS64_BUDGET_H
+
+namespace as64
+{
+
+class Context;
+
+void checkBudgets(Context& context);
+
+
+}
+#endif
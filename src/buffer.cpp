@@ -13,10 +13,11 @@
 // PERFORMANCE OF THIS SOFTWARE.
 
 #include <iostream>
-#include <fstream>
 #include <sstream>
+#include <algorithm>
 #include "str.h"
 #include "path.h"
+#include "file.h"
 #include "error.h"
 #include "buffer.h"
 
@@ -55,29 +56,37 @@ void CodeBuffer::fill(Offset offset, ByteLength count, Byte value) noexcept
   std::fill(&data_[offset], &data_[endOffset], value);
 }
 
+void CodeBuffer::writeBytes(Offset offset, const std::vector<Byte>& values) noexcept
+{
+  writeBytes(offset, values.data(), values.size());
+}
+
+void CodeBuffer::writeBytes(Offset offset, const Byte *values, ByteLength count) noexcept
+{
+  auto endOffset = offset + count;
+  if (endOffset > data_.size())
+    data_.resize(endOffset);
+  std::copy(values, values + count, std::begin(data_) + offset);
+}
+
 void CodeBuffer::write(std::ostream& s, bool withOriginPrefix) const noexcept
 {
   if (withOriginPrefix)
   {
-    char c1 = origin_, c2 = origin_ >> 8;
-    s.write(&c1, 1);
-    s.write(&c2, 1);
+    char prefix[] = { static_cast<char>(origin_), static_cast<char>(origin_ >> 8) };
+    s.write(prefix, sizeof(prefix));
   }
-  s.write(reinterpret_cast<const char *>(&data_[0]), data_.size());
+  s.write(reinterpret_cast<const char *>(data_.data()), data_.size());
 }
 
-void CodeBuffer::save(const std::string& pathPrefix, bool withOriginPrefix) const
+bool CodeBuffer::save(const std::string& pathPrefix, bool withOriginPrefix) const
 {
-  std::string filename = joinPath(pathPrefix, filename_);
-  std::ofstream s(filename);
-  if (! s.is_open())
-    throw SystemError(filename);
-
-  write(s, withOriginPrefix);
-
-  s.close();
-  if (s.bad())
-    throw SystemError(filename);
+  Byte prefix[] = { static_cast<Byte>(origin_), static_cast<Byte>(origin_ >> 8) };
+  std::vector<FileChunk> chunks;
+  if (withOriginPrefix)
+    chunks.push_back({ prefix, sizeof(prefix) });
+  chunks.push_back({ data_.data(), data_.size() });
+  return saveFile(joinPath(pathPrefix, filename_), chunks);
 }
 
 // ----------------------------------------------------------------------------
@@ -89,10 +98,10 @@ CodeWriter::CodeWriter(CodeBuffer *buffer) noexcept
 {
 }
 
-void CodeWriter::attach(CodeBuffer *buffer) noexcept
+void CodeWriter::attach(CodeBuffer *buffer, Offset offset) noexcept
 {
   buffer_ = buffer;
-  offset_ = 0;
+  offset_ = offset;
 }
 
 // ----------------------------------------------------------------------------
@@ -26,13 +26,16 @@ public:
   bool isEmpty() const noexcept { return data_.empty(); }
   ByteLength size() const noexcept { return data_.size(); }
   Byte operator[](Offset offset) const noexcept { return data_[offset]; }
+  const std::vector<Byte>& data() const noexcept { return data_; }
 
   void writeByte(Offset offset, Byte value) noexcept;
   void writeWord(Offset offset, Word value) noexcept;
   void fill(ByteLength offset, ByteLength count, Byte value = 0) noexcept;
+  void writeBytes(Offset offset, const std::vector<Byte>& values) noexcept;
+  void writeBytes(Offset offset, const Byte *values, ByteLength count) noexcept;
 
   void write(std::ostream& c, bool withOriginPrefix = true) const noexcept;
-  void save(const std::string& pathPrefix = "", bool withOriginPrefix = true) const;
+  bool save(const std::string& pathPrefix = "", bool withOriginPrefix = true) const;
 
 private:
   Address origin_;
@@ -51,11 +54,13 @@ public:
 
   Offset offset() const noexcept { return offset_; }
   CodeBuffer *buffer() const noexcept { return buffer_; }
-  void attach(CodeBuffer *buffer) noexcept;
+  void attach(CodeBuffer *buffer, Offset offset = 0) noexcept;
 
   void byte(Byte value) noexcept;
   void word(Word value) noexcept;
   void fill(ByteLength count, Byte value = 0) noexcept;
+  void bytes(const std::vector<Byte>& values) noexcept;
+  void bytes(const Byte *values, ByteLength count) noexcept;
 
 private:
   CodeBuffer *buffer_;
@@ -83,6 +88,20 @@ inline void CodeWriter::fill(ByteLength count, Byte value) noexcept
   offset_ += count;
 }
 
+inline void CodeWriter::bytes(const std::vector<Byte>& values) noexcept
+{
+  assert(buffer_ != nullptr);
+  buffer_->writeBytes(offset_, values);
+  offset_ += values.size();
+}
+
+inline void CodeWriter::bytes(const Byte *values, ByteLength count) noexcept
+{
+  assert(buffer_ != nullptr);
+  buffer_->writeBytes(offset_, values, count);
+  offset_ += count;
+}
+
 // ----------------------------------------------------------------------------
 //      CodeRange
 // ----------------------------------------------------------------------------
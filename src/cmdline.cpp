@@ -12,6 +12,7 @@
 // OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
 // PERFORMANCE OF THIS SOFTWARE.
 
+#include <cstring>
 #include "cmdline.h"
 
 namespace as64
@@ -27,7 +28,30 @@ std::vector<std::string> parseCommandLine(int argc, char **argv, std::initialize
   for (int index = 1; index < argc; ++ index)
   { 
     const char *p = argv[index];
-    if (*p == '-')
+    if (p[0] == '-' && p[1] == '-')
+    {
+      p += 2;
+      const char *value = std::strchr(p, '=');
+      size_t length = value ? value - p : std::strlen(p);
+      for (const auto& option: options)
+      {
+        if (option.longName && std::strlen(option.longName) == length && std::strncmp(p, option.longName, length) == 0)
+        {
+          if (! option.hasArg)
+            option.handler("");
+          else if (value)
+            option.handler(value + 1);
+          else
+          {
+            ++ index;
+            if (index < argc)
+              option.handler(argv[index]);
+          }
+          break;
+        }
+      }
+    }
+    else if (*p == '-')
     {
       ++ p;
       bool cont;
@@ -36,7 +60,7 @@ std::vector<std::string> parseCommandLine(int argc, char **argv, std::initialize
         cont = false;
         for (const auto& option: options)
         {
-          if (*p == option.name)
+          if (option.name && *p == option.name)
           {
             ++ p;
             if (! option.hasArg)
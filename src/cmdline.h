@@ -20,6 +20,7 @@ struct Option
   char name;
   bool hasArg;
   OptionHandler handler;
+  const char *longName;                       // Matches --longName[=value] when not null
 };
 
 std::vector<std::string> parseCommandLine(int argc, char **argv, std::initializer_list<Option> options);
@@ -3,11 +3,15 @@
 
 #include <memory>
 #include <vector>
+#include <string>
+#include <unordered_map>
 #include "source.h"
 #include "ast.h"
 #include "message.h"
 #include "symbol.h"
 #include "buffer.h"
+#include "layout.h"
+#include "object.h"
 
 namespace as64
 {
@@ -18,15 +22,42 @@ namespace as64
 
 struct Context
 {
-  Context() : pc(0) { }
+  Context() : cpu(Cpu::Mos6502), pc(0), indexName(nullptr), index(0), relocatable(false), importing(false),
+              segment(nullptr) { }
 
   SourceStream source;
   StatementList statements;
   MessageList messages;
   SymbolTable symbols;
   std::vector<std::unique_ptr<CodeBuffer>> buffers;
+  Layout layout;
 
+  Cpu cpu;                                    // Instruction set in effect at the start of the source
   ProgramCounter pc;
+
+  // Symbol definitions are evaluated when their value is first needed (see lookupSymbol). Each keeps the
+  // serial number it was given in the definition pass, so that the symbol table stays in declaration order.
+  // A definition found to be circular keeps the error, which every later use reports again.
+  struct LazyDefinition
+  {
+    const SymbolDefinition *node;
+    int serialNum;
+    std::shared_ptr<const SourceError> failure;
+  };
+  std::unordered_map<std::string, LazyDefinition> definitions;
+  std::vector<std::string> evaluating;        // Definitions being evaluated, innermost last
+
+  // While a .fill expression is evaluated, its index symbol stands for the position in the table.
+  const std::string *indexName;
+  Address index;
+
+  // Only used when assembling an object module.
+  bool relocatable;
+  bool importing;                             // Undefined symbols evaluate to ImportAddress
+  const Segment *segment;                     // Segment that the program counter is in
+  std::unordered_map<std::string, RelocationTerm> symbolTerms;
+  std::vector<Relocation> relocations;
+  std::vector<CodeRange> segmentRanges;       // Where each segment was emitted, by layout index
 };
 
 }
@@ -0,0 +1,339 @@
+// Copyright (c) 2018 Robert A. Stoerrle
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+// REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+// AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+// INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+// LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+// OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+#include <iostream>
+#include <algorithm>
+#include <cstdio>
+#include "crunch.h"
+#include "parser.h"
+#include "define.h"
+#include "emit.h"
+#include "context.h"
+
+namespace as64
+{
+
+constexpr int MinMatch = 3;
+constexpr int MaxMatch = 128;
+constexpr int MaxLiteralRun = 128;
+constexpr int MaxOffset = 0xffff;
+constexpr int MaxChainDepth = 256;
+constexpr Byte MatchToken = 0x80;
+constexpr Byte EndToken = 0xff;
+
+// The decruncher is assembled with the assembler itself, at whatever address it has to run from. The
+// symbols stub, dest, entry, size and pages are defined before it is parsed.
+static const char *g_decruncher = R"(
+src     = $fb
+dst     = $fd
+ref     = $f7
+
+        .org $0801
+        .word link, 10
+        .byte $9e
+        .asc "2061"
+        .byte 0
+link    .word 0
+
+        ; Move the decruncher into place.
+        ldx #decrEnd - stub
+-       lda image - 1,x
+        sta stub - 1,x
+        dex
+        bne -
+        jmp stub
+
+image   .off stub
+        ; Bank out BASIC and move the packed data up so that it ends at the decruncher.
+        lda #$36
+        sta $01
+        lda #<payload + size - 256
+        sta src
+        lda #>payload + size - 256
+        sta src + 1
+        lda #<stub - 256
+        sta dst
+        lda #>stub - 256
+        sta dst + 1
+        ldx #pages
+page    ldy #$ff
+-       lda (src),y
+        sta (dst),y
+        dey
+        cpy #$ff
+        bne -
+        dec src + 1
+        dec dst + 1
+        dex
+        bne page
+
+        lda #<stub - size
+        sta src
+        lda #>stub - size
+        sta src + 1
+        lda #<dest
+        sta dst
+        lda #>dest
+        sta dst + 1
+
+next    ldy #0
+        lda (src),y
+        inc src
+        bne +
+        inc src + 1
++       cmp #$80
+        bcs match
+        tax
+-       lda (src),y
+        sta (dst),y
+        iny
+        dex
+        bpl -
+        tya
+        clc
+        adc src
+        sta src
+        bcc advance
+        inc src + 1
+        bcs advance
+
+match   cmp #$ff
+        beq done
+        and #$7f
+        tax
+        inx
+        inx
+        sec
+        lda dst
+        sbc (src),y
+        sta ref
+        iny
+        lda dst + 1
+        sbc (src),y
+        sta ref + 1
+        lda src
+        clc
+        adc #2
+        sta src
+        bcc +
+        inc src + 1
++       ldy #0
+-       lda (ref),y
+        sta (dst),y
+        iny
+        dex
+        bpl -
+
+advance tya
+        clc
+        adc dst
+        sta dst
+        bcc next
+        inc dst + 1
+        bcs next
+
+done    lda #$37
+        sta $01
+        jmp entry
+decrEnd .ofe
+
+payload = image + decrEnd - stub
+)";
+
+// ----------------------------------------------------------------------------
+//      Cruncher
+// ----------------------------------------------------------------------------
+
+struct CrunchStats
+{
+  CrunchStats() noexcept : literalRuns(0), literals(0), matches(0), matchedBytes(0) { }
+
+  int literalRuns;
+  int literals;
+  int matches;
+  int matchedBytes;
+};
+
+static std::vector<Byte> crunch(const std::vector<Byte>& data, CrunchStats& stats) noexcept
+{
+  int size = data.size();
+
+  // Hash chains over three-byte prefixes give the longest match at each position, preferring the
+  // nearest one; the search order is fixed, so the output depends only on the input.
+  std::vector<int> matchLength(size, 0), matchOffset(size, 0);
+  std::vector<int> head(0x10000, -1), prev(size, -1);
+  for (int i = 0; i + MinMatch <= size; ++ i)
+  {
+    int hash = (data[i] << 8 | data[i + 1]) ^ (data[i + 2] << 4);
+    int limit = std::min(MaxMatch, size - i);
+    int depth = 0;
+    for (int j = head[hash]; j >= 0 && i - j <= MaxOffset && depth < MaxChainDepth; j = prev[j], ++ depth)
+    {
+      int length = 0;
+      while (length < limit && data[j + length] == data[i + length])
+        ++ length;
+      if (length > matchLength[i])
+      {
+        matchLength[i] = length;
+        matchOffset[i] = i - j;
+        if (length == limit)
+          break;
+      }
+    }
+    prev[i] = head[hash];
+    head[hash] = i;
+  }
+
+  // Working back from the end, choose the cheapest way to encode the rest of the data from each position.
+  // A literal run of n bytes costs n+1 bytes and a match always costs three.
+  std::vector<int> cost(size + 1), choice(size + 1);
+  cost[size] = 1;
+  for (int i = size - 1; i >= 0; -- i)
+  {
+    cost[i] = INT32_MAX;
+    for (int length = 1; length <= MaxLiteralRun && i + length <= size; ++ length)
+    {
+      if (1 + length + cost[i + length] < cost[i])
+      {
+        cost[i] = 1 + length + cost[i + length];
+        choice[i] = -length;
+      }
+    }
+    for (int length = MinMatch; length <= matchLength[i]; ++ length)
+    {
+      if (3 + cost[i + length] < cost[i])
+      {
+        cost[i] = 3 + cost[i + length];
+        choice[i] = length;
+      }
+    }
+  }
+
+  std::vector<Byte> packed;
+  packed.reserve(cost[0]);
+  for (int i = 0; i < size; )
+  {
+    if (choice[i] < 0)
+    {
+      int length = -choice[i];
+      packed.push_back(length - 1);
+      packed.insert(std::end(packed), &data[i], &data[i] + length);
+      ++ stats.literalRuns;
+      stats.literals += length;
+      i += length;
+    }
+    else
+    {
+      int length = choice[i];
+      packed.push_back(MatchToken | (length - MinMatch));
+      packed.push_back(matchOffset[i]);
+      packed.push_back(matchOffset[i] >> 8);
+      ++ stats.matches;
+      stats.matchedBytes += length;
+      i += length;
+    }
+  }
+  packed.push_back(EndToken);
+  return packed;
+}
+
+std::vector<Byte> crunch(const std::vector<Byte>& data) noexcept
+{
+  CrunchStats stats;
+  return crunch(data, stats);
+}
+
+// Cycle counts are taken from the decruncher loops above and ignore page crossings. A self-extracting file also
+// pays for moving the decruncher and the packed data into place.
+static uint64_t decrunchCycles(const CrunchStats& stats, bool selfExtracting, int pages) noexcept
+{
+  uint64_t cycles = 34 + stats.literalRuns * 46 + stats.literals * 18 + stats.matches * 85 + stats.matchedBytes * 18;
+  if (selfExtracting)
+    cycles += 2200 + pages * 4624;
+  return cycles;
+}
+
+static std::unique_ptr<CodeBuffer> assembleDecruncher(const CodeBuffer& buffer, const CrunchOptions& options,
+                                                      ByteLength size, int pages, Address& payload)
+{
+  Context context;
+  context.symbols.set(Label("stub"), options.decruncherAddress);
+  context.symbols.set(Label("dest"), buffer.origin());
+  context.symbols.set(Label("entry"), options.entry.value(buffer.origin()));
+  context.symbols.set(Label("size"), size);
+  context.symbols.set(Label("pages"), pages);
+  parseText(context, "decruncher", g_decruncher);
+  define(context);
+  if (! context.messages.hasFatalError())
+    emit(context);
+  if (context.messages.errorCount() || context.buffers.size() != 1)
+    throw CrunchError("Failed to assemble the decruncher");
+
+  payload = lookupSymbol(context, "payload").value();
+  return std::move(context.buffers.front());
+}
+
+std::unique_ptr<CodeBuffer> crunch(const CodeBuffer& buffer, const CrunchOptions& options, std::ostream *report)
+{
+  CrunchStats stats;
+  auto packed = crunch(buffer.data(), stats);
+  int pages = (packed.size() + 255) / 256;
+
+  auto result = std::make_unique<CodeBuffer>();
+  CodeWriter writer(result.get());
+  if (options.selfExtracting)
+  {
+    Address payload;
+    auto stub = assembleDecruncher(buffer, options, packed.size(), pages, payload);
+
+    // The packed data is moved up to end just below the decruncher and unpacked forwards from there, so the
+    // unpacked data must end before the packed data begins.
+    char buf[256];
+    if (payload + packed.size() > options.decruncherAddress)
+    {
+      snprintf(buf, sizeof(buf), "Decruncher at $%04x must be above the end of the loaded file ($%04x)",
+               options.decruncherAddress, static_cast<int>(payload + packed.size()));
+      throw CrunchError(buf);
+    }
+    if (buffer.origin() + buffer.size() > options.decruncherAddress - packed.size())
+    {
+      snprintf(buf, sizeof(buf), "Unpacked data at $%04x-$%04x overlaps the packed data moved below the decruncher at $%04x",
+               buffer.origin(), buffer.origin() + buffer.size() - 1, options.decruncherAddress);
+      throw CrunchError(buf);
+    }
+
+    result->setOrigin(stub->origin());
+    for (auto value: stub->data())
+      writer.byte(value);
+  }
+  else
+    result->setOrigin(buffer.origin());
+
+  for (auto value: packed)
+    writer.byte(value);
+  result->setFilename(buffer.filename());
+
+  if (report)
+  {
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s: %d -> %d byte(s) (%.1f%%), about %llu cycle(s) to decrunch",
+             buffer.filename().c_str(), static_cast<int>(buffer.size()), static_cast<int>(packed.size()),
+             buffer.size() ? 100.0 * packed.size() / buffer.size() : 0.0,
+             static_cast<unsigned long long>(decrunchCycles(stats, options.selfExtracting, pages)));
+    *report << buf << std::endl;
+  }
+  return result;
+}
+
+}
@@ -0,0 +1,58 @@
+#ifndef _INCLUDED_AS64_CRUNCH_H
+#define _INCLUDED_AS64_CRUNCH_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <ostream>
+#include "types.h"
+#include "error.h"
+#include "buffer.h"
+
+namespace as64
+{
+
+// ----------------------------------------------------------------------------
+//      Cruncher
+// ----------------------------------------------------------------------------
+
+// The packed stream is a sequence of tokens:
+//
+//   $00-$7f    literal run; the next token+1 bytes are copied as they are
+//   $80-$fd    match; copies (token & $7f)+3 bytes starting at the 16-bit little-endian offset
+//              that follows, counted back from the current output position
+//   $ff        end of data
+//
+// A crunched file carries the address of the unpacked data in place of the load address. A self-extracting
+// file loads at $0801 and contains a BASIC line that starts the decruncher.
+
+struct CrunchOptions
+{
+  CrunchOptions() noexcept : selfExtracting(false), decruncherAddress(0xcf00) { }
+
+  bool selfExtracting;
+  Address decruncherAddress;
+  Maybe<Address> entry;                       // Defaults to the origin of each buffer
+};
+
+std::vector<Byte> crunch(const std::vector<Byte>& data) noexcept;
+std::unique_ptr<CodeBuffer> crunch(const CodeBuffer& buffer, const CrunchOptions& options, std::ostream *report = nullptr);
+
+// ----------------------------------------------------------------------------
+//      CrunchError
+// ----------------------------------------------------------------------------
+
+class CrunchError : public GeneralError
+{
+public:
+  CrunchError(const std::string& message) noexcept : message_(message) { }
+
+  const char *what() const noexcept override { return "Crunch Error"; }
+  std::string message() const noexcept override { return message_; }
+
+private:
+  std::string message_;
+};
+
+}
+#endif
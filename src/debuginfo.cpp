@@ -0,0 +1,169 @@
+// Copyright (c) 2018 Robert A. Stoerrle
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+// REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+// AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+// INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+// LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+// OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+#include <algorithm>
+#include <unordered_map>
+#include "str.h"
+#include "enum.h"
+#include "file.h"
+#include "context.h"
+#include "ast.h"
+#include "debuginfo.h"
+
+namespace as64
+{
+
+static EnumTags<DebugInfoFormat> g_debugInfoFormatTags =
+{
+  { DebugInfoFormat::Binary,      "bin" },
+  { DebugInfoFormat::Text,        "text" }
+};
+
+Maybe<DebugInfoFormat> debugInfoFormatNamed(const std::string& name) noexcept
+{
+  auto format = g_debugInfoFormatTags.fromName(toLowerCase(name), DebugInfoFormat::_End);
+  if (format == DebugInfoFormat::_End)
+    return nullptr;
+  return format;
+}
+
+static void appendNumber(std::string& out, unsigned value)
+{
+  do
+  {
+    auto byte = value & 0x7f;
+    value >>= 7;
+    out += static_cast<char>(value ? byte | 0x80 : byte);
+  }
+  while (value);
+}
+
+static void appendHex(std::string& out, unsigned value)
+{
+  int digits = 4;
+  while (digits < 8 && (value >> (digits * 4)))
+    ++ digits;
+  for (int shift = (digits - 1) * 4; shift >= 0; shift -= 4)
+    out += "0123456789abcdef"[(value >> shift) & 0x0f];
+}
+
+// ----------------------------------------------------------------------------
+//      DebugInfo
+// ----------------------------------------------------------------------------
+
+DebugInfo::DebugInfo(const Context& context, const CodeBuffer& buffer)
+{
+  std::unordered_map<int, int> fileIndexes;
+  for (const auto& node: context.statements)
+  {
+    auto range = node->range();
+    const auto *line = node->pos().line();
+    if (range.buffer() != &buffer || ! range.length() || ! line)
+      continue;
+
+    auto i = fileIndexes.find(line->fileIndex());
+    if (i == std::end(fileIndexes))
+    {
+      i = fileIndexes.insert({ line->fileIndex(), static_cast<int>(filenames_.size()) }).first;
+      filenames_.push_back(line->filename());
+    }
+    entries_.push_back({ node->pc(), range.length(), i->second, line->lineNumber() });
+  }
+
+  std::stable_sort(std::begin(entries_), std::end(entries_), [](const auto& a, const auto& b)
+  {
+    return a.pc < b.pc;
+  });
+
+  // Adjacent statements from the same line, such as a label on a line of its own followed by data, become a
+  // single entry. Code assembled twice at one address keeps only the first entry.
+  std::vector<Entry> merged;
+  merged.reserve(entries_.size());
+  for (const auto& entry: entries_)
+  {
+    if (! merged.empty())
+    {
+      auto& last = merged.back();
+      if (entry.pc < last.pc + last.length)
+        continue;
+      if (entry.pc == last.pc + last.length && entry.fileIndex == last.fileIndex &&
+          entry.lineNumber == last.lineNumber)
+      {
+        last.length += entry.length;
+        continue;
+      }
+    }
+    merged.push_back(entry);
+  }
+  entries_ = std::move(merged);
+}
+
+void DebugInfo::write(std::string& out, DebugInfoFormat format) const
+{
+  if (format == DebugInfoFormat::Text)
+    writeText(out);
+  else
+    writeBinary(out);
+}
+
+void DebugInfo::writeBinary(std::string& out) const
+{
+  out.append("AS64DBG", 8);
+  out += static_cast<char>(1);
+  appendNumber(out, static_cast<unsigned>(filenames_.size()));
+  for (const auto& filename: filenames_)
+  {
+    appendNumber(out, static_cast<unsigned>(filename.length()));
+    out += filename;
+  }
+
+  appendNumber(out, static_cast<unsigned>(entries_.size()));
+  ProgramCounter end = 0;
+  int lineNumber = 0;
+  for (const auto& entry: entries_)
+  {
+    auto delta = entry.lineNumber - lineNumber;
+    appendNumber(out, entry.pc - end);
+    appendNumber(out, entry.length);
+    appendNumber(out, static_cast<unsigned>(entry.fileIndex));
+    appendNumber(out, delta < 0 ? (static_cast<unsigned>(-delta) << 1) - 1 : static_cast<unsigned>(delta) << 1);
+    end = entry.pc + entry.length;
+    lineNumber = entry.lineNumber;
+  }
+}
+
+void DebugInfo::writeText(std::string& out) const
+{
+  for (const auto& entry: entries_)
+  {
+    out += '$';
+    appendHex(out, entry.pc);
+    out += "-$";
+    appendHex(out, entry.pc + entry.length - 1);
+    out += ' ';
+    out += filenames_[entry.fileIndex];
+    out += ':';
+    out += std::to_string(entry.lineNumber);
+    out += '\n';
+  }
+}
+
+bool DebugInfo::save(const std::string& filename, DebugInfoFormat format) const
+{
+  std::string contents;
+  write(contents, format);
+  return saveFile(filename, { { contents.data(), contents.size() } });
+}
+
+}
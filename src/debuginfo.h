@@ -0,0 +1,67 @@
+#ifndef _INCLUDED_AS64_DEBUGINFO_H
+#define _INCLUDED_AS64_DEBUGINFO_H
+
+#include <string>
+#include <vector>
+#include "types.h"
+
+namespace as64
+{
+
+class Context;
+class CodeBuffer;
+
+enum class DebugInfoFormat
+{
+  Binary,
+  Text,
+
+  _End
+};
+
+// Recognized names are bin and text.
+Maybe<DebugInfoFormat> debugInfoFormatNamed(const std::string& name) noexcept;
+
+// ----------------------------------------------------------------------------
+//      DebugInfo
+// ----------------------------------------------------------------------------
+
+// Maps the addresses of the code and data in one buffer back to the source lines that produced them.
+//
+// The binary form starts with "AS64DBG\0" and a version byte (1), followed by unsigned LEB128 numbers: the
+// file count, each filename as a length and its bytes, the entry count, and then for each entry the
+// distance of its address from the end of the previous entry, its length, its file index and its line
+// number as a zigzag-encoded difference from the previous entry's line. Entries are sorted by address and
+// do not overlap, so once decoded they can be searched by address with a binary search.
+//
+// The text form has one "$start-$end file:line" row per entry, in the same order.
+class DebugInfo
+{
+public:
+  DebugInfo(const Context& context, const CodeBuffer& buffer);
+
+  bool isEmpty() const noexcept { return entries_.empty(); }
+
+  void write(std::string& out, DebugInfoFormat format) const;
+
+  // Returns false if the file already had the same contents and was left alone.
+  bool save(const std::string& filename, DebugInfoFormat format) const;
+
+private:
+  struct Entry
+  {
+    ProgramCounter pc;
+    ProgramCounter length;
+    int fileIndex;
+    int lineNumber;
+  };
+
+  void writeBinary(std::string& out) const;
+  void writeText(std::string& out) const;
+
+  std::vector<std::string> filenames_;
+  std::vector<Entry> entries_;
+};
+
+}
+#endif
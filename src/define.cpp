@@ -16,6 +16,7 @@
 #include <vector>
 #include <algorithm>
 #include "define.h"
+#include "layout.h"
 #include "context.h"
 #include "ast.h"
 
@@ -26,88 +27,66 @@ namespace as64
 //      DefinitionPass
 // ----------------------------------------------------------------------------
 
-class DefinitionPass : public StatementVisitor
-{
-public:
-  DefinitionPass(Context& context);
-
-  void run();
-
-  void visit(SymbolDefinition& node) override;
-  void visit(ProgramCounterAssignment& node) override;
-  void visit(ImpliedOperation& node) override;
-  void visit(ImmediateOperation& node) override;
-  void visit(AccumulatorOperation& node) override;
-  void visit(DirectOperation& node) override;
-  void visit(IndirectOperation& node) override;
-  void visit(BranchOperation& node) override;
-  void visit(OriginDirective& node) override;
-  void visit(BufferDirective& node) override;
-  void visit(OffsetBeginDirective& node) override;
-  void visit(OffsetEndDirective& node) override;
-  void visit(ByteDirective& node) override;
-  void visit(WordDirective& node) override;
-  void visit(StringDirective& node) override;
-  void visit(BitmapDirective& node) override;
-  void visit(IfDirective& node) override;
-  void visit(IfdefDirective& node) override;
-  void visit(ElseDirective& node) override;
-  void visit(EndifDirective& node) override;
-  void visit(EndDirective& node) override;
-
-  bool before(Statement& node) override;
-  bool uncaught(SourceError& err) override;
-
-private:
-  struct Conditional
-  {
-    Statement *node;
-    bool value;
-  };
-
-  void processLabel(Statement& node);
-  void setLabel(Statement& node, Address value);
-  void updateSkipFlag();
-  void advance(SourcePos pos, ByteLength count);
-
-  Context& context_;
-  std::vector<Address> offsetStack_;
-  bool skipping_;
-  bool ended_;
-  std::vector<Conditional> conditionalStack_;
-};
-
-DefinitionPass::DefinitionPass(Context& context)
-  : context_(context), skipping_(false), ended_(false)
+DefinitionPass::DefinitionPass(Context& context, bool placingSegments)
+  : context_(context), skipping_(false), ended_(false), placingSegments_(placingSegments), segment_(nullptr)
 {
 }
 
 void DefinitionPass::run()
 {
+  begin();
   context_.statements.accept(*this);
+  end();
+}
+
+void DefinitionPass::begin()
+{
+  context_.pc = 0;
+  context_.segment = nullptr;
+  context_.definitions.clear();
+  for (const auto& segment: context_.layout.segments())
+    segmentPcs_.push_back(segment.base);
+}
 
+void DefinitionPass::end()
+{
   for (const auto& cond: conditionalStack_)
     context_.messages.add(Severity::Error, cond.node->pos(), "Missing corresponding .ife");
+
+  if (segment_)
+    segmentPcs_[segment_ - &context_.layout.segments()[0]] = context_.pc;
+  for (size_t i = 0; i < segmentPcs_.size(); ++ i)
+  {
+    auto& segment = context_.layout.segments()[i];
+    segment.size = segmentPcs_[i] - segment.base;
+  }
 }
 
 bool DefinitionPass::before(Statement& node)
 {
   node.setPc(context_.pc);
-  if (ended_ || (skipping_ && ! node.isConditional()))
-  {
-    node.skip();
-    return false;
-  }
-  return true;
+  node.skip(ended_ || (skipping_ && ! node.isConditional()));
+  return ! node.isSkipped();
+}
+
+void DefinitionPass::visit(MacroCall& node)
+{
+  processLabel(node);
 }
 
+// A definition is only recorded here, so that it can refer to symbols defined further on and so that
+// the ones nothing uses cost nothing.
 void DefinitionPass::visit(SymbolDefinition& node)
 {
-  setLabel(node, node.expr().eval(context_));
+  const auto& name = node.label().name();
+  if (context_.symbols.exists(name) || context_.definitions.count(name))
+    throwSourceError(node.pos(), "Symbol '%s' already exists", name.c_str());
+  context_.definitions[name] = { &node, context_.symbols.reserveSerialNum() };
 }
 
 void DefinitionPass::visit(ProgramCounterAssignment& node)
 {
+  checkUnsegmented(node);
   context_.pc = node.expr().eval(context_);
 }
 
@@ -164,6 +143,11 @@ void DefinitionPass::visit(DirectOperation& node)
     throwSourceError(node.pos(), "Instruction '%s' does not support direct addressing", node.instruction().name().c_str());
   }
 
+  // While segments are being placed, an operand that needed absolute addressing keeps it, so that
+  // segments only ever grow from one pass to the next.
+  if (placingSegments_ && *length == 3)
+    node.setForceAbsolute(true);
+
   advance(node.pos(), *length);
 }
 
@@ -196,6 +180,7 @@ void DefinitionPass::visit(BranchOperation& node)
 
 void DefinitionPass::visit(OriginDirective& node)
 {
+  checkUnsegmented(node);
   processLabel(node);
 
   context_.pc = node.expr().eval(context_);
@@ -227,6 +212,31 @@ void DefinitionPass::visit(OffsetEndDirective& node)
   offsetStack_.pop_back();
 }
 
+void DefinitionPass::visit(SegmentDirective& node)
+{
+  auto *segment = context_.layout.segmentNamed(node.name());
+  if (! segment)
+  {
+    if (context_.layout.isEmpty())
+      throwSourceError(node.pos(), "Segment '%s' requires a layout (use -T <file>)", node.name().c_str());
+    throwSourceError(node.pos(), "Unknown segment '%s'", node.name().c_str());
+  }
+  if (! offsetStack_.empty())
+    throwSourceError(node.pos(), "Cannot change segments while the program counter is offset");
+
+  // Each segment has a program counter of its own. Code that comes before the first segment keeps its
+  // place in memory, but nothing after it can leave the segments again.
+  auto *segments = &context_.layout.segments()[0];
+  if (segment_)
+    segmentPcs_[segment_ - segments] = context_.pc;
+  segment_ = segment;
+  context_.segment = segment;
+  context_.pc = segmentPcs_[segment_ - segments];
+  node.setPc(context_.pc);
+
+  processLabel(node);
+}
+
 void DefinitionPass::visit(ByteDirective& node)
 {
   processLabel(node);
@@ -255,6 +265,27 @@ void DefinitionPass::visit(BitmapDirective& node)
   advance(node.pos(), node.byteLength());
 }
 
+void DefinitionPass::visit(FillDirective& node)
+{
+  processLabel(node);
+
+  advance(node.pos(), node.count().eval(context_));
+}
+
+void DefinitionPass::visit(TableDirective& node)
+{
+  processLabel(node);
+
+  advance(node.pos(), node.count().eval(context_));
+}
+
+void DefinitionPass::visit(IncbinDirective& node)
+{
+  processLabel(node);
+
+  advance(node.pos(), node.byteLength());
+}
+
 void DefinitionPass::visit(IfDirective& node)
 {
   conditionalStack_.push_back({ &node, node.expr().eval(context_) != 0 });
@@ -263,7 +294,7 @@ void DefinitionPass::visit(IfDirective& node)
 
 void DefinitionPass::visit(IfdefDirective& node)
 {
-  conditionalStack_.push_back({ &node, context_.symbols.exists(node.name()) });
+  conditionalStack_.push_back({ &node, context_.symbols.exists(node.name()) || context_.definitions.count(node.name()) });
   updateSkipFlag();
 }
 
@@ -288,6 +319,26 @@ void DefinitionPass::visit(EndDirective& node)
   ended_ = true;
 }
 
+void DefinitionPass::visit(OptimizeDirective& node)
+{
+  processLabel(node);
+}
+
+void DefinitionPass::visit(CpuDirective& node)
+{
+  processLabel(node);
+}
+
+void DefinitionPass::visit(BudgetBeginDirective& node)
+{
+  processLabel(node);
+}
+
+void DefinitionPass::visit(BudgetEndDirective& node)
+{
+  processLabel(node);
+}
+
 bool DefinitionPass::uncaught(SourceError& err)
 {
   context_.messages.add(err.isFatal() ? Severity::FatalError : Severity::Error, err.pos(), err.message());
@@ -297,14 +348,28 @@ bool DefinitionPass::uncaught(SourceError& err)
 void DefinitionPass::processLabel(Statement& node)
 {
   setLabel(node, context_.pc);
+  if (context_.relocatable && segment_)
+    setTerm(node, { TermType::Segment, segment_->name });
 }
 
 void DefinitionPass::setLabel(Statement& node, Address value)
 {
-  if (! context_.symbols.set(node.label(), value))
+  if (! context_.symbols.set(node.label(), value) || context_.definitions.count(node.label().name()))
     throwSourceError(node.pos(), "Symbol '%s' already exists", node.label().name().c_str());
 }
 
+void DefinitionPass::setTerm(Statement& node, const RelocationTerm& term)
+{
+  if (! node.label().isEmpty())
+    context_.symbolTerms[node.label().name()] = term;
+}
+
+void DefinitionPass::checkUnsegmented(Statement& node)
+{
+  if (segment_)
+    throwSourceError(node.pos(), "Cannot set the program counter inside segment '%s'", segment_->name.c_str());
+}
+
 void DefinitionPass::updateSkipFlag()
 {
   skipping_ = std::find_if(std::begin(conditionalStack_), std::end(conditionalStack_),
@@ -326,10 +391,135 @@ void DefinitionPass::advance(SourcePos pos, ByteLength count)
   }
 }
 
+// ----------------------------------------------------------------------------
+//      Lazy Definitions
+// ----------------------------------------------------------------------------
+
+// A definition is evaluated at its own place in the source, so * and temporary labels mean the same as
+// they would have if it had been evaluated in order.
+class Evaluation
+{
+public:
+  Evaluation(Context& context, const SymbolDefinition& node)
+    : context_(context), pc_(context.pc), indexName_(context.indexName)
+  {
+    context_.pc = node.pc();
+    context_.indexName = nullptr;
+    context_.evaluating.push_back(node.label().name());
+  }
+
+  ~Evaluation()
+  {
+    context_.pc = pc_;
+    context_.indexName = indexName_;
+    context_.evaluating.pop_back();
+  }
+
+private:
+  Context& context_;
+  ProgramCounter pc_;
+  const std::string *indexName_;
+};
+
+Maybe<Address> lookupSymbol(Context& context, const std::string& name, bool throwUndefined)
+{
+  auto value = context.symbols.get(name);
+  if (value.hasValue())
+    return value;
+
+  auto definition = context.definitions.find(name);
+  if (definition == std::end(context.definitions))
+    return nullptr;
+  const auto& node = *definition->second.node;
+  if (definition->second.failure)
+    throw *definition->second.failure;
+
+  // Every definition on the cycle fails with the same error, so it is reported only once.
+  auto cycle = std::find(std::begin(context.evaluating), std::end(context.evaluating), name);
+  if (cycle != std::end(context.evaluating))
+  {
+    std::string path;
+    for (auto i = cycle; i != std::end(context.evaluating); ++ i)
+      path += *i + " -> ";
+    auto failure = std::make_shared<const SourceError>(node.pos(), "Circular definition of symbol '" + name + "' (" +
+                                                       path + name + ")");
+    for (; cycle != std::end(context.evaluating); ++ cycle)
+      context.definitions[*cycle].failure = failure;
+    throw *failure;
+  }
+
+  Evaluation evaluation(context, node);
+  value = throwUndefined ? node.expr().eval(context) : node.expr().tryEval(context);
+  if (! value.hasValue())
+    return nullptr;
+  if (context.relocatable)
+    context.symbolTerms[name] = node.expr().term(context);
+  context.symbols.set(node.label(), *value, definition->second.serialNum);
+  context.definitions.erase(definition);
+  return value;
+}
+
+void defineAll(Context& context)
+{
+  std::vector<std::string> names;
+  for (const auto& definition: context.definitions)
+    names.push_back(definition.first);
+  std::sort(std::begin(names), std::end(names));
+
+  for (const auto& name: names)
+  {
+    try
+    {
+      lookupSymbol(context, name, true);
+    }
+    catch (SourceError& err)
+    {
+      context.messages.add(Severity::Warning, err.pos(), err.message());
+    }
+  }
+}
+
+// ----------------------------------------------------------------------------
+//      define
+// ----------------------------------------------------------------------------
+
 void define(Context& context)
 {
-  DefinitionPass pass(context);
-  pass.run();
+  if (context.layout.isEmpty())
+  {
+    DefinitionPass pass(context);
+    pass.run();
+    return;
+  }
+
+  // Where a segment is placed depends on the sizes of the segments before it, and sizes can depend on
+  // addresses, so the definitions are repeated until the placement stops changing.
+  constexpr int MaxPasses = 8;
+  auto serialNum = context.symbols.serialNum();
+  auto messages = context.messages;
+  context.layout.place();
+  for (int passCount = 1; ; ++ passCount)
+  {
+    DefinitionPass pass(context, true);
+    pass.run();
+    if (context.messages.errorCount() > messages.errorCount())
+      return;
+
+    std::vector<Address> bases;
+    for (const auto& segment: context.layout.segments())
+      bases.push_back(segment.base);
+    context.layout.place();
+    bool settled = true;
+    for (size_t i = 0; i < bases.size(); ++ i)
+      settled = settled && bases[i] == context.layout.segments()[i].base;
+    if (settled)
+      return;
+
+    if (passCount == MaxPasses)
+      throw LayoutError("Segment placement did not settle after " + std::to_string(MaxPasses) + " passes");
+    context.symbols.truncate(serialNum);
+    context.messages = messages;
+  }
 }
 
 }
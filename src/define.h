@@ -1,13 +1,102 @@
 #ifndef _INCLUDED_AS64_DEFINE_H
 #define _INCLUDED_AS64_DEFINE_H
 
+#include <vector>
+#include "types.h"
+#include "ast.h"
+#include "layout.h"
+
 namespace as64
 {
 
 class Context;
 
+// ----------------------------------------------------------------------------
+//      DefinitionPass
+// ----------------------------------------------------------------------------
+
+class DefinitionPass : public StatementVisitor
+{
+public:
+  DefinitionPass(Context& context, bool placingSegments = false);
+
+  void run();
+
+  // A pass can also be driven one statement at a time: begin, then before and accept for each
+  // statement, then end.
+  void begin();
+  void end();
+
+  void visit(MacroCall& node) override;
+  void visit(SymbolDefinition& node) override;
+  void visit(ProgramCounterAssignment& node) override;
+  void visit(ImpliedOperation& node) override;
+  void visit(ImmediateOperation& node) override;
+  void visit(AccumulatorOperation& node) override;
+  void visit(DirectOperation& node) override;
+  void visit(IndirectOperation& node) override;
+  void visit(BranchOperation& node) override;
+  void visit(OriginDirective& node) override;
+  void visit(BufferDirective& node) override;
+  void visit(OffsetBeginDirective& node) override;
+  void visit(OffsetEndDirective& node) override;
+  void visit(SegmentDirective& node) override;
+  void visit(ByteDirective& node) override;
+  void visit(WordDirective& node) override;
+  void visit(StringDirective& node) override;
+  void visit(BitmapDirective& node) override;
+  void visit(FillDirective& node) override;
+  void visit(TableDirective& node) override;
+  void visit(IncbinDirective& node) override;
+  void visit(IfDirective& node) override;
+  void visit(IfdefDirective& node) override;
+  void visit(ElseDirective& node) override;
+  void visit(EndifDirective& node) override;
+  void visit(EndDirective& node) override;
+  void visit(OptimizeDirective& node) override;
+  void visit(CpuDirective& node) override;
+  void visit(BudgetBeginDirective& node) override;
+  void visit(BudgetEndDirective& node) override;
+
+  bool before(Statement& node) override;
+  bool uncaught(SourceError& err) override;
+
+private:
+  struct Conditional
+  {
+    Statement *node;
+    bool value;
+  };
+
+  void processLabel(Statement& node);
+  void setLabel(Statement& node, Address value);
+  void setTerm(Statement& node, const RelocationTerm& term);
+  void updateSkipFlag();
+  void advance(SourcePos pos, ByteLength count);
+
+  void checkUnsegmented(Statement& node);
+
+  Context& context_;
+  std::vector<Address> offsetStack_;
+  bool skipping_;
+  bool ended_;
+  std::vector<Conditional> conditionalStack_;
+  bool placingSegments_;
+  Segment *segment_;
+  std::vector<Address> segmentPcs_;
+};
+
 void define(Context& context);
 
+// Returns the value of a symbol, first evaluating its definition if nothing has needed it yet. Evaluation
+// follows the definitions that it depends on, and a definition that depends on itself is an error that
+// names every symbol in the cycle.
+Maybe<Address> lookupSymbol(Context& context, const std::string& name, bool throwUndefined = false);
+
+// Evaluates every definition that has not been needed yet, for when the whole symbol table is wanted. Nothing
+// uses those definitions, so any that cannot be evaluated are only reported as warnings.
+void defineAll(Context& context);
+
 
 }
 #endif
@@ -0,0 +1,260 @@
+// Copyright (c) 2018 Robert A. Stoerrle
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+// REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+// AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+// INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+// LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+// OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+#include <sstream>
+#include <algorithm>
+#include "str.h"
+#include "file.h"
+#include "diskimage.h"
+
+namespace as64
+{
+
+constexpr int BlockDataSize = DiskImage::SectorSize - 2;
+constexpr int DirectoryInterleave = 3;
+constexpr int EntrySize = 32;
+constexpr int NameLength = 16;
+constexpr Byte ShiftedSpace = 0xa0;
+constexpr Byte ClosedPrg = 0x82;
+constexpr int BamOffset = 357 * DiskImage::SectorSize;      // Track 18, sector 0
+
+// Data blocks are allocated the way DOS does it, working outwards from the directory track.
+static const int g_trackOrder[] =
+{
+  17, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1,
+  19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35
+};
+
+constexpr int DataTrackCount = sizeof(g_trackOrder) / sizeof(g_trackOrder[0]);
+
+static void copyName(Byte *p, const std::string& name) noexcept
+{
+  std::fill(p, p + NameLength, ShiftedSpace);
+  std::copy(std::begin(name), std::begin(name) + std::min<size_t>(name.length(), NameLength), p);
+}
+
+// ----------------------------------------------------------------------------
+//      DiskImage
+// ----------------------------------------------------------------------------
+
+DiskImage::DiskImage(const std::string& name, const std::string& id) noexcept
+  : data_(SectorCount * SectorSize, 0), interleave_(DefaultInterleave), lastTrack_(0)
+{
+  for (int track = 1; track <= TrackCount; ++ track)
+  {
+    auto *entry = bamEntry(track);
+    int count = sectorsOnTrack(track);
+    entry[0] = count;
+    for (int sector = 0; sector < count; ++ sector)
+      entry[1 + sector / 8] |= 1 << (sector % 8);
+  }
+
+  auto *bam = sector({ DirectoryTrack, 0 });
+  bam[0] = DirectoryTrack;
+  bam[1] = 1;
+  bam[2] = 'A';
+  copyName(bam + 0x90, encode(StringEncoding::Petscii, toLowerCase(name)));
+  std::fill(bam + 0xa0, bam + 0xab, ShiftedSpace);
+  auto diskId = encode(StringEncoding::Petscii, toLowerCase(id));
+  std::copy(std::begin(diskId), std::begin(diskId) + std::min<size_t>(diskId.length(), 2), bam + 0xa2);
+  bam[0xa5] = '2';
+  bam[0xa6] = 'A';
+  allocate({ DirectoryTrack, 0 });
+
+  auto *directory = sector({ DirectoryTrack, 1 });
+  directory[1] = 0xff;
+  allocate({ DirectoryTrack, 1 });
+}
+
+int DiskImage::sectorsOnTrack(int track) noexcept
+{
+  if (track <= 17)
+    return 21;
+  if (track <= 24)
+    return 19;
+  if (track <= 30)
+    return 18;
+  return 17;
+}
+
+int DiskImage::freeBlocks() const noexcept
+{
+  int count = 0;
+  for (int track = 1; track <= TrackCount; ++ track)
+  {
+    if (track != DirectoryTrack)
+      count += data_[BamOffset + 4 * track];
+  }
+  return count;
+}
+
+Byte *DiskImage::sector(Block block) noexcept
+{
+  int index = block.sector;
+  for (int track = 1; track < block.track; ++ track)
+    index += sectorsOnTrack(track);
+  return &data_[index * SectorSize];
+}
+
+Byte *DiskImage::bamEntry(int track) noexcept
+{
+  return &data_[BamOffset + 4 * track];
+}
+
+bool DiskImage::isFree(Block block) noexcept
+{
+  return (bamEntry(block.track)[1 + block.sector / 8] & (1 << (block.sector % 8))) != 0;
+}
+
+void DiskImage::allocate(Block block) noexcept
+{
+  auto *entry = bamEntry(block.track);
+  entry[1 + block.sector / 8] &= ~(1 << (block.sector % 8));
+  -- entry[0];
+}
+
+// Allocates the first free sector on the block's track at least interleave sectors past the block's sector.
+bool DiskImage::allocateNear(Block& block, int interleave) noexcept
+{
+  int count = sectorsOnTrack(block.track);
+  for (int i = 0; i < count; ++ i)
+  {
+    Block candidate { block.track, (block.sector + interleave + i) % count };
+    if (isFree(candidate))
+    {
+      allocate(candidate);
+      block = candidate;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Each file starts at sector 0 of the first track with room on it. Later blocks follow at the interleave,
+// carrying the sector position over to the next track when a track fills up.
+bool DiskImage::allocateData(Block& block, bool first) noexcept
+{
+  if (first)
+    block.sector = 0;
+  else if (allocateNear(block, interleave_))
+    return true;
+
+  for (; lastTrack_ < DataTrackCount; ++ lastTrack_)
+  {
+    block.track = g_trackOrder[lastTrack_];
+    if (bamEntry(block.track)[0] && allocateNear(block, first ? 0 : interleave_))
+      return true;
+  }
+  return false;
+}
+
+Byte *DiskImage::directoryEntry()
+{
+  Block block { DirectoryTrack, 1 };
+  for (;;)
+  {
+    auto *p = sector(block);
+    for (int i = 0; i < SectorSize; i += EntrySize)
+    {
+      if (p[i + 2] == 0)
+        return p + i;
+    }
+    if (p[0] == 0)
+      break;
+    block = { p[0], p[1] };
+  }
+
+  auto *last = sector(block);
+  if (! allocateNear(block, DirectoryInterleave))
+    throw DiskImageError("Directory is full");
+  last[0] = block.track;
+  last[1] = block.sector;
+  auto *p = sector(block);
+  p[1] = 0xff;
+  return p;
+}
+
+void DiskImage::addFile(const std::string& name, const std::vector<Byte>& data)
+{
+  auto filename = encode(StringEncoding::Petscii, toLowerCase(name));
+  if (filename.empty() || filename.length() > NameLength)
+    throw DiskImageError("Invalid filename '" + name + "' (must be 1 to 16 characters)");
+
+  Byte paddedName[NameLength];
+  copyName(paddedName, filename);
+  for (Block block { DirectoryTrack, 1 }; block.track; )
+  {
+    auto *p = sector(block);
+    for (int i = 0; i < SectorSize; i += EntrySize)
+    {
+      if (p[i + 2] && std::equal(paddedName, paddedName + NameLength, p + i + 5))
+        throw DiskImageError("Duplicate filename '" + name + "'");
+    }
+    block = { p[0], p[1] };
+  }
+
+  int blockCount = std::max<int>(1, (data.size() + BlockDataSize - 1) / BlockDataSize);
+  if (blockCount > freeBlocks())
+    throw DiskImageError("Disk is full (cannot add '" + name + "')");
+
+  auto *entry = directoryEntry();
+  Block block { 0, 0 }, first { 0, 0 };
+  Byte *previous = nullptr;
+  for (int i = 0; i < blockCount; ++ i)
+  {
+    allocateData(block, i == 0);
+    if (previous)
+    {
+      previous[0] = block.track;
+      previous[1] = block.sector;
+    }
+    else
+      first = block;
+
+    auto *p = sector(block);
+    int offset = i * BlockDataSize;
+    int length = std::min<int>(BlockDataSize, data.size() - offset);
+    std::copy(data.begin() + offset, data.begin() + offset + length, p + 2);
+    p[0] = 0;
+    p[1] = length + 1;
+    previous = p;
+  }
+
+  entry[2] = ClosedPrg;
+  entry[3] = first.track;
+  entry[4] = first.sector;
+  std::copy(paddedName, paddedName + NameLength, entry + 5);
+  entry[30] = blockCount;
+  entry[31] = blockCount >> 8;
+}
+
+void DiskImage::addFile(const std::string& name, const CodeBuffer& buffer, const OutputFormat& format)
+{
+  std::ostringstream s;
+  format.write(s, buffer);
+  auto contents = s.str();
+  addFile(name, std::vector<Byte>(std::begin(contents), std::end(contents)));
+}
+
+void DiskImage::write(std::ostream& s) const noexcept
+{
+  s.write(reinterpret_cast<const char *>(&data_[0]), data_.size());
+}
+
+bool DiskImage::save(const std::string& filename) const
+{
+  return saveFile(filename, { { data_.data(), data_.size() } });
+}
+
+}
@@ -0,0 +1,79 @@
+#ifndef _INCLUDED_AS64_DISKIMAGE_H
+#define _INCLUDED_AS64_DISKIMAGE_H
+
+#include <string>
+#include <vector>
+#include <ostream>
+#include "types.h"
+#include "error.h"
+#include "buffer.h"
+#include "output.h"
+
+namespace as64
+{
+
+// ----------------------------------------------------------------------------
+//      DiskImage
+// ----------------------------------------------------------------------------
+
+// A 35 track 1541 disk image (.d64). The whole image is built in memory and written out in one piece.
+class DiskImage
+{
+public:
+  static constexpr int TrackCount = 35;
+  static constexpr int SectorCount = 683;
+  static constexpr int SectorSize = 256;
+  static constexpr int DirectoryTrack = 18;
+  static constexpr int DefaultInterleave = 10;
+
+  DiskImage(const std::string& name = "", const std::string& id = "00") noexcept;
+
+  int interleave() const noexcept { return interleave_; }
+  void setInterleave(int interleave) noexcept { interleave_ = interleave; }
+  int freeBlocks() const noexcept;
+
+  void addFile(const std::string& name, const std::vector<Byte>& data);
+  void addFile(const std::string& name, const CodeBuffer& buffer, const OutputFormat& format);
+
+  void write(std::ostream& s) const noexcept;
+  bool save(const std::string& filename) const;
+
+  static int sectorsOnTrack(int track) noexcept;
+
+private:
+  struct Block
+  {
+    int track, sector;
+  };
+
+  Byte *sector(Block block) noexcept;
+  Byte *bamEntry(int track) noexcept;
+  bool isFree(Block block) noexcept;
+  void allocate(Block block) noexcept;
+  bool allocateNear(Block& block, int interleave) noexcept;
+  bool allocateData(Block& block, bool first) noexcept;
+  Byte *directoryEntry();
+
+  std::vector<Byte> data_;
+  int interleave_;
+  int lastTrack_;
+};
+
+// ----------------------------------------------------------------------------
+//      DiskImageError
+// ----------------------------------------------------------------------------
+
+class DiskImageError : public GeneralError
+{
+public:
+  DiskImageError(const std::string& message) noexcept : message_(message) { }
+
+  const char *what() const noexcept override { return "Disk Image Error"; }
+  std::string message() const noexcept override { return message_; }
+
+private:
+  std::string message_;
+};
+
+}
+#endif
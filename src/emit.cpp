@@ -13,13 +13,42 @@
 // PERFORMANCE OF THIS SOFTWARE.
 
 #include <iostream>
+#include <algorithm>
+#include <cmath>
 #include "emit.h"
+#include "define.h"
 #include "context.h"
 #include "ast.h"
 
 namespace as64
 {
 
+// Makes the index symbol of a .fill directive visible for as long as its values are being evaluated.
+class IndexBinding
+{
+public:
+  IndexBinding(Context& context, const std::string& name) : context_(context) { context_.indexName = &name; }
+  ~IndexBinding() { context_.indexName = nullptr; }
+
+private:
+  Context& context_;
+};
+
+static RelocationKind relocationKind(ByteSelector selector) noexcept
+{
+  switch (selector)
+  {
+    case ByteSelector::Low:
+      return RelocationKind::Low;
+
+    case ByteSelector::High:
+      return RelocationKind::High;
+
+    default:
+      return RelocationKind::Byte;
+  }
+}
+
 // ----------------------------------------------------------------------------
 //      CodeGenerationPass
 // ----------------------------------------------------------------------------
@@ -27,9 +56,11 @@ namespace as64
 class CodeGenerationPass : public StatementVisitor
 {
 public:
-  CodeGenerationPass(Context& context);
+  CodeGenerationPass(Context& context, bool backpatching = false);
 
   void run();
+  void begin();
+  void end();
 
   void visit(ProgramCounterAssignment& node) override;
   void visit(ImpliedOperation& node) override;
@@ -40,140 +71,338 @@ public:
   void visit(BranchOperation& node) override;
   void visit(BufferDirective& node) override;
   void visit(ObjectFileDirective& node) override;
+  void visit(SegmentDirective& node) override;
   void visit(ByteDirective& node) override;
   void visit(WordDirective& node) override;
   void visit(StringDirective& node) override;
   void visit(BitmapDirective& node) override;
+  void visit(FillDirective& node) override;
+  void visit(TableDirective& node) override;
+  void visit(IncbinDirective& node) override;
 
   bool before(Statement& node) override;
   void after(Statement& node) override;
   bool uncaught(SourceError& err) override;
 
-private:
+protected:
+  enum class FixupType
+  {
+    Byte,
+    Word,
+    ZeroPage,
+    Branch,
+    Table
+  };
+
+  struct Fixup
+  {
+    CodeBuffer *buffer;
+    Offset offset;
+    FixupType type;
+    ByteSelector selector;
+    const Expression *expr;
+    ProgramCounter pc;
+    SourcePos pos;
+    const std::string *indexName;             // The index symbol of a .fill value, and its value
+    Address index;
+    const TableDirective *table;              // For a table, which is computed in full instead of expr
+  };
+
   void invalidInstruction(SourcePos pos);
   void newBuffer();
+  void createSegmentBuffers();
+  Address evaluate(const Expression& expr, FixupType type, Offset offset, SourcePos pos,
+                   ByteSelector selector = ByteSelector::Unspecified);
+  void patch(const Fixup& fixup);
+  Address absolute(const Expression& expr);
+  std::vector<Byte> tableValues(const TableDirective& node, size_t count);
+  bool relocate(const Expression& expr, Address value, RelocationKind kind, Offset offset);
 
   Context& context_;
   CodeWriter writer_;
+  CodeWriter *current_;
   Offset start_;
+  std::vector<CodeWriter> segmentWriters_;
+  std::vector<Offset> segmentStarts_;
+  Segment *segment_;
+  std::unique_ptr<CodeBuffer> discarded_;
+  bool backpatching_;
+  std::vector<Fixup> fixups_;
 };
 
-CodeGenerationPass::CodeGenerationPass(Context& context)
-  : context_(context)
+CodeGenerationPass::CodeGenerationPass(Context& context, bool backpatching)
+  : context_(context), current_(&writer_), segment_(nullptr), discarded_(std::make_unique<CodeBuffer>()),
+    backpatching_(backpatching)
 {
   newBuffer();
+  createSegmentBuffers();
 }
 
 void CodeGenerationPass::run()
 {
+  begin();
   context_.statements.accept(*this);
+  end();
+}
+
+void CodeGenerationPass::begin()
+{
+  context_.segment = nullptr;
+  context_.relocations.clear();
+  context_.segmentRanges.clear();
+  context_.importing = context_.relocatable;
+}
+
+void CodeGenerationPass::end()
+{
+  context_.importing = false;
+
+  for (const auto& fixup: fixups_)
+  {
+    try
+    {
+      patch(fixup);
+    }
+    catch (SourceError& err)
+    {
+      if (! uncaught(err))
+        break;
+    }
+  }
+
+  if (context_.relocatable)
+  {
+    for (size_t i = 0; i < segmentWriters_.size(); ++ i)
+    {
+      auto *buffer = segmentWriters_[i].buffer();
+      if (buffer == discarded_.get())
+        context_.segmentRanges.push_back({});
+      else
+        context_.segmentRanges.push_back({ buffer, segmentStarts_[i], segmentWriters_[i].offset() });
+    }
+  }
 }
 
 bool CodeGenerationPass::before(Statement& node)
 {
   context_.pc = node.pc();
-  start_ = writer_.offset();
-  if (writer_.buffer()->isEmpty())
-    writer_.buffer()->setOrigin(node.pc());
+  start_ = current_->offset();
+  if (! segment_ && current_->buffer()->isEmpty())
+    current_->buffer()->setOrigin(node.pc());
   return ! node.isSkipped();
 }
 
 void CodeGenerationPass::after(Statement& node)
 {
-  node.setRange({ writer_.buffer(), start_, writer_.offset() });
+  if (context_.relocatable && ! segment_ && current_->offset() != start_)
+    context_.messages.error(node.pos(), "Code in an object module must be placed in a segment");
+  if (current_->buffer() != discarded_.get())
+    node.setRange({ current_->buffer(), start_, current_->offset() });
+  else
+  {
+    if (segment_->bss && current_->offset() != start_ && ! dynamic_cast<BufferDirective *>(&node))
+      context_.messages.error(node.pos(), "Segment '%s' can only reserve space with .buf", segment_->name.c_str());
+    node.setRange({});
+  }
 }
 
 void CodeGenerationPass::visit(ProgramCounterAssignment& node)
 {
-  auto addr = node.expr().eval(context_);
-  if (! writer_.buffer()->isEmpty() && addr < context_.pc)
+  auto addr = absolute(node.expr());
+  if (! current_->buffer()->isEmpty() && addr < context_.pc)
     throwSourceError(node.pos(), "Invalid program counter assignment (address $%04x < pc $%04x)", addr, context_.pc);
-  writer_.fill(addr - context_.pc);
+  current_->fill(addr - context_.pc);
 }
 
 void CodeGenerationPass::visit(ImpliedOperation& node)
 {
-  if (! node.instruction().encodeImplied(&writer_).hasValue())
+  if (! node.instruction().encodeImplied(current_).hasValue())
     invalidInstruction(node.pos());
 }
 
 void CodeGenerationPass::visit(ImmediateOperation& node)
 {
-  auto value = select(node.selector(), node.expr().eval(context_));
+  auto addr = evaluate(node.expr(), FixupType::Byte, current_->offset() + 1, node.pos(), node.selector());
+  auto value = select(node.selector(), addr);
+  if (relocate(node.expr(), addr, relocationKind(node.selector()), current_->offset() + 1))
+    value = value.value(addr & 0xff);
   if (! value.hasValue())
-    throwSourceError(node.pos(), "Expected a value between 0 and 255; got %d", node.expr().eval(context_));
-  if (! node.instruction().encodeImmediate(&writer_, *value).hasValue())
+    throwSourceError(node.pos(), "Expected a value between 0 and 255; got %d", addr);
+  if (! node.instruction().encodeImmediate(current_, *value).hasValue())
     invalidInstruction(node.pos());
 }
 
 void CodeGenerationPass::visit(AccumulatorOperation& node)
 {
-  if (! node.instruction().encodeAccumulator(&writer_).hasValue())
+  if (! node.instruction().encodeAccumulator(current_).hasValue())
     invalidInstruction(node.pos());
 }
 
 void CodeGenerationPass::visit(DirectOperation& node)
 {
-  auto addr = node.expr().eval(context_);
-  if (! node.instruction().encodeDirect(&writer_, addr, node.index(), node.forceAbsolute()).hasValue())
+  // An operand that could not be evaluated when it was defined is always absolute.
+  auto addr = evaluate(node.expr(), FixupType::Word, current_->offset() + 1, node.pos());
+  auto offset = current_->offset();
+  if (! node.instruction().encodeDirect(current_, addr, node.index(), node.forceAbsolute()).hasValue())
     invalidInstruction(node.pos());
+  relocate(node.expr(), addr, current_->offset() - offset == 3 ? RelocationKind::Word : RelocationKind::Byte, offset + 1);
 }
 
 void CodeGenerationPass::visit(IndirectOperation& node)
 {
-  auto addr = node.expr().eval(context_);
-  if ( ! node.instruction().encodeIndirect(&writer_, addr, node.index()).hasValue())
+  auto length = node.instruction().encodeIndirect(nullptr, 0, node.index());
+  auto addr = evaluate(node.expr(), length.value(0) == 3 ? FixupType::Word : FixupType::ZeroPage,
+                       current_->offset() + 1, node.pos());
+  auto offset = current_->offset();
+  if ( ! node.instruction().encodeIndirect(current_, addr, node.index()).hasValue())
     invalidInstruction(node.pos());
+  relocate(node.expr(), addr, current_->offset() - offset == 3 ? RelocationKind::Word : RelocationKind::Byte, offset + 1);
 }
 
 void CodeGenerationPass::visit(BranchOperation& node)
 {
-  auto addr = node.expr().eval(context_);
-  if (! node.instruction().encodeRelative(&writer_, context_.pc, addr).hasValue())
+  auto addr = evaluate(node.expr(), FixupType::Branch, current_->offset() + 1, node.pos());
+  if (context_.relocatable)
+  {
+    auto term = node.expr().term(context_);
+    if (term.type == TermType::Import || (term.type == TermType::Segment && (! segment_ || term.name != segment_->name)))
+      throwSourceError(node.pos(), "Branch target must be in the same segment");
+  }
+  if (! node.instruction().encodeRelative(current_, context_.pc, addr).hasValue())
     throwSourceError(node.pos(), "Branch out of range");
 }
 
 void CodeGenerationPass::visit(BufferDirective& node)
 {
-  writer_.fill(node.expr().eval(context_));
+  current_->fill(absolute(node.expr()));
 }
 
 void CodeGenerationPass::visit(ObjectFileDirective& node)
 {
-  if (! writer_.buffer()->isEmpty())
+  if (segment_)
+    throwSourceError(node.pos(), "Cannot change the output file inside segment '%s'", segment_->name.c_str());
+  if (! current_->buffer()->isEmpty())
     newBuffer();
-  auto& buffer = *writer_.buffer();
+  start_ = current_->offset();
+  auto& buffer = *current_->buffer();
   buffer.setFilename(node.filename());
 }
 
+void CodeGenerationPass::visit(SegmentDirective& node)
+{
+  auto *segment = context_.layout.segmentNamed(node.name());
+  if (! segment)
+    return;
+  segment_ = segment;
+  context_.segment = segment;
+  current_ = &segmentWriters_[segment_ - &context_.layout.segments()[0]];
+  start_ = current_->offset();
+}
+
 void CodeGenerationPass::visit(ByteDirective& node)
 {
+  if (node.isPacked())
+  {
+    current_->bytes(node.values());
+    return;
+  }
   for (const auto& expr: node)
   {
-    auto value = select(node.selector(), expr->eval(context_));
+    auto addr = evaluate(*expr, FixupType::Byte, current_->offset(), expr->pos(), node.selector());
+    auto value = select(node.selector(), addr);
+    if (relocate(*expr, addr, relocationKind(node.selector()), current_->offset()))
+      value = value.value(addr & 0xff);
     if (! value.hasValue())
-      throwSourceError(expr->pos(), "Expected a value between 0 and 255; got %d", expr->eval(context_));
-    writer_.byte(*value);
+      throwSourceError(expr->pos(), "Expected a value between 0 and 255; got %d", addr);
+    current_->byte(*value);
   }
 }
 
 void CodeGenerationPass::visit(WordDirective& node)
 {
+  if (node.isPacked())
+  {
+    current_->bytes(node.values());
+    return;
+  }
   for (const auto& expr: node)
-    writer_.word(expr->eval(context_));
+  {
+    auto addr = evaluate(*expr, FixupType::Word, current_->offset(), expr->pos());
+    relocate(*expr, addr, RelocationKind::Word, current_->offset());
+    current_->word(addr);
+  }
 }
 
 void CodeGenerationPass::visit(StringDirective& node)
 {
   auto str = encode(node.encoding(), node.str());
   for (const auto& c: str)
-    writer_.byte(c);
+    current_->byte(c);
 }
 
 void CodeGenerationPass::visit(BitmapDirective& node)
 {
   for (const auto& c: node)
-    writer_.byte(c);
+    current_->byte(c);
+}
+
+// When backpatching, each value that refers to something defined further on gets a fixup of its own, which
+// remembers its index.
+void CodeGenerationPass::visit(FillDirective& node)
+{
+  std::vector<Byte> values(absolute(node.count()));
+  IndexBinding binding(context_, node.index());
+  auto offset = current_->offset();
+  for (size_t index = 0; index < values.size(); ++ index)
+  {
+    context_.index = static_cast<Address>(index);
+    auto addr = backpatching_ ? evaluate(node.value(), FixupType::Byte, offset + index, node.value().pos(), node.selector())
+                              : absolute(node.value());
+    auto value = select(node.selector(), addr);
+    if (! value.hasValue())
+      throwSourceError(node.value().pos(), "Expected a value between 0 and 255; got %d at index %d", addr, static_cast<int>(index));
+    values[index] = *value;
+  }
+  current_->bytes(values);
+}
+
+// When backpatching, a table whose amplitude or offset is defined further on is written as zeros and
+// computed again once the pass is over.
+void CodeGenerationPass::visit(TableDirective& node)
+{
+  auto count = absolute(node.count());
+  if (backpatching_ && (! node.amplitude().tryEval(context_).hasValue() ||
+                        (node.offset() && ! node.offset()->tryEval(context_).hasValue())))
+  {
+    fixups_.push_back({ current_->buffer(), current_->offset(), FixupType::Table, ByteSelector::Unspecified,
+                        nullptr, context_.pc, node.pos(), nullptr, 0, &node });
+    current_->bytes(std::vector<Byte>(count));
+    return;
+  }
+  current_->bytes(tableValues(node, count));
+}
+
+std::vector<Byte> CodeGenerationPass::tableValues(const TableDirective& node, size_t count)
+{
+  constexpr double Pi = 3.14159265358979323846;
+  std::vector<Byte> values(count);
+  double amplitude = absolute(node.amplitude());
+  int offset = node.offset() ? absolute(*node.offset()) : 0;
+  for (size_t index = 0; index < values.size(); ++ index)
+  {
+    auto angle = 2 * Pi * index / values.size();
+    auto f = node.function() == TableFunction::Sine ? std::sin(angle) : std::cos(angle);
+    auto value = offset + static_cast<int>(std::lround(amplitude * f));
+    if (value < -128 || value > 255)
+      throwSourceError(node.pos(), "Table value %d at index %d is out of range", value, static_cast<int>(index));
+    values[index] = static_cast<Byte>(value);
+  }
+  return values;
+}
+
+void CodeGenerationPass::visit(IncbinDirective& node)
+{
+  current_->bytes(node.data(), node.byteLength());
 }
 
 bool CodeGenerationPass::uncaught(SourceError& err)
@@ -194,10 +423,190 @@ void CodeGenerationPass::newBuffer()
   context_.buffers.push_back(std::move(buffer));
 }
 
+// Segments are written straight into the buffer for their region's output file, at their distance from
+// the lowest segment in that file. Space reserved by bss segments, and by segments that are empty, is
+// written to a buffer that is thrown away.
+void CodeGenerationPass::createSegmentBuffers()
+{
+  const auto& regions = context_.layout.regions();
+  std::vector<std::pair<std::string, CodeBuffer *>> files;
+  for (const auto& segment: context_.layout.segments())
+  {
+    if (segment.bss || segment.size == 0)
+      continue;
+    const auto& filename = regions[segment.region].filename;
+    auto file = std::find_if(std::begin(files), std::end(files), [&](const auto& f) { return f.first == filename; });
+    if (file == std::end(files))
+    {
+      auto buffer = std::make_unique<CodeBuffer>();
+      buffer->setFilename(filename);
+      buffer->setOrigin(segment.base);
+      files.push_back({ filename, buffer.get() });
+      context_.buffers.push_back(std::move(buffer));
+    }
+    else if (segment.base < file->second->origin())
+      file->second->setOrigin(segment.base);
+  }
+
+  for (const auto& segment: context_.layout.segments())
+  {
+    segmentWriters_.emplace_back(discarded_.get());
+    segmentStarts_.push_back(0);
+    if (segment.bss || segment.size == 0)
+      continue;
+    const auto& filename = regions[segment.region].filename;
+    auto file = std::find_if(std::begin(files), std::end(files), [&](const auto& f) { return f.first == filename; });
+    segmentStarts_.back() = segment.base - file->second->origin();
+    segmentWriters_.back().attach(file->second, segmentStarts_.back());
+  }
+}
+
+// When backpatching, a value that refers to a symbol or temporary label defined further on is written as a
+// placeholder that the operand's checks accept, and the real value is patched in once the pass is over.
+Address CodeGenerationPass::evaluate(const Expression& expr, FixupType type, Offset offset, SourcePos pos,
+                                     ByteSelector selector)
+{
+  if (! backpatching_)
+    return expr.eval(context_);
+
+  auto value = expr.tryEval(context_);
+  if (value.hasValue())
+    return *value;
+  fixups_.push_back({ current_->buffer(), offset, type, selector, &expr, context_.pc, pos, context_.indexName,
+                      context_.index, nullptr });
+  return type == FixupType::Branch ? context_.pc + 2 : 0;
+}
+
+void CodeGenerationPass::patch(const Fixup& fixup)
+{
+  context_.pc = fixup.pc;
+  if (fixup.type == FixupType::Table)
+  {
+    auto values = tableValues(*fixup.table, absolute(fixup.table->count()));
+    fixup.buffer->writeBytes(fixup.offset, values);
+    return;
+  }
+
+  std::unique_ptr<IndexBinding> binding;
+  if (fixup.indexName)
+  {
+    binding = std::make_unique<IndexBinding>(context_, *fixup.indexName);
+    context_.index = fixup.index;
+  }
+  auto addr = fixup.expr->eval(context_);
+  switch (fixup.type)
+  {
+    case FixupType::Byte:
+    {
+      auto value = select(fixup.selector, addr);
+      if (! value.hasValue())
+        throwSourceError(fixup.pos, "Expected a value between 0 and 255; got %d", addr);
+      fixup.buffer->writeByte(fixup.offset, *value);
+      break;
+    }
+
+    case FixupType::Word:
+      fixup.buffer->writeWord(fixup.offset, addr);
+      break;
+
+    case FixupType::ZeroPage:
+      if (addr > 0xff)
+        invalidInstruction(fixup.pos);
+      fixup.buffer->writeByte(fixup.offset, addr);
+      break;
+
+    case FixupType::Branch:
+    {
+      auto delta = static_cast<int>(addr) - (static_cast<int>(fixup.pc) + 2);
+      if (delta > 127 || delta < -128)
+        throwSourceError(fixup.pos, "Branch out of range");
+      fixup.buffer->writeByte(fixup.offset, delta);
+      break;
+    }
+
+    case FixupType::Table:
+      break;
+  }
+}
+
+// Values that decide how much space is used cannot wait for the linker.
+Address CodeGenerationPass::absolute(const Expression& expr)
+{
+  if (context_.relocatable && ! expr.term(context_).isAbsolute())
+    throwSourceError(expr.pos(), "Expression must not depend on segment addresses or imported symbols");
+  return expr.eval(context_);
+}
+
+// When assembling an object module, a value that depends on where a segment ends up, or on a symbol
+// from another module, is recorded along with the buffer offset it was written to; the bytes written
+// for it now are only provisional.
+bool CodeGenerationPass::relocate(const Expression& expr, Address value, RelocationKind kind, Offset offset)
+{
+  if (! context_.relocatable || ! segment_)
+    return false;
+  auto term = expr.term(context_);
+  if (term.isAbsolute())
+    return false;
+
+  int base = ImportAddress;
+  if (term.type == TermType::Segment)
+    base = context_.layout.segmentNamed(term.name)->base;
+  auto index = segment_ - &context_.layout.segments()[0];
+  context_.relocations.push_back({ segment_->name, static_cast<Offset>(offset - segmentStarts_[index]), kind, term, value - base });
+  return true;
+}
+
 void emit(Context& context)
 {
   CodeGenerationPass pass(context);
   pass.run();
 }
 
+// ----------------------------------------------------------------------------
+//      SinglePass
+// ----------------------------------------------------------------------------
+
+// Defines and emits each statement in turn, so the statement list is only walked once. Forward references
+// are handled exactly as the definition pass handles them, so the output is the same as from define and
+// emit.
+class SinglePass : public CodeGenerationPass
+{
+public:
+  SinglePass(Context& context) : CodeGenerationPass(context, true), definitions_(context), pc_(0) { }
+
+  void run();
+
+  bool before(Statement& node) override;
+
+private:
+  DefinitionPass definitions_;
+  ProgramCounter pc_;                         // Program counter of the definitions, which runs ahead
+};
+
+void SinglePass::run()
+{
+  definitions_.begin();
+  pc_ = context_.pc;
+  CodeGenerationPass::begin();
+  context_.statements.accept(*this);
+  definitions_.end();
+  CodeGenerationPass::end();
+}
+
+bool SinglePass::before(Statement& node)
+{
+  start_ = current_->offset();
+  context_.pc = pc_;
+  if (definitions_.before(node))
+    node.accept(definitions_);
+  pc_ = context_.pc;
+  return CodeGenerationPass::before(node);
+}
+
+void assemble(Context& context)
+{
+  SinglePass pass(context);
+  pass.run();
+}
+
 }
@@ -8,6 +8,10 @@ class Context;
 
 void emit(Context& context);
 
+// Defines and emits in a single pass over the statements, patching in forward references at the end.
+// Only for sources without segments that are not assembled as object modules.
+void assemble(Context& context);
+
 
 }
 #endif
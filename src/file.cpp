@@ -0,0 +1,258 @@
+// Copyright (c) 2018 Robert A. Stoerrle
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+// REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+// AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+// INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+// LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+// OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <climits>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include "path.h"
+#include "error.h"
+#include "file.h"
+
+namespace as64
+{
+
+// ----------------------------------------------------------------------------
+//      File Utilities
+// ----------------------------------------------------------------------------
+
+static bool hasContents(const std::string& filename, const std::vector<FileChunk>& chunks, size_t size) noexcept
+{
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  bool same = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && static_cast<size_t>(st.st_size) == size;
+  if (same && size > 0)
+  {
+    void *p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED)
+      same = false;
+    else
+    {
+      auto *contents = static_cast<const char *>(p);
+      for (const auto& chunk: chunks)
+      {
+        if (std::memcmp(contents, chunk.data, chunk.size) != 0)
+        {
+          same = false;
+          break;
+        }
+        contents += chunk.size;
+      }
+      munmap(p, size);
+    }
+  }
+  close(fd);
+  return same;
+}
+
+static bool writeChunks(int fd, const std::vector<FileChunk>& chunks) noexcept
+{
+  std::vector<iovec> iov;
+  for (const auto& chunk: chunks)
+  {
+    if (chunk.size)
+      iov.push_back({ const_cast<void *>(chunk.data), chunk.size });
+  }
+
+  // A short write leaves the remainder for another writev.
+  size_t index = 0;
+  while (index < iov.size())
+  {
+    auto count = writev(fd, &iov[index], std::min<size_t>(iov.size() - index, IOV_MAX));
+    if (count < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    for (; index < iov.size() && static_cast<size_t>(count) >= iov[index].iov_len; ++ index)
+      count -= iov[index].iov_len;
+    if (index < iov.size())
+    {
+      iov[index].iov_base = static_cast<char *>(iov[index].iov_base) + count;
+      iov[index].iov_len -= count;
+    }
+  }
+  return true;
+}
+
+// Writes the chunks to a new file named tempFilename and returns whether it succeeded, with errno set if it
+// didn't. An unnamed temporary file is tried first, so that nothing appears under the name until it is
+// complete. Giving it a name goes through /proc, so where that or O_TMPFILE isn't available, the file is
+// written under the name from the start. A file that replaces another gets its permissions, which a file
+// written in place would have kept.
+static bool writeTemporary(const std::string& directory, const char *tempFilename,
+                           const std::vector<FileChunk>& chunks, const struct stat *replaced) noexcept
+{
+  // A file left behind by an earlier run that crashed with the same process ID would be in the way.
+  unlink(tempFilename);
+
+#ifdef O_TMPFILE
+  int unnamedFd = open(directory.c_str(), O_TMPFILE | O_WRONLY, 0666);
+  if (unnamedFd >= 0)
+  {
+    if ((replaced && fchmod(unnamedFd, replaced->st_mode & 07777) != 0) || ! writeChunks(unnamedFd, chunks))
+    {
+      int code = errno;
+      close(unnamedFd);
+      errno = code;
+      return false;
+    }
+    char procPath[64];
+    snprintf(procPath, sizeof(procPath), "/proc/self/fd/%d", unnamedFd);
+    bool linked = linkat(AT_FDCWD, procPath, AT_FDCWD, tempFilename, AT_SYMLINK_FOLLOW) == 0;
+    close(unnamedFd);
+    if (linked)
+      return true;
+  }
+#endif
+
+  int fd = open(tempFilename, O_CREAT | O_EXCL | O_WRONLY, 0666);
+  if (fd < 0)
+    return false;
+  if ((replaced && fchmod(fd, replaced->st_mode & 07777) != 0) || ! writeChunks(fd, chunks))
+  {
+    int code = errno;
+    close(fd);
+    unlink(tempFilename);
+    errno = code;
+    return false;
+  }
+  close(fd);
+  return true;
+}
+
+// Output written through a symbolic link replaces the file that the link points to, and the link is kept.
+// A link that points nowhere is replaced itself.
+static std::string resolveLink(const std::string& filename)
+{
+  struct stat st;
+  if (lstat(filename.c_str(), &st) != 0 || ! S_ISLNK(st.st_mode))
+    return filename;
+  char path[PATH_MAX];
+  if (! realpath(filename.c_str(), path))
+    return filename;
+  return path;
+}
+
+bool saveFile(const std::string& filename, const std::vector<FileChunk>& chunks)
+{
+  size_t size = 0;
+  for (const auto& chunk: chunks)
+    size += chunk.size;
+  auto target = resolveLink(filename);
+  if (hasContents(target, chunks, size))
+    return false;
+
+  char tempFilename[PATH_MAX];
+  snprintf(tempFilename, sizeof(tempFilename), "%s.%ld.tmp", target.c_str(), static_cast<long>(getpid()));
+  struct stat st;
+  bool replacing = stat(target.c_str(), &st) == 0 && S_ISREG(st.st_mode);
+  if (! writeTemporary(dirname(target), tempFilename, chunks, replacing ? &st : nullptr))
+    throw SystemError(filename);
+
+  if (rename(tempFilename, target.c_str()) != 0)
+  {
+    int code = errno;
+    unlink(tempFilename);
+    throw SystemError(filename, code);
+  }
+  return true;
+}
+
+bool isRegularFile(const std::string& filename) noexcept
+{
+  struct stat st;
+  return stat(filename.c_str(), &st) == 0 && S_ISREG(st.st_mode);
+}
+
+// The modification time with nanoseconds is st_mtim in POSIX, but macOS names it st_mtimespec.
+static const timespec& modificationTime(const struct stat& st) noexcept
+{
+#if defined(__APPLE__)
+  return st.st_mtimespec;
+#else
+  return st.st_mtim;
+#endif
+}
+
+bool isNewer(const std::string& filename, const std::string& otherFilename) noexcept
+{
+  struct stat st, otherSt;
+  if (stat(filename.c_str(), &st) != 0 || stat(otherFilename.c_str(), &otherSt) != 0)
+    return false;
+  const auto& time = modificationTime(st);
+  const auto& otherTime = modificationTime(otherSt);
+  if (time.tv_sec != otherTime.tv_sec)
+    return time.tv_sec > otherTime.tv_sec;
+  return time.tv_nsec > otherTime.tv_nsec;
+}
+
+// ----------------------------------------------------------------------------
+//      MappedFile
+// ----------------------------------------------------------------------------
+
+MappedFile::MappedFile(const std::string& filename)
+  : filename_(filename), data_(nullptr), size_(0)
+{
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw SystemError(filename);
+
+  struct stat st;
+  if (fstat(fd, &st) != 0)
+  {
+    int code = errno;
+    close(fd);
+    throw SystemError(filename, code);
+  }
+  if (! S_ISREG(st.st_mode))
+  {
+    close(fd);
+    throw SystemError(filename, EINVAL);
+  }
+
+  // An empty file can't be mapped, and has nothing to map anyway.
+  size_ = st.st_size;
+  if (size_ > 0)
+  {
+    void *p = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED)
+    {
+      int code = errno;
+      close(fd);
+      throw SystemError(filename, code);
+    }
+    data_ = static_cast<const uint8_t *>(p);
+  }
+  close(fd);
+}
+
+MappedFile::~MappedFile() noexcept
+{
+  if (data_)
+    munmap(const_cast<uint8_t *>(data_), size_);
+}
+
+}
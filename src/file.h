@@ -0,0 +1,56 @@
+#ifndef _INCLUDED_AS64_FILE_H
+#define _INCLUDED_AS64_FILE_H
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+namespace as64
+{
+
+// ----------------------------------------------------------------------------
+//      File Utilities
+// ----------------------------------------------------------------------------
+
+struct FileChunk
+{
+  const void *data;
+  size_t size;
+};
+
+// Replaces the file atomically with the concatenated chunks, written with a single writev. A file whose
+// contents would not change is left alone, so that its modification time is preserved. Returns whether the
+// file was written.
+bool saveFile(const std::string& filename, const std::vector<FileChunk>& chunks);
+
+bool isRegularFile(const std::string& filename) noexcept;
+
+// Returns whether the first file exists and was modified after the second.
+bool isNewer(const std::string& filename, const std::string& otherFilename) noexcept;
+
+// ----------------------------------------------------------------------------
+//      MappedFile
+// ----------------------------------------------------------------------------
+
+// A read-only view of a file's contents, mapped into memory for as long as the object lives.
+class MappedFile
+{
+public:
+  explicit MappedFile(const std::string& filename);
+  MappedFile(const MappedFile& other) = delete;
+  ~MappedFile() noexcept;
+  MappedFile& operator=(const MappedFile& other) = delete;
+
+  const std::string& filename() const noexcept { return filename_; }
+  const uint8_t *data() const noexcept { return data_; }
+  size_t size() const noexcept { return size_; }
+
+private:
+  std::string filename_;
+  const uint8_t *data_;
+  size_t size_;
+};
+
+}
+#endif
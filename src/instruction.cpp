@@ -14,11 +14,11 @@
 
 #include <iostream>
 #include <algorithm>
+#include <unordered_map>
 #include "str.h"
 #include "enum.h"
 #include "table.h"
 #include "buffer.h"
-#include "table.h"
 #include "instruction.h"
 
 namespace as64
@@ -101,7 +101,33 @@ AddrMode indirectMode(IndexRegister index) noexcept
 bool isZeroPage(AddrMode mode) noexcept
 {
   return mode == AddrMode::ZeroPage || mode == AddrMode::ZeroPageX || mode == AddrMode::ZeroPageY ||
-         mode == AddrMode::IndexedIndirect || mode == AddrMode::IndirectIndexed;
+         mode == AddrMode::IndexedIndirect || mode == AddrMode::IndirectIndexed || mode == AddrMode::ZeroPageIndirect;
+}
+
+// ----------------------------------------------------------------------------
+//      Cpu
+// ----------------------------------------------------------------------------
+
+static EnumTags<Cpu> g_cpuTags =
+{
+  { Cpu::Mos6502,                 "6502" },
+  { Cpu::Mos6510,                 "6510" },
+  { Cpu::Mos6502X,                "6502x" },
+  { Cpu::Wdc65C02,                "65c02" },
+  { Cpu::Wdc65816,                "65816" }
+};
+
+std::string toString(Cpu cpu) noexcept
+{
+  return g_cpuTags.fromValue(cpu);
+}
+
+Maybe<Cpu> cpuNamed(const std::string& name) noexcept
+{
+  auto cpu = g_cpuTags.fromName(toLowerCase(name), Cpu::_End);
+  if (cpu == Cpu::_End)
+    return nullptr;
+  return cpu;
 }
 
 // ----------------------------------------------------------------------------
@@ -118,74 +144,294 @@ constexpr Opcode ____ = -1;
 
 static InstructionDef g_table[] =
 {
-  // Opcode   Accum   Immed   Imply   Rel     Abs     AbsX    AbsY    zp      zp,x    zp,y    Indir   (a, x)  (a),y
-  { "adc",    ____,   0x69,   ____,   ____,   0x6d,   0x7d,   0x79,   0x65,   0x75,   ____,   ____,   0x61,   0x71  },
-  { "and",    ____,   0x29,   ____,   ____,   0x2d,   0x3d,   0x39,   0x25,   0x35,   ____,   ____,   0x21,   0x31  },
-  { "asl",    0x0a,   ____,   ____,   ____,   0x0e,   0x1e,   ____,   0x06,   0x16,   ____,   ____,   ____,   ____  },
-  { "bcc",    ____,   ____,   ____,   0x90,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
-  { "bcs",    ____,   ____,   ____,   0xb0,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
-  { "beq",    ____,   ____,   ____,   0xf0,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
-  { "bit",    ____,   ____,   ____,   ____,   0x2c,   ____,   ____,   0x24,   ____,   ____,   ____,   ____,   ____  },
-  { "bmi",    ____,   ____,   ____,   0x30,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
-  { "bne",    ____,   ____,   ____,   0xd0,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
-  { "bpl",    ____,   ____,   ____,   0x10,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
-  { "brk",    ____,   ____,   0x00,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
-  { "bvc",    ____,   ____,   ____,   0x50,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
-  { "bvs",    ____,   ____,   ____,   0x70,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
-  { "clc",    ____,   ____,   0x18,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
-  { "cld",    ____,   ____,   0xd8,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
-  { "cli",    ____,   ____,   0x58,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
-  { "clv",    ____,   ____,   0xb8,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
-  { "cmp",    ____,   0xc9,   ____,   ____,   0xcd,   0xdd,   0xd9,   0xc5,   0xd5,   ____,   ____,   0xc1,   0xd1  },
-  { "cpx",    ____,   0xe0,   ____,   ____,   0xec,   ____,   ____,   0xe4,   ____,   ____,   ____,   ____,   ____  },
-  { "cpy",    ____,   0xc0,   ____,   ____,   0xcc,   ____,   ____,   0xc4,   ____,   ____,   ____,   ____,   ____  },
-  { "dec",    ____,   ____,   ____,   ____,   0xce,   0xde,   ____,   0xc6,   0xd6,   ____,   ____,   ____,   ____  },
-  { "dex",    ____,   ____,   0xca,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
-  { "dey",    ____,   ____,   0x88,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
-  { "eor",    ____,   0x49,   ____,   ____,   0x4d,   0x5d,   0x59,   0x45,   0x55,   ____,   ____,   0x41,   0x51  },
-  { "inc",    ____,   ____,   ____,   ____,   0xee,   0xfe,   ____,   0xe6,   0xf6,   ____,   ____,   ____,   ____  },
-  { "inx",    ____,   ____,   0xe8,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
-  { "iny",    ____,   ____,   0xc8,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
-  { "jmp",    ____,   ____,   ____,   ____,   0x4c,   ____,   ____,   ____,   ____,   ____,   0x6c,   ____,   ____  },
-  { "jsr",    ____,   ____,   ____,   ____,   0x20,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
-  { "lda",    ____,   0xa9,   ____,   ____,   0xad,   0xbd,   0xb9,   0xa5,   0xb5,   ____,   ____,   0xa1,   0xb1  },
-  { "ldx",    ____,   0xa2,   ____,   ____,   0xae,   ____,   0xbe,   0xa6,   ____,   0xb6,   ____,   ____,   ____  },
-  { "ldy",    ____,   0xa0,   ____,   ____,   0xac,   0xbc,   ____,   0xa4,   0xb4,   ____,   ____,   ____,   ____  },
-  { "lsr",    0x4a,   ____,   ____,   ____,   0x4e,   0x53,   ____,   0x46,   0x56,   ____,   ____,   ____,   ____  },
-  { "nop",    ____,   ____,   0xea,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
-  { "ora",    ____,   0x09,   ____,   ____,   0x0d,   0x1d,   0x19,   0x05,   0x15,   ____,   ____,   0x01,   0x11  },
-  { "pha",    ____,   ____,   0x48,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
-  { "php",    ____,   ____,   0x08,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
-  { "pla",    ____,   ____,   0x68,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
-  { "plp",    ____,   ____,   0x28,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
-  { "rol",    0x2a,   ____,   ____,   ____,   0x2e,   0x3e,   ____,   0x26,   0x36,   ____,   ____,   ____,   ____  },
-  { "ror",    0x6a,   ____,   ____,   ____,   0x6e,   0x7e,   ____,   0x66,   0x76,   ____,   ____,   ____,   ____  },
-  { "rti",    ____,   ____,   0x40,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
-  { "rts",    ____,   ____,   0x60,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
-  { "sbc",    ____,   0xe9,   ____,   ____,   0xed,   0xfd,   0xf9,   0xe5,   0xf5,   ____,   ____,   0xe1,   0xf1  },
-  { "sec",    ____,   ____,   0x38,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
-  { "sed",    ____,   ____,   0xf8,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
-  { "sei",    ____,   ____,   0x78,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
-  { "sta",    ____,   ____,   ____,   ____,   0x8d,   0x9d,   0x99,   0x85,   0x95,   ____,   ____,   0x81,   0x91  },
-  { "stx",    ____,   ____,   ____,   ____,   0x8e,   ____,   ____,   0x86,   ____,   0x96,   ____,   ____,   ____  },
-  { "sty",    ____,   ____,   ____,   ____,   0x8c,   ____,   ____,   0x84,   0x94,   ____,   ____,   ____,   ____  },
-  { "tax",    ____,   ____,   0xaa,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
-  { "tay",    ____,   ____,   0xa8,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
-  { "tsx",    ____,   ____,   0xba,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
-  { "txa",    ____,   ____,   0x8a,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
-  { "txs",    ____,   ____,   0x9a,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
-  { "tya",    ____,   ____,   0x98,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  }
+  // Opcode   Accum   Immed   Imply   Rel     Abs     AbsX    AbsY    zp      zp,x    zp,y    Indir   (a, x)  (a),y   (a)     (a16,x)
+  { "adc",    ____,   0x69,   ____,   ____,   0x6d,   0x7d,   0x79,   0x65,   0x75,   ____,   ____,   0x61,   0x71,   ____,   ____  },
+  { "and",    ____,   0x29,   ____,   ____,   0x2d,   0x3d,   0x39,   0x25,   0x35,   ____,   ____,   0x21,   0x31,   ____,   ____  },
+  { "asl",    0x0a,   ____,   ____,   ____,   0x0e,   0x1e,   ____,   0x06,   0x16,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "bcc",    ____,   ____,   ____,   0x90,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "bcs",    ____,   ____,   ____,   0xb0,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "beq",    ____,   ____,   ____,   0xf0,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "bit",    ____,   ____,   ____,   ____,   0x2c,   ____,   ____,   0x24,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "bmi",    ____,   ____,   ____,   0x30,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "bne",    ____,   ____,   ____,   0xd0,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "bpl",    ____,   ____,   ____,   0x10,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "brk",    ____,   ____,   0x00,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "bvc",    ____,   ____,   ____,   0x50,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "bvs",    ____,   ____,   ____,   0x70,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "clc",    ____,   ____,   0x18,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "cld",    ____,   ____,   0xd8,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "cli",    ____,   ____,   0x58,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "clv",    ____,   ____,   0xb8,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "cmp",    ____,   0xc9,   ____,   ____,   0xcd,   0xdd,   0xd9,   0xc5,   0xd5,   ____,   ____,   0xc1,   0xd1,   ____,   ____  },
+  { "cpx",    ____,   0xe0,   ____,   ____,   0xec,   ____,   ____,   0xe4,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "cpy",    ____,   0xc0,   ____,   ____,   0xcc,   ____,   ____,   0xc4,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "dec",    ____,   ____,   ____,   ____,   0xce,   0xde,   ____,   0xc6,   0xd6,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "dex",    ____,   ____,   0xca,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "dey",    ____,   ____,   0x88,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "eor",    ____,   0x49,   ____,   ____,   0x4d,   0x5d,   0x59,   0x45,   0x55,   ____,   ____,   0x41,   0x51,   ____,   ____  },
+  { "inc",    ____,   ____,   ____,   ____,   0xee,   0xfe,   ____,   0xe6,   0xf6,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "inx",    ____,   ____,   0xe8,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "iny",    ____,   ____,   0xc8,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "jmp",    ____,   ____,   ____,   ____,   0x4c,   ____,   ____,   ____,   ____,   ____,   0x6c,   ____,   ____,   ____,   ____  },
+  { "jsr",    ____,   ____,   ____,   ____,   0x20,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "lda",    ____,   0xa9,   ____,   ____,   0xad,   0xbd,   0xb9,   0xa5,   0xb5,   ____,   ____,   0xa1,   0xb1,   ____,   ____  },
+  { "ldx",    ____,   0xa2,   ____,   ____,   0xae,   ____,   0xbe,   0xa6,   ____,   0xb6,   ____,   ____,   ____,   ____,   ____  },
+  { "ldy",    ____,   0xa0,   ____,   ____,   0xac,   0xbc,   ____,   0xa4,   0xb4,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "lsr",    0x4a,   ____,   ____,   ____,   0x4e,   0x5e,   ____,   0x46,   0x56,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "nop",    ____,   ____,   0xea,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "ora",    ____,   0x09,   ____,   ____,   0x0d,   0x1d,   0x19,   0x05,   0x15,   ____,   ____,   0x01,   0x11,   ____,   ____  },
+  { "pha",    ____,   ____,   0x48,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "php",    ____,   ____,   0x08,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "pla",    ____,   ____,   0x68,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "plp",    ____,   ____,   0x28,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "rol",    0x2a,   ____,   ____,   ____,   0x2e,   0x3e,   ____,   0x26,   0x36,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "ror",    0x6a,   ____,   ____,   ____,   0x6e,   0x7e,   ____,   0x66,   0x76,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "rti",    ____,   ____,   0x40,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "rts",    ____,   ____,   0x60,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "sbc",    ____,   0xe9,   ____,   ____,   0xed,   0xfd,   0xf9,   0xe5,   0xf5,   ____,   ____,   0xe1,   0xf1,   ____,   ____  },
+  { "sec",    ____,   ____,   0x38,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "sed",    ____,   ____,   0xf8,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "sei",    ____,   ____,   0x78,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "sta",    ____,   ____,   ____,   ____,   0x8d,   0x9d,   0x99,   0x85,   0x95,   ____,   ____,   0x81,   0x91,   ____,   ____  },
+  { "stx",    ____,   ____,   ____,   ____,   0x8e,   ____,   ____,   0x86,   ____,   0x96,   ____,   ____,   ____,   ____,   ____  },
+  { "sty",    ____,   ____,   ____,   ____,   0x8c,   ____,   ____,   0x84,   0x94,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "tax",    ____,   ____,   0xaa,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "tay",    ____,   ____,   0xa8,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "tsx",    ____,   ____,   0xba,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "txa",    ____,   ____,   0x8a,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "txs",    ____,   ____,   0x9a,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "tya",    ____,   ____,   0x98,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  }
+};
+
+// Undocumented NMOS opcodes whose behavior does not depend on the chip revision or on bus timing.
+static InstructionDef g_undocumentedTable[] =
+{
+  // Opcode   Accum   Immed   Imply   Rel     Abs     AbsX    AbsY    zp      zp,x    zp,y    Indir   (a, x)  (a),y   (a)     (a16,x)
+  { "alr",    ____,   0x4b,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "anc",    ____,   0x0b,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "arr",    ____,   0x6b,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "dcp",    ____,   ____,   ____,   ____,   0xcf,   0xdf,   0xdb,   0xc7,   0xd7,   ____,   ____,   0xc3,   0xd3,   ____,   ____  },
+  { "isc",    ____,   ____,   ____,   ____,   0xef,   0xff,   0xfb,   0xe7,   0xf7,   ____,   ____,   0xe3,   0xf3,   ____,   ____  },
+  { "lax",    ____,   ____,   ____,   ____,   0xaf,   ____,   0xbf,   0xa7,   ____,   0xb7,   ____,   0xa3,   0xb3,   ____,   ____  },
+  { "rla",    ____,   ____,   ____,   ____,   0x2f,   0x3f,   0x3b,   0x27,   0x37,   ____,   ____,   0x23,   0x33,   ____,   ____  },
+  { "rra",    ____,   ____,   ____,   ____,   0x6f,   0x7f,   0x7b,   0x67,   0x77,   ____,   ____,   0x63,   0x73,   ____,   ____  },
+  { "sax",    ____,   ____,   ____,   ____,   0x8f,   ____,   ____,   0x87,   ____,   0x97,   ____,   0x83,   ____,   ____,   ____  },
+  { "sbx",    ____,   0xcb,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "slo",    ____,   ____,   ____,   ____,   0x0f,   0x1f,   0x1b,   0x07,   0x17,   ____,   ____,   0x03,   0x13,   ____,   ____  },
+  { "sre",    ____,   ____,   ____,   ____,   0x4f,   0x5f,   0x5b,   0x47,   0x57,   ____,   ____,   0x43,   0x53,   ____,   ____  }
+};
+
+// Instructions and addressing modes added by the 65C02.
+static InstructionDef g_cmosTable[] =
+{
+  // Opcode   Accum   Immed   Imply   Rel     Abs     AbsX    AbsY    zp      zp,x    zp,y    Indir   (a, x)  (a),y   (a)     (a16,x)
+  { "adc",    ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   0x72,   ____  },
+  { "and",    ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   0x32,   ____  },
+  { "bit",    ____,   0x89,   ____,   ____,   ____,   0x3c,   ____,   ____,   0x34,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "bra",    ____,   ____,   ____,   0x80,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "cmp",    ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   0xd2,   ____  },
+  { "dec",    0x3a,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "eor",    ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   0x52,   ____  },
+  { "inc",    0x1a,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "jmp",    ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   0x7c  },
+  { "lda",    ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   0xb2,   ____  },
+  { "ora",    ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   0x12,   ____  },
+  { "phx",    ____,   ____,   0xda,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "phy",    ____,   ____,   0x5a,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "plx",    ____,   ____,   0xfa,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "ply",    ____,   ____,   0x7a,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "sbc",    ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   0xf2,   ____  },
+  { "sta",    ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   0x92,   ____  },
+  { "stz",    ____,   ____,   ____,   ____,   0x9c,   0x9e,   ____,   0x64,   0x74,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "trb",    ____,   ____,   ____,   ____,   0x1c,   ____,   ____,   0x14,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "tsb",    ____,   ____,   ____,   ____,   0x0c,   ____,   ____,   0x04,   ____,   ____,   ____,   ____,   ____,   ____,   ____  }
+};
+
+// The 65816 instructions that work with 8-bit operands and 16-bit addresses. Long addressing, stack relative
+// modes, block moves and 16-bit relative branches are not supported.
+static InstructionDef g_65816Table[] =
+{
+  // Opcode   Accum   Immed   Imply   Rel     Abs     AbsX    AbsY    zp      zp,x    zp,y    Indir   (a, x)  (a),y   (a)     (a16,x)
+  { "cop",    ____,   0x02,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "jsr",    ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   0xfc  },
+  { "pea",    ____,   ____,   ____,   ____,   0xf4,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "pei",    ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   0xd4,   ____  },
+  { "phb",    ____,   ____,   0x8b,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "phd",    ____,   ____,   0x0b,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "phk",    ____,   ____,   0x4b,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "plb",    ____,   ____,   0xab,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "pld",    ____,   ____,   0x2b,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "rep",    ____,   0xc2,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "rtl",    ____,   ____,   0x6b,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "sep",    ____,   0xe2,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "stp",    ____,   ____,   0xdb,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "tcd",    ____,   ____,   0x5b,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "tcs",    ____,   ____,   0x1b,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "tdc",    ____,   ____,   0x7b,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "tsc",    ____,   ____,   0x3b,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "txy",    ____,   ____,   0x9b,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "tyx",    ____,   ____,   0xbb,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "wai",    ____,   ____,   0xcb,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "wdm",    ____,   0x42,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "xba",    ____,   ____,   0xeb,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  },
+  { "xce",    ____,   ____,   0xfb,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____,   ____  }
 };
 
-static Table<Instruction>& instructions() noexcept
+// ----------------------------------------------------------------------------
+//      Cycle Table
+// ----------------------------------------------------------------------------
+
+// Entries marked with _P take an extra cycle when indexing crosses a page boundary.
+constexpr Byte _P = 0x80;
+
+static Byte g_cycleTable[256] =
+{
+  //        x0      x1      x2      x3      x4      x5      x6      x7      x8      x9      xa      xb      xc      xd      xe      xf
+  /* 0x */  7,      6,      2,      8,      3,      3,      5,      5,      3,      2,      2,      2,      4,      4,      6,      6,
+  /* 1x */  2,      5|_P,   2,      8,      4,      4,      6,      6,      2,      4|_P,   2,      7,      4|_P,   4|_P,   7,      7,
+  /* 2x */  6,      6,      2,      8,      3,      3,      5,      5,      4,      2,      2,      2,      4,      4,      6,      6,
+  /* 3x */  2,      5|_P,   2,      8,      4,      4,      6,      6,      2,      4|_P,   2,      7,      4|_P,   4|_P,   7,      7,
+  /* 4x */  6,      6,      2,      8,      3,      3,      5,      5,      3,      2,      2,      2,      3,      4,      6,      6,
+  /* 5x */  2,      5|_P,   2,      8,      4,      4,      6,      6,      2,      4|_P,   2,      7,      4|_P,   4|_P,   7,      7,
+  /* 6x */  6,      6,      2,      8,      3,      3,      5,      5,      4,      2,      2,      2,      5,      4,      6,      6,
+  /* 7x */  2,      5|_P,   2,      8,      4,      4,      6,      6,      2,      4|_P,   2,      7,      4|_P,   4|_P,   7,      7,
+  /* 8x */  2,      6,      2,      6,      3,      3,      3,      3,      2,      2,      2,      2,      4,      4,      4,      4,
+  /* 9x */  2,      6,      2,      6,      4,      4,      4,      4,      2,      5,      2,      5,      5,      5,      5,      5,
+  /* ax */  2,      6,      2,      6,      3,      3,      3,      3,      2,      2,      2,      2,      4,      4,      4,      4,
+  /* bx */  2,      5|_P,   2,      5|_P,   4,      4,      4,      4,      2,      4|_P,   2,      4|_P,   4|_P,   4|_P,   4|_P,   4|_P,
+  /* cx */  2,      6,      2,      8,      3,      3,      5,      5,      2,      2,      2,      2,      4,      4,      6,      6,
+  /* dx */  2,      5|_P,   2,      8,      4,      4,      6,      6,      2,      4|_P,   2,      7,      4|_P,   4|_P,   7,      7,
+  /* ex */  2,      6,      2,      8,      3,      3,      5,      5,      2,      2,      2,      2,      4,      4,      6,      6,
+  /* fx */  2,      5|_P,   2,      8,      4,      4,      6,      6,      2,      4|_P,   2,      7,      4|_P,   4|_P,   7,      7
+};
+
+// The 65C02 takes an extra cycle for adc and sbc in decimal mode; that is left to the simulator.
+static Byte g_cmosCycleTable[256] =
+{
+  //        x0      x1      x2      x3      x4      x5      x6      x7      x8      x9      xa      xb      xc      xd      xe      xf
+  /* 0x */  7,      6,      2,      1,      5,      3,      5,      5,      3,      2,      2,      1,      6,      4,      6,      5,
+  /* 1x */  2,      5|_P,   5,      1,      5,      4,      6,      5,      2,      4|_P,   2,      1,      6,      4|_P,   6|_P,   5,
+  /* 2x */  6,      6,      2,      1,      3,      3,      5,      5,      4,      2,      2,      1,      4,      4,      6,      5,
+  /* 3x */  2,      5|_P,   5,      1,      4,      4,      6,      5,      2,      4|_P,   2,      1,      4|_P,   4|_P,   6|_P,   5,
+  /* 4x */  6,      6,      2,      1,      3,      3,      5,      5,      3,      2,      2,      1,      3,      4,      6,      5,
+  /* 5x */  2,      5|_P,   5,      1,      4,      4,      6,      5,      2,      4|_P,   3,      1,      8,      4|_P,   6|_P,   5,
+  /* 6x */  6,      6,      2,      1,      3,      3,      5,      5,      4,      2,      2,      1,      6,      4,      6,      5,
+  /* 7x */  2,      5|_P,   5,      1,      4,      4,      6,      5,      2,      4|_P,   4,      1,      6,      4|_P,   6|_P,   5,
+  /* 8x */  2,      6,      2,      1,      3,      3,      3,      5,      2,      2,      2,      1,      4,      4,      4,      5,
+  /* 9x */  2,      6,      5,      1,      4,      4,      4,      5,      2,      5,      2,      1,      4,      5,      5,      5,
+  /* ax */  2,      6,      2,      1,      3,      3,      3,      5,      2,      2,      2,      1,      4,      4,      4,      5,
+  /* bx */  2,      5|_P,   5,      1,      4,      4,      4,      5,      2,      4|_P,   2,      1,      4|_P,   4|_P,   4|_P,   5,
+  /* cx */  2,      6,      2,      1,      3,      3,      5,      5,      2,      2,      2,      3,      4,      4,      6,      5,
+  /* dx */  2,      5|_P,   5,      1,      4,      4,      6,      5,      2,      4|_P,   3,      3,      4,      4|_P,   7,      5,
+  /* ex */  2,      6,      2,      1,      3,      3,      5,      5,      2,      2,      2,      1,      4,      4,      6,      5,
+  /* fx */  2,      5|_P,   5,      1,      4,      4,      6,      5,      2,      4|_P,   4,      1,      4,      4|_P,   7,      5
+};
+
+// Emulation mode timings with 8-bit registers. Read-modify-write instructions with absolute,x addressing
+// always take seven cycles, as on the NMOS part.
+static Byte g_65816CycleTable[256] =
 {
-  static Table<Instruction> instance([](auto& table)
+  //        x0      x1      x2      x3      x4      x5      x6      x7      x8      x9      xa      xb      xc      xd      xe      xf
+  /* 0x */  7,      6,      7,      4,      5,      3,      5,      6,      3,      2,      2,      4,      6,      4,      6,      5,
+  /* 1x */  2,      5|_P,   5,      7,      5,      4,      6,      6,      2,      4|_P,   2,      2,      6,      4|_P,   7,      5,
+  /* 2x */  6,      6,      8,      4,      3,      3,      5,      6,      4,      2,      2,      5,      4,      4,      6,      5,
+  /* 3x */  2,      5|_P,   5,      7,      4,      4,      6,      6,      2,      4|_P,   2,      2,      4|_P,   4|_P,   7,      5,
+  /* 4x */  6,      6,      2,      4,      7,      3,      5,      6,      3,      2,      2,      3,      3,      4,      6,      5,
+  /* 5x */  2,      5|_P,   5,      7,      7,      4,      6,      6,      2,      4|_P,   3,      2,      4,      4|_P,   7,      5,
+  /* 6x */  6,      6,      6,      4,      3,      3,      5,      6,      4,      2,      2,      6,      5,      4,      6,      5,
+  /* 7x */  2,      5|_P,   5,      7,      4,      4,      6,      6,      2,      4|_P,   4,      2,      6,      4|_P,   7,      5,
+  /* 8x */  2,      6,      4,      4,      3,      3,      3,      6,      2,      2,      2,      3,      4,      4,      4,      5,
+  /* 9x */  2,      6,      5,      7,      4,      4,      4,      6,      2,      5,      2,      2,      4,      5,      5,      5,
+  /* ax */  2,      6,      2,      4,      3,      3,      3,      6,      2,      2,      2,      4,      4,      4,      4,      5,
+  /* bx */  2,      5|_P,   5,      7,      4,      4,      4,      6,      2,      4|_P,   2,      2,      4|_P,   4|_P,   4|_P,   5,
+  /* cx */  2,      6,      3,      4,      3,      3,      5,      6,      2,      2,      2,      3,      4,      4,      6,      5,
+  /* dx */  2,      5|_P,   5,      7,      6,      4,      6,      6,      2,      4|_P,   3,      3,      6,      4|_P,   7,      5,
+  /* ex */  2,      6,      3,      4,      3,      3,      5,      6,      2,      2,      2,      3,      4,      4,      6,      5,
+  /* fx */  2,      5|_P,   5,      7,      5,      4,      6,      6,      2,      4|_P,   4,      2,      8,      4|_P,   7,      5
+};
+
+static const Byte *cycleTable(Cpu cpu) noexcept
+{
+  switch (cpu)
   {
-    for (const auto& def: g_table)
-      table.emplace(def.name, def.name, def.opcodes);
-  });
+    case Cpu::Wdc65C02:
+      return g_cmosCycleTable;
+
+    case Cpu::Wdc65816:
+      return g_65816CycleTable;
 
-  return instance;
+    default:
+      return g_cycleTable;
+  }
+}
+
+int cycleCount(Opcode opcode, Cpu cpu) noexcept
+{
+  return isValid(opcode) ? cycleTable(cpu)[opcode & 0xff] & ~_P : 0;
+}
+
+bool hasPageCrossingPenalty(Opcode opcode, Cpu cpu) noexcept
+{
+  return isValid(opcode) && (cycleTable(cpu)[opcode & 0xff] & _P) != 0;
+}
+
+// Each processor gets a single table holding its complete instruction set, so that looking up a mnemonic
+// costs one hash probe whichever processor is selected.
+static Table<Instruction> buildInstructions(Cpu cpu) noexcept
+{
+  std::unordered_map<std::string, OpcodeArray> opcodes;
+  auto add = [&](const auto& defs)
+  {
+    for (const auto& def: defs)
+    {
+      auto i = opcodes.emplace(def.name, def.opcodes);
+      if (i.second)
+        continue;
+      for (size_t mode = 0; mode < AddrModeCount; ++ mode)
+      {
+        if (isValid(def.opcodes[mode]))
+          i.first->second[mode] = def.opcodes[mode];
+      }
+    }
+  };
+
+  add(g_table);
+  switch (cpu)
+  {
+    case Cpu::Mos6502X:
+      add(g_undocumentedTable);
+      break;
+
+    case Cpu::Wdc65C02:
+      add(g_cmosTable);
+      break;
+
+    case Cpu::Wdc65816:
+      add(g_cmosTable);
+      add(g_65816Table);
+      break;
+
+    default:
+      break;
+  }
+
+  Table<Instruction> table;
+  for (const auto& entry: opcodes)
+    table.emplace(entry.first, entry.first, entry.second);
+  return table;
+}
+
+static Table<Instruction>& instructions(Cpu cpu) noexcept
+{
+  static std::array<Table<Instruction>, CpuCount> tables = []
+  {
+    std::array<Table<Instruction>, CpuCount> result;
+    for (size_t cpu = 0; cpu < CpuCount; ++ cpu)
+      result[cpu] = buildInstructions(static_cast<Cpu>(cpu));
+    return result;
+  }();
+
+  return tables[static_cast<size_t>(cpu)];
 }
 
 // ----------------------------------------------------------------------------
@@ -230,44 +476,63 @@ Maybe<ByteLength> Instruction::encodeImmediate(CodeWriter *writer, Byte value) c
   return 2;
 }
 
+Maybe<AddrMode> Instruction::directMode(Address addr, IndexRegister index, bool forceAbsolute) const noexcept
+{
+  if (addr < 0x100 && ! forceAbsolute && supports(zeroPageMode(index)))
+    return zeroPageMode(index);
+  if (supports(absoluteMode(index)))
+    return absoluteMode(index);
+  return nullptr;
+}
+
 Maybe<ByteLength> Instruction::encodeDirect(CodeWriter *writer, Address addr,
                                             IndexRegister index, bool forceAbsolute) const noexcept
 {
-  if (addr < 0x100 && ! forceAbsolute)
-  {
-    auto op = opcode(zeroPageMode(index));
-    if (isValid(op))
-    {
-      if (writer)
-      {
-        writer->byte(op);
-        writer->byte(addr);
-      }
-      return 2;
-    }
-  }
-  auto op = opcode(absoluteMode(index));
-  if (isValid(op))
+  auto mode = directMode(addr, index, forceAbsolute);
+  if (! mode.hasValue())
+    return nullptr;
+
+  auto op = opcode(*mode);
+  if (isZeroPage(*mode))
   {
     if (writer)
     {
       writer->byte(op);
-      writer->word(addr);
+      writer->byte(addr);
     }
-    return 3;
+    return 2;
   }
 
+  if (writer)
+  {
+    writer->byte(op);
+    writer->word(addr);
+  }
+  return 3;
+}
+
+Maybe<AddrMode> Instruction::indirectMode(IndexRegister index) const noexcept
+{
+  // No instruction has both the zero page and the absolute form of an indirect mode, so the mode, and
+  // with it the length, never depends on the address.
+  auto mode = as64::indirectMode(index);
+  if (supports(mode))
+    return mode;
+  if (index == IndexRegister::None && supports(AddrMode::ZeroPageIndirect))
+    return AddrMode::ZeroPageIndirect;
+  if (index == IndexRegister::X && supports(AddrMode::AbsoluteIndexedIndirect))
+    return AddrMode::AbsoluteIndexedIndirect;
   return nullptr;
 }
 
 Maybe<ByteLength> Instruction::encodeIndirect(CodeWriter *writer, Address addr, IndexRegister index) const noexcept
 {
   auto mode = indirectMode(index);
-  auto op = opcode(mode);
-  if (! isValid(op))
+  if (! mode.hasValue())
     return nullptr;
 
-  if (mode == AddrMode::Indirect)
+  auto op = opcode(*mode);
+  if (! isZeroPage(*mode))
   {
     if (writer)
     {
@@ -311,9 +576,15 @@ Maybe<ByteLength> Instruction::encodeRelative(CodeWriter *writer, Address from,
   return encodeRelative(writer, delta);
 }
 
-Instruction *instructionNamed(const std::string& name) noexcept
+Instruction *instructionNamed(const std::string& name, Cpu cpu) noexcept
+{
+  return instructions(cpu).get(toLowerCase(name));
+}
+
+void forEachInstruction(Cpu cpu, std::function<void (const Instruction&)> fn) noexcept
 {
-  return instructions().get(toLowerCase(name));
+  for (const auto& entry: instructions(cpu))
+    fn(entry.second);
 }
 
 }
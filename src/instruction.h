@@ -3,7 +3,9 @@
 
 #include <string>
 #include <array>
+#include <functional>
 #include <cstdint>
+#include "types.h"
 
 namespace as64
 {
@@ -42,6 +44,8 @@ enum class AddrMode
   Indirect,
   IndexedIndirect,
   IndirectIndexed,
+  ZeroPageIndirect,                           // (zp) on the 65C02 and later
+  AbsoluteIndexedIndirect,                    // (abs,x) on the 65C02 and later
 
   _End
 };
@@ -53,6 +57,27 @@ AddrMode zeroPageMode(IndexRegister index) noexcept;
 AddrMode indirectMode(IndexRegister index) noexcept;
 bool isZeroPage(AddrMode mode) noexcept;
 
+// ----------------------------------------------------------------------------
+//      Cpu
+// ----------------------------------------------------------------------------
+
+enum class Cpu
+{
+  Mos6502,
+  Mos6510,
+  Mos6502X,                                   // NMOS 6502 with the stable undocumented opcodes
+  Wdc65C02,
+  Wdc65816,                                   // Emulation mode instructions with 8-bit operands only
+
+  _End
+};
+
+constexpr size_t CpuCount = static_cast<size_t>(Cpu::_End);
+
+std::string toString(Cpu cpu) noexcept;
+Maybe<Cpu> cpuNamed(const std::string& name) noexcept;
+constexpr bool isCmos(Cpu cpu) noexcept { return cpu == Cpu::Wdc65C02 || cpu == Cpu::Wdc65816; }
+
 // ----------------------------------------------------------------------------
 //      Opcode
 // ----------------------------------------------------------------------------
@@ -63,6 +88,10 @@ constexpr bool isValid(Opcode opcode) noexcept { return opcode >= 0; }
 
 using OpcodeArray = std::array<Opcode, AddrModeCount>;
 
+// Base cycle counts exclude the extra cycle taken by a branch and the page crossing penalty.
+int cycleCount(Opcode opcode, Cpu cpu = Cpu::Mos6502) noexcept;
+bool hasPageCrossingPenalty(Opcode opcode, Cpu cpu = Cpu::Mos6502) noexcept;
+
 // ----------------------------------------------------------------------------
 //      Instruction
 // ----------------------------------------------------------------------------
@@ -77,6 +106,8 @@ public:
   Opcode opcode(AddrMode mode) const noexcept { return opcodes_[static_cast<int>(mode)]; }
   bool isRelative() const noexcept { return isValid(opcode(AddrMode::Relative)); }
   bool isImplied() const noexcept { return isValid(opcode(AddrMode::Implied)); }
+  Maybe<AddrMode> directMode(Address addr, IndexRegister index, bool forceAbsolute = false) const noexcept;
+  Maybe<AddrMode> indirectMode(IndexRegister index) const noexcept;
 
   Maybe<ByteLength> encodeImplied(CodeWriter *writer) const noexcept;
   Maybe<ByteLength> encodeAccumulator(CodeWriter *writer) const noexcept;
@@ -91,7 +122,8 @@ private:
   OpcodeArray opcodes_;
 };
 
-Instruction *instructionNamed(const std::string& name) noexcept;
+Instruction *instructionNamed(const std::string& name, Cpu cpu = Cpu::Mos6502) noexcept;
+void forEachInstruction(Cpu cpu, std::function<void (const Instruction&)> fn) noexcept;
 
 }
 #endif
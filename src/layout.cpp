@@ -0,0 +1,202 @@
+// Copyright (c) 2018 Robert A. Stoerrle
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+// REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+// AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+// INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+// LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+// OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cstdlib>
+#include "str.h"
+#include "layout.h"
+
+namespace as64
+{
+
+static bool parseAddress(const std::string& text, Address& addr) noexcept
+{
+  const char *p = text.c_str();
+  int base = 10;
+  if (*p == '$')
+  {
+    ++ p;
+    base = 16;
+  }
+  else if (text.compare(0, 2, "0x") == 0)
+  {
+    p += 2;
+    base = 16;
+  }
+
+  char *end;
+  long value = std::strtol(p, &end, base);
+  if (! *p || *end || value < 0 || value > 0xffff)
+    return false;
+  addr = value;
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+//      Layout
+// ----------------------------------------------------------------------------
+
+Segment *Layout::segmentNamed(const std::string& name) noexcept
+{
+  for (auto& segment: segments_)
+  {
+    if (segment.name == name)
+      return &segment;
+  }
+  return nullptr;
+}
+
+int Layout::regionNamed(const std::string& name) const noexcept
+{
+  for (size_t i = 0; i < regions_.size(); ++ i)
+  {
+    if (regions_[i].name == name)
+      return i;
+  }
+  return -1;
+}
+
+void Layout::load(const std::string& filename)
+{
+  std::ifstream s(filename);
+  if (! s.is_open())
+    throw SystemError(filename);
+
+  std::string text;
+  for (int lineNumber = 1; std::getline(s, text); ++ lineNumber)
+  {
+    auto fail = [&](const std::string& message) {
+      throw LayoutError(filename + ":" + std::to_string(lineNumber) + ": " + message);
+    };
+
+    auto comment = text.find_first_of("#;");
+    if (comment != std::string::npos)
+      text.erase(comment);
+    for (auto& c: text)
+    {
+      if (c == ',')
+        c = ' ';
+    }
+    std::istringstream line(text);
+    std::vector<std::string> words;
+    for (std::string word; line >> word; )
+      words.push_back(word);
+    if (words.empty())
+      continue;
+
+    if (words[0] == "memory")
+    {
+      MemoryRegion region { "", 0, 0, "", 0 };
+      if (words.size() != 4 && ! (words.size() == 6 && words[4] == "file"))
+        fail("Expected memory <name> <start> <end> [file \"<filename>\"]");
+      region.name = words[1];
+      if (regionNamed(region.name) >= 0)
+        fail("Memory region '" + region.name + "' already exists");
+      if (! parseAddress(words[2], region.start) || ! parseAddress(words[3], region.end) || region.end < region.start)
+        fail("Invalid address range for memory region '" + region.name + "'");
+      if (words.size() == 6)
+      {
+        region.filename = words[5];
+        if (region.filename.size() >= 2 && region.filename.front() == '"' && region.filename.back() == '"')
+          region.filename = region.filename.substr(1, region.filename.size() - 2);
+      }
+      regions_.push_back(region);
+    }
+    else if (words[0] == "segment")
+    {
+      Segment segment { "", {}, false, 0, 0, -1 };
+      if (words.size() < 3)
+        fail("Expected segment <name> <memory>[, <memory> ...] [bss]");
+      segment.name = words[1];
+      if (segmentNamed(segment.name))
+        fail("Segment '" + segment.name + "' already exists");
+      for (size_t i = 2; i < words.size(); ++ i)
+      {
+        if (words[i] == "bss" && i == words.size() - 1)
+        {
+          segment.bss = true;
+          continue;
+        }
+        auto region = regionNamed(words[i]);
+        if (region < 0)
+          fail("Unknown memory region '" + words[i] + "'");
+        segment.regions.push_back(region);
+      }
+      if (segment.regions.empty())
+        fail("Segment '" + segment.name + "' has no memory region");
+      segments_.push_back(segment);
+    }
+    else
+      fail("Expected memory or segment");
+  }
+}
+
+void Layout::place()
+{
+  for (auto& region: regions_)
+    region.used = 0;
+
+  for (auto& segment: segments_)
+  {
+    segment.region = -1;
+    for (auto index: segment.regions)
+    {
+      auto& region = regions_[index];
+      if (region.start + region.used + segment.size <= region.end + 1)
+      {
+        segment.base = region.start + region.used;
+        segment.region = index;
+        region.used += segment.size;
+        break;
+      }
+    }
+
+    if (segment.region < 0)
+    {
+      std::string names;
+      for (auto index: segment.regions)
+        names += (names.empty() ? "" : ", ") + regions_[index].name;
+      char buf[256];
+      snprintf(buf, sizeof(buf), "Segment '%s' (%d byte(s)) does not fit in memory region(s) %s",
+               segment.name.c_str(), segment.size, names.c_str());
+      throw LayoutError(buf);
+    }
+  }
+}
+
+void Layout::report(std::ostream& s) const noexcept
+{
+  char buf[256];
+  s << "Region           Start  End      Size    Used    Free" << std::endl;
+  for (size_t i = 0; i < regions_.size(); ++ i)
+  {
+    const auto& region = regions_[i];
+    int size = region.end - region.start + 1;
+    snprintf(buf, sizeof(buf), "%-16s $%04x  $%04x  %6d  %6d  %6d", region.name.c_str(), region.start, region.end,
+             size, region.used, size - region.used);
+    s << buf << std::endl;
+    for (const auto& segment: segments_)
+    {
+      if (segment.region != static_cast<int>(i) || ! segment.size)
+        continue;
+      snprintf(buf, sizeof(buf), "  %-14s $%04x  $%04x  %6d%s", segment.name.c_str(), segment.base,
+               segment.base + segment.size - 1, segment.size, segment.bss ? "  (bss)" : "");
+      s << buf << std::endl;
+    }
+  }
+}
+
+}
@@ -0,0 +1,82 @@
+#ifndef _INCLUDED_AS64_LAYOUT_H
+#define _INCLUDED_AS64_LAYOUT_H
+
+#include <string>
+#include <vector>
+#include <ostream>
+#include "types.h"
+#include "error.h"
+
+namespace as64
+{
+
+// ----------------------------------------------------------------------------
+//      Layout
+// ----------------------------------------------------------------------------
+
+// A layout is read from a configuration file with one declaration per line:
+//
+//   memory <name> <start> <end> [file "<filename>"]
+//   segment <name> <memory>[, <memory> ...] [bss]
+//
+// Segments are placed in declaration order, each in the first of its memory regions with enough room
+// left. Regions without a file go into the default output file; bss segments reserve space but
+// produce no output.
+
+struct MemoryRegion
+{
+  std::string name;
+  Address start;
+  Address end;
+  std::string filename;
+  int used;
+};
+
+struct Segment
+{
+  std::string name;
+  std::vector<int> regions;
+  bool bss;
+  int size;
+  Address base;
+  int region;                                 // Index of the region the segment was placed in
+};
+
+class Layout
+{
+public:
+  bool isEmpty() const noexcept { return segments_.empty(); }
+  const std::vector<MemoryRegion>& regions() const noexcept { return regions_; }
+  std::vector<Segment>& segments() noexcept { return segments_; }
+  const std::vector<Segment>& segments() const noexcept { return segments_; }
+  Segment *segmentNamed(const std::string& name) noexcept;
+
+  void load(const std::string& filename);
+  void place();
+  void report(std::ostream& s) const noexcept;
+
+private:
+  int regionNamed(const std::string& name) const noexcept;
+
+  std::vector<MemoryRegion> regions_;
+  std::vector<Segment> segments_;
+};
+
+// ----------------------------------------------------------------------------
+//      LayoutError
+// ----------------------------------------------------------------------------
+
+class LayoutError : public GeneralError
+{
+public:
+  LayoutError(const std::string& message) noexcept : message_(message) { }
+
+  const char *what() const noexcept override { return "Layout Error"; }
+  std::string message() const noexcept override { return message_; }
+
+private:
+  std::string message_;
+};
+
+}
+#endif
@@ -0,0 +1,228 @@
+// Copyright (c) 2018 Robert A. Stoerrle
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+// REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+// AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+// INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+// LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+// OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+#include <algorithm>
+#include <cstdio>
+#include "linker.h"
+#include "str.h"
+
+namespace as64
+{
+
+// ----------------------------------------------------------------------------
+//      Linker
+// ----------------------------------------------------------------------------
+
+void Linker::link()
+{
+  joinSegments();
+  defineSymbols();
+  createBuffers();
+  applyFixups();
+}
+
+void Linker::writeSymbols(std::ostream& s) const noexcept
+{
+  std::vector<std::pair<std::string, Address>> entries;
+  size_t longestName = 0;
+  for (const auto& symbol: symbols_)
+  {
+    const auto& definitions = symbol.second;
+    if (std::any_of(std::begin(definitions), std::end(definitions),
+                    [&](const auto& d) { return d.value != definitions.front().value; }))
+      continue;
+    longestName = std::max(longestName, symbol.first.length());
+    entries.push_back({ symbol.first, definitions.front().value });
+  }
+  std::sort(std::begin(entries), std::end(entries), [](const auto& a, const auto& b)
+  {
+    return a.second < b.second || (a.second == b.second && a.first < b.first);
+  });
+
+  if (longestName % 2)
+    ++ longestName;
+  longestName += 2;
+  for (const auto& entry: entries)
+  {
+    char addrText[16];
+    std::snprintf(addrText, sizeof(addrText), "%04x", entry.second);
+    s << padRight(entry.first, longestName) << "= $" << addrText << std::endl;
+  }
+}
+
+// The parts of each segment are laid end to end in module order, so a segment's size is the sum of its
+// parts and each part's address is known as soon as the joined segments are placed.
+void Linker::joinSegments()
+{
+  auto& segments = layout_.segments();
+  for (auto& segment: segments)
+    segment.size = 0;
+
+  std::vector<std::vector<int>> starts;
+  for (const auto& module: modules_)
+  {
+    segmentIndexes_.emplace_back();
+    starts.emplace_back();
+    for (const auto& part: module->segments)
+    {
+      auto *segment = layout_.segmentNamed(part.name);
+      if (! segment)
+        throw LinkError("Segment '" + part.name + "' in '" + module->filename + "' is not in the layout");
+      if (segment->bss && ! part.bss && part.size)
+        throw LinkError("Segment '" + part.name + "' in '" + module->filename + "' has contents, but the layout makes it bss");
+
+      segmentIndexes_.back().push_back(segment - &segments[0]);
+      starts.back().push_back(segment->size);
+      segment->size += part.size;
+      if (segment->size > 65536)
+        throw LinkError("Segment '" + part.name + "' is larger than 64K");
+    }
+  }
+
+  layout_.place();
+
+  for (size_t m = 0; m < modules_.size(); ++ m)
+  {
+    segmentAddrs_.emplace_back();
+    for (size_t i = 0; i < segmentIndexes_[m].size(); ++ i)
+      segmentAddrs_.back().push_back(segments[segmentIndexes_[m][i]].base + starts[m][i]);
+  }
+}
+
+void Linker::defineSymbols()
+{
+  for (size_t m = 0; m < modules_.size(); ++ m)
+  {
+    for (const auto& symbol: modules_[m]->symbols)
+    {
+      Address value = symbol.value;
+      if (symbol.segment >= 0)
+        value += segmentAddrs_[m][symbol.segment];
+      symbols_[symbol.name].push_back({ value, modules_[m].get() });
+    }
+  }
+}
+
+// As when assembling, each output file holds the segments placed in the memory regions that name it,
+// from the lowest segment up, with any gaps between segments filled with zeroes.
+void Linker::createBuffers()
+{
+  const auto& regions = layout_.regions();
+  const auto& segments = layout_.segments();
+  segmentBuffers_.assign(segments.size(), nullptr);
+  for (size_t i = 0; i < segments.size(); ++ i)
+  {
+    const auto& segment = segments[i];
+    if (segment.bss || segment.size == 0)
+      continue;
+    const auto& filename = regions[segment.region].filename;
+    auto buffer = std::find_if(std::begin(buffers_), std::end(buffers_), [&](const auto& b) { return b->filename() == filename; });
+    if (buffer == std::end(buffers_))
+    {
+      buffers_.push_back(std::make_unique<CodeBuffer>());
+      buffers_.back()->setFilename(filename);
+      buffers_.back()->setOrigin(segment.base);
+      buffer = std::end(buffers_) - 1;
+    }
+    else
+      (*buffer)->setOrigin(std::min((*buffer)->origin(), segment.base));
+    segmentBuffers_[i] = buffer->get();
+  }
+
+  for (size_t m = 0; m < modules_.size(); ++ m)
+  {
+    const auto& parts = modules_[m]->segments;
+    for (size_t i = 0; i < parts.size(); ++ i)
+    {
+      auto *buffer = segmentBuffers_[segmentIndexes_[m][i]];
+      if (! buffer || parts[i].bss || parts[i].data.empty())
+        continue;
+      CodeWriter writer(buffer);
+      writer.attach(buffer, segmentAddrs_[m][i] - buffer->origin());
+      for (auto value: parts[i].data)
+        writer.byte(value);
+    }
+  }
+}
+
+void Linker::applyFixups()
+{
+  char buf[256];
+  for (size_t m = 0; m < modules_.size(); ++ m)
+  {
+    const auto& module = *modules_[m];
+    for (const auto& fixup: module.fixups)
+    {
+      auto *buffer = segmentBuffers_[segmentIndexes_[m][fixup.segment]];
+      if (! buffer)
+        continue;
+      Address addr = segmentAddrs_[m][fixup.segment] + fixup.offset;
+
+      int value = fixup.addend;
+      if (fixup.termType == TermType::Segment)
+        value += segmentAddrs_[m][fixup.termSegment];
+      else if (fixup.termType == TermType::Import)
+        value += resolve(fixup.import, module);
+      if (value < 0 || value > 0xffff)
+      {
+        snprintf(buf, sizeof(buf), "Relocated value at $%04x in '%s' is out of range (%d)", addr, module.filename.c_str(), value);
+        throw LinkError(buf);
+      }
+
+      Offset offset = addr - buffer->origin();
+      switch (fixup.kind)
+      {
+        case RelocationKind::Word:
+          buffer->writeWord(offset, value);
+          break;
+
+        case RelocationKind::Byte:
+          if (value > 0xff)
+          {
+            snprintf(buf, sizeof(buf), "Relocated value at $%04x in '%s' does not fit in a byte ($%04x)",
+                     addr, module.filename.c_str(), value);
+            throw LinkError(buf);
+          }
+          buffer->writeByte(offset, value);
+          break;
+
+        case RelocationKind::Low:
+          buffer->writeByte(offset, value & 0xff);
+          break;
+
+        case RelocationKind::High:
+          buffer->writeByte(offset, value >> 8);
+          break;
+      }
+    }
+  }
+}
+
+Address Linker::resolve(const std::string& name, const ObjectModule& module) const
+{
+  auto symbol = symbols_.find(name);
+  if (symbol == std::end(symbols_))
+    throw LinkError("Undefined symbol '" + name + "' in '" + module.filename + "'");
+
+  const auto& definitions = symbol->second;
+  for (const auto& definition: definitions)
+  {
+    if (definition.value != definitions.front().value)
+      throw LinkError("Symbol '" + name + "' used in '" + module.filename + "' is defined differently in '" +
+                      definitions.front().module->filename + "' and '" + definition.module->filename + "'");
+  }
+  return definitions.front().value;
+}
+
+}
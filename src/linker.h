@@ -0,0 +1,76 @@
+#ifndef _INCLUDED_AS64_LINKER_H
+#define _INCLUDED_AS64_LINKER_H
+
+#include <string>
+#include <memory>
+#include <vector>
+#include <ostream>
+#include <unordered_map>
+#include "types.h"
+#include "error.h"
+#include "buffer.h"
+#include "layout.h"
+#include "object.h"
+
+namespace as64
+{
+
+// ----------------------------------------------------------------------------
+//      Linker
+// ----------------------------------------------------------------------------
+
+// Object modules are linked by joining the parts of each segment in the order the modules were added,
+// placing the joined segments according to the layout, and then fixing up every relocation. Every named
+// symbol is exported, so the same name may be defined by several modules; that is only an error if the
+// definitions differ and the name is imported somewhere.
+class Linker
+{
+public:
+  Linker(Layout& layout) noexcept : layout_(layout) { }
+
+  void add(std::unique_ptr<ObjectModule> module) { modules_.push_back(std::move(module)); }
+  void link();
+
+  std::vector<std::unique_ptr<CodeBuffer>>& buffers() noexcept { return buffers_; }
+  void writeSymbols(std::ostream& s) const noexcept;
+
+private:
+  struct Definition
+  {
+    Address value;
+    const ObjectModule *module;
+  };
+
+  void joinSegments();
+  void defineSymbols();
+  void createBuffers();
+  void applyFixups();
+  Address resolve(const std::string& name, const ObjectModule& module) const;
+
+  Layout& layout_;
+  std::vector<std::unique_ptr<ObjectModule>> modules_;
+  std::vector<std::vector<int>> segmentIndexes_;    // Layout segment index of each module segment
+  std::vector<std::vector<Address>> segmentAddrs_;  // Final address of each module segment
+  std::unordered_map<std::string, std::vector<Definition>> symbols_;
+  std::vector<std::unique_ptr<CodeBuffer>> buffers_;
+  std::vector<CodeBuffer *> segmentBuffers_;        // Output buffer of each layout segment
+};
+
+// ----------------------------------------------------------------------------
+//      LinkError
+// ----------------------------------------------------------------------------
+
+class LinkError : public GeneralError
+{
+public:
+  LinkError(const std::string& message) noexcept : message_(message) { }
+
+  const char *what() const noexcept override { return "Link Error"; }
+  std::string message() const noexcept override { return message_; }
+
+private:
+  std::string message_;
+};
+
+}
+#endif
@@ -0,0 +1,114 @@
+// Copyright (c) 2018 Robert A. Stoerrle
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+// REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+// AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+// INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+// LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+// OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+#include <iostream>
+#include "error.h"
+#include "layout.h"
+#include "object.h"
+#include "linker.h"
+#include "output.h"
+#include "cmdline.h"
+
+using namespace as64;
+
+constexpr const char *g_version = "v1.0.1";
+
+static void usage()
+{
+  std::cout << "as64-link [options] <file> ..." << std::endl;
+  std::cout << "  -T <file>           Place segments according to the memory layout in <file> (required)" << std::endl;
+  std::cout << "  -o <file>           Specify output filename" << std::endl;
+  std::cout << "  -O <path>           Specify output directory" << std::endl;
+  std::cout << "  -F <format>         Select the output format: prg (default), bin, hex, crt, crt:magicdesk or crt:easyflash" << std::endl;
+  std::cout << "  --map               Write the memory layout with used and free space to standard output" << std::endl;
+  std::cout << "  -s                  Write the symbol table to standard output" << std::endl;
+  std::cout << "  -h                  Show help text" << std::endl;
+  std::cout << "  -v                  Show version number" << std::endl;
+  std::cout << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+  bool showHelpText = false, showVersion = false, mapToStdout = false, symbolsToStdout = false;
+  std::string outputFilename, outputPath, layoutFilename, formatName = "prg";
+  auto inputFilenames = parseCommandLine(argc, argv,
+  {
+    { 'h',    false,      [&](const auto& value) { showHelpText = true; } },
+    { 'v',    false,      [&](const auto& value) { showVersion = true; } },
+    { 'o',    true,       [&](const auto& value) { outputFilename = value; } },
+    { 'O',    true,       [&](const auto& value) { outputPath = value; } },
+    { 'F',    true,       [&](const auto& value) { formatName = value; } },
+    { 'T',    true,       [&](const auto& value) { layoutFilename = value; } },
+    { 's',    false,      [&](const auto& value) { symbolsToStdout = true; } },
+    { 0,      false,      [&](const auto& value) { mapToStdout = true; }, "map" }
+  });
+
+  if (showVersion)
+  {
+    std::cout << g_version << std::endl;
+    return 0;
+  }
+
+  if (showHelpText || inputFilenames.empty())
+  {
+    usage();
+    return 0;
+  }
+
+  try
+  {
+    auto format = outputFormatNamed(formatName);
+    if (! format)
+    {
+      std::cerr << "[Error] Unknown output format '" << formatName << "'" << std::endl;
+      return -1;
+    }
+
+    if (layoutFilename.empty())
+    {
+      std::cerr << "[Error] A layout is required (use -T <file>)" << std::endl;
+      return -1;
+    }
+
+    Layout layout;
+    layout.load(layoutFilename);
+    Linker linker(layout);
+    for (const auto& filename: inputFilenames)
+    {
+      auto module = std::make_unique<ObjectModule>();
+      module->load(filename);
+      linker.add(std::move(module));
+    }
+    linker.link();
+
+    for (const auto& buffer: linker.buffers())
+    {
+      if (buffer->filename().empty())
+        buffer->setFilename(outputFilename);
+      if (buffer->filename().empty())
+        continue;
+      format->save(*buffer, outputPath);
+    }
+    if (mapToStdout)
+      layout.report(std::cout);
+    if (symbolsToStdout)
+      linker.writeSymbols(std::cout);
+    return 0;
+  }
+  catch (Error& err)
+  {
+    std::cerr << "[Error] " << err.format() << std::endl;
+    return -1;
+  }
+}
@@ -13,69 +13,142 @@
 // PERFORMANCE OF THIS SOFTWARE.
 
 #include <iostream>
+#include <fstream>
 #include <algorithm>
-#include <cstdio>
+#include <string>
+#include "error.h"
 #include "lister.h"
 #include "context.h"
+#include "ast.h"
 
 namespace as64
 {
 
 // ----------------------------------------------------------------------------
-//      Lister
+//      ListingWriter
 // ----------------------------------------------------------------------------
 
-static const char *bytesToHex(CodeRange range, Offset offset)
+// Formats the listing rows into one buffer that is handed to the stream whenever it fills up, so that
+// writing a row neither allocates nor goes through printf.
+class ListingWriter
+{
+public:
+  ListingWriter(std::ostream& s) : s_(s) { buffer_.reserve(Capacity + MaxRowLength); }
+  ~ListingWriter() { flush(); }
+
+  void row(const Statement& node, const std::string& filename, size_t filenameWidth, CodeRange range,
+           Offset offset, bool withSource);
+
+private:
+  static constexpr size_t Capacity = 1 << 20;
+  static constexpr size_t MaxRowLength = 256;
+
+  void flush();
+  void hex(unsigned value, int digits);
+  void decimal(int value, int digits = 1);
+
+  std::ostream& s_;
+  std::string buffer_;
+};
+
+void ListingWriter::row(const Statement& node, const std::string& filename, size_t filenameWidth,
+                        CodeRange range, Offset offset, bool withSource)
 {
-  static char buf[32];
+  const auto *line = node.pos().line();
+  buffer_ += filename;
+  if (filename.length() < filenameWidth)
+    buffer_.append(filenameWidth - filename.length(), ' ');
+  buffer_ += ':';
+  decimal(line->lineNumber(), 5);
+  buffer_ += " [+";
+  hex(range.start() + offset, 4);
+  buffer_ += "] ";
+  hex(node.pc() + offset, 4);
+  buffer_ += ": ";
+
   auto count = std::min(3, range.length() - offset);
-  switch (count)
+  for (int index = 0; index < 3; ++ index)
   {
-    case 1:
-      snprintf(buf, sizeof(buf), "%02x      ", static_cast<int>(range[offset]));
-      break;
-
-    case 2:
-      snprintf(buf, sizeof(buf), "%02x %02x   ", static_cast<int>(range[offset]), static_cast<int>(range[offset + 1]));
-      break;
-
-    case 3:
-      snprintf(buf, sizeof(buf), "%02x %02x %02x", static_cast<int>(range[offset]), static_cast<int>(range[offset + 1]),
-               static_cast<int>(range[offset + 2]));
-      break;
-
-    default:
-      snprintf(buf, sizeof(buf), "        ");
-      break;
+    if (index)
+      buffer_ += ' ';
+    if (index < count)
+      hex(range[offset + index], 2);
+    else
+      buffer_ += "  ";
   }
-  return buf;
+  buffer_ += "    ";
+
+  if (withSource)
+  {
+    buffer_ += line->text();
+    const auto *budget = dynamic_cast<const BudgetBeginDirective *>(&node);
+    if (budget && budget->isChecked())
+    {
+      buffer_ += "    ; ";
+      decimal(budget->cycles());
+      buffer_ += " of ";
+      decimal(budget->budget());
+      buffer_ += budget->isWorstCase() ? " cycle(s) worst case" : " cycle(s) simulated, worst case unknown";
+    }
+  }
+  buffer_ += '\n';
+
+  if (buffer_.length() >= Capacity)
+    flush();
+}
+
+void ListingWriter::flush()
+{
+  s_.write(buffer_.data(), buffer_.length());
+  buffer_.clear();
 }
 
-void list(std::ostream& s, Context& context)
+void ListingWriter::hex(unsigned value, int digits)
 {
-  char buf[1024];
+  while (digits < 8 && (value >> (digits * 4)))
+    ++ digits;
+  for (int shift = (digits - 1) * 4; shift >= 0; shift -= 4)
+    buffer_ += "0123456789abcdef"[(value >> shift) & 0x0f];
+}
 
-  size_t maxFilenameLength = 0;
-  for (const auto& node: context.statements)
+void ListingWriter::decimal(int value, int digits)
+{
+  if (value < 0)
   {
-    auto length = node->pos().line()->shortFilename().length();
-    if (length > maxFilenameLength)
-      maxFilenameLength = length;
+    buffer_ += '-';
+    value = -value;
   }
+  char text[12];
+  int count = 0;
+  do
+  {
+    text[count ++] = static_cast<char>('0' + value % 10);
+    value /= 10;
+  } while (value);
+  for ( ; digits > count; -- digits)
+    buffer_ += '0';
+  while (count)
+    buffer_ += text[-- count];
+}
 
+// ----------------------------------------------------------------------------
+//      Lister
+// ----------------------------------------------------------------------------
+
+void list(std::ostream& s, const Context& context)
+{
+  ListingWriter writer(s);
+  auto filenameWidth = context.source.longestShortFilename();
   const Line *prevLine = nullptr;
   for (const auto& node: context.statements)
   {
     auto range = node->range();
     const auto *line = node->pos().line();
+    const auto& filename = line->shortFilename();
     Offset offset = 0;
     do
     {
-      snprintf(buf, sizeof(buf), "%s:%05d [+%04x] %04x: %s    %s\n",
-               padRight(line->shortFilename(), maxFilenameLength).c_str(), line->lineNumber(),
-               range.start() + offset, node->pc() + offset, bytesToHex(range, offset),
-               offset < 3 && line != prevLine ? node->sourceText().c_str() : "");
-      s << buf;
+      writer.row(*node, filename, filenameWidth, range, offset, offset < 3 && line != prevLine);
       offset += 3;
     }
     while (offset < range.length());
@@ -84,4 +157,14 @@ void list(std::ostream& s, Context& context)
   }
 }
 
+void list(const std::string& filename, const Context& context)
+{
+  std::ofstream output(filename, std::ios::binary);
+  if (! output.is_open())
+    throw SystemError(filename);
+  list(output, context);
+  if (! output.flush())
+    throw SystemError(filename);
+}
+
 }
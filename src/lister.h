@@ -2,13 +2,18 @@
 #define _INCLUDED_AS64_LISTER_H
 
 #include <ostream>
+#include <string>
 
 namespace as64
 {
 
 class Context;
 
-void list(std::ostream& s, Context& context);
+void list(std::ostream& s, const Context& context);
+
+// Reads the statements and buffers without changing them, so it may run on another thread while the
+// buffers are saved.
+void list(const std::string& filename, const Context& context);
 
 
 }
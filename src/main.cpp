@@ -13,10 +13,24 @@
 // PERFORMANCE OF THIS SOFTWARE.
 
 #include <iostream>
+#include <cstdlib>
+#include <future>
 #include "error.h"
 #include "parser.h"
 #include "define.h"
+#include "optimize.h"
+#include "simulator.h"
 #include "emit.h"
+#include "budget.h"
+#include "crunch.h"
+#include "output.h"
+#include "diskimage.h"
+#include "reach.h"
+#include "symexport.h"
+#include "debuginfo.h"
+#include "precompiled.h"
+#include "object.h"
+#include "path.h"
 #include "lister.h"
 #include "context.h"
 #include "cmdline.h"
@@ -29,12 +43,32 @@ static void usage()
 {
   std::cout << "as64 [options] <file> ..." << std::endl;
   std::cout << "  -l                  Write listing to standard output" << std::endl;
+  std::cout << "  -L <file>           Write listing to <file>, alongside the output files" << std::endl;
   std::cout << "  -o <file>           Specify output filename" << std::endl;
   std::cout << "  -O <path>           Specify output directory" << std::endl;
   std::cout << "  -D <name[=value]>   Add an entry to the symbol table (value defaults to 0)" << std::endl;
+  std::cout << "  -I <path>           Search <path> for .seq, .seqonce and .incbin files not found beside the source (may be repeated)" << std::endl;
   std::cout << "  -s                  Write the symbol table to standard output" << std::endl;
-  std::cout << "  -r                  Suppress load location from output file header" << std::endl;
-  std::cout << "  -A                  Write AST to standard output and then exit" << std::endl;
+  std::cout << "  -S <fmt>:<file>     Write the symbol table to <file> as text, vice, json or bin (may be repeated)" << std::endl;
+  std::cout << "  -d <file>           Write all output files into a .d64 disk image instead of separate files" << std::endl;
+  std::cout << "  --interleave <n>    Set the sector interleave for files in the disk image (default 10)" << std::endl;
+  std::cout << "  -F <format>         Select the output format: prg (default), bin, hex, crt, crt:magicdesk or crt:easyflash" << std::endl;
+  std::cout << "  -g <fmt>            Write an address-to-line map in bin or text format next to each output file (.dbg or .dbg.txt)" << std::endl;
+  std::cout << "  -r                  Suppress load location from output file header (same as -F bin)" << std::endl;
+  std::cout << "  -c                  Compress each output file" << std::endl;
+  std::cout << "  -C <addr[,entry]>   Compress each output file into a self-extracting program with its decruncher at <addr>" << std::endl;
+  std::cout << "  -m <cpu>            Select the initial processor: 6502, 6510, 6502x, 65c02 or 65816" << std::endl;
+  std::cout << "  -T <file>           Place .segment code according to the memory layout in <file>" << std::endl;
+  std::cout << "  --object            Write a relocatable object file for as64-link instead of output files (requires -T)" << std::endl;
+  std::cout << "  --map               Write the memory layout with used and free space to standard output" << std::endl;
+  std::cout << "  --single-pass       Assemble in one pass, patching in forward references afterwards (not with -p, -T or --object)" << std::endl;
+  std::cout << "  --entry <symbols>   Report the code and data that cannot be reached from the comma-separated entry symbols" << std::endl;
+  std::cout << "  --strip             Leave the unreachable code and data found by --entry out of the output" << std::endl;
+  std::cout << "  --precompile        Write the constant definitions in an include file to <file>.pch, for .seq to load instead" << std::endl;
+  std::cout << "  -p                  Optimize code with the peephole optimizer" << std::endl;
+  std::cout << "  -P                  Optimize code and write a report of each rewrite to standard output" << std::endl;
+  std::cout << "  -A                  Write AST (optimized, if -p is given) to standard output and then exit" << std::endl;
+  std::cout << "  --run <symbol>      Simulate the code from <symbol> and write a cycle profile to standard output" << std::endl;
   std::cout << "  -h                  Show help text" << std::endl;
   std::cout << "  -v                  Show version number" << std::endl;
   std::cout << std::endl;
@@ -49,23 +83,95 @@ static std::pair<Label, Address> parseDefinition(const std::string& text)
   return { text.substr(0, pos), stoi(text.substr(pos + 1), 0) };
 }
 
+static Address parseAddress(const std::string& text, Context& context)
+{
+  auto symbol = lookupSymbol(context, text);
+  if (symbol.hasValue())
+    return *symbol;
+
+  if (! text.empty() && text[0] == '$')
+    return std::strtol(text.c_str() + 1, nullptr, 16);
+  return std::strtol(text.c_str(), nullptr, 0);
+}
+
+// Disk names and filenames are taken from the base name without its extension.
+static std::string diskFilename(const std::string& path)
+{
+  auto name = basename(path);
+  auto pos = name.find_last_of('.');
+  return pos == std::string::npos || pos == 0 ? name : name.substr(0, pos);
+}
+
+static void addEntrySymbols(std::vector<std::string>& symbols, const std::string& text)
+{
+  size_t start = 0;
+  while (start <= text.length())
+  {
+    auto end = text.find_first_of(',', start);
+    if (end == std::string::npos)
+      end = text.length();
+    if (end > start)
+      symbols.push_back(text.substr(start, end - start));
+    start = end + 1;
+  }
+}
+
+static std::pair<std::string, std::string> splitSymbolFile(const std::string& text)
+{
+  auto pos = text.find_first_of(':');
+  if (pos == std::string::npos)
+    return { text, "" };
+  return { text.substr(0, pos), text.substr(pos + 1) };
+}
+
+static std::string objectFilename(const std::string& path)
+{
+  return diskFilename(path) + ".o64";
+}
+
 int main(int argc, char **argv)
 {
-  bool listingToStdout = false, suppressLoadLocation = false, showHelpText = false, astToStdout = false;
-  bool symbolsToStdout = false, showVersion = false;
-  std::string outputFilename, outputPath;
+  bool listingToStdout = false, showHelpText = false, astToStdout = false;
+  bool symbolsToStdout = false, showVersion = false, optimizeCode = false, reportToStdout = false;
+  bool crunchOutput = false, mapToStdout = false, objectOutput = false;
+  bool singlePass = false, stripUnreachable = false, precompile = false;
+  std::vector<std::string> entrySymbols;
+  std::vector<std::pair<std::string, std::string>> symbolFiles;
+  int interleave = DiskImage::DefaultInterleave;
+  std::string outputFilename, outputPath, runSymbol, cpuName, decruncher, diskImageFilename, formatName = "prg";
+  std::string layoutFilename, listingFilename, debugInfoName;
   Context context;
   auto inputFilenames = parseCommandLine(argc, argv,
   {
     { 'h',    false,      [&](const auto& value) { showHelpText = true; } },
     { 'v',    false,      [&](const auto& value) { showVersion = true; } },
     { 'l',    false,      [&](const auto& value) { listingToStdout = true; } },
+    { 'L',    true,       [&](const auto& value) { listingFilename = value; } },
     { 'o',    true,       [&](const auto& value) { outputFilename = value; } },
     { 'O',    true,       [&](const auto& value) { outputPath = value; } },
-    { 'r',    false,      [&](const auto& value) { suppressLoadLocation = true; } },
+    { 'd',    true,       [&](const auto& value) { diskImageFilename = value; } },
+    { 'r',    false,      [&](const auto& value) { formatName = "bin"; } },
+    { 'F',    true,       [&](const auto& value) { formatName = value; } },
+    { 'g',    true,       [&](const auto& value) { debugInfoName = value; } },
+    { 'm',    true,       [&](const auto& value) { cpuName = value; } },
+    { 'c',    false,      [&](const auto& value) { crunchOutput = true; } },
+    { 'C',    true,       [&](const auto& value) { crunchOutput = true; decruncher = value; } },
+    { 'T',    true,       [&](const auto& value) { layoutFilename = value; } },
+    { 'p',    false,      [&](const auto& value) { optimizeCode = true; } },
+    { 'P',    false,      [&](const auto& value) { optimizeCode = reportToStdout = true; } },
     { 'A',    false,      [&](const auto& value) { astToStdout = true; } },
     { 'D',    true,       [&](const auto& value) { context.symbols.set(parseDefinition(value)); } },
-    { 's',    false,      [&](const auto& value) { symbolsToStdout = true; } }
+    { 'I',    true,       [&](const auto& value) { context.source.addIncludePath(value); } },
+    { 's',    false,      [&](const auto& value) { symbolsToStdout = true; } },
+    { 'S',    true,       [&](const auto& value) { symbolFiles.push_back(splitSymbolFile(value)); } },
+    { 0,      true,       [&](const auto& value) { runSymbol = value; }, "run" },
+    { 0,      true,       [&](const auto& value) { interleave = stoi(value, 0); }, "interleave" },
+    { 0,      false,      [&](const auto& value) { mapToStdout = true; }, "map" },
+    { 0,      false,      [&](const auto& value) { objectOutput = true; }, "object" },
+    { 0,      false,      [&](const auto& value) { singlePass = true; }, "single-pass" },
+    { 0,      true,       [&](const auto& value) { addEntrySymbols(entrySymbols, value); }, "entry" },
+    { 0,      false,      [&](const auto& value) { stripUnreachable = true; }, "strip" },
+    { 0,      false,      [&](const auto& value) { precompile = true; }, "precompile" }
   });
 
   if (showVersion)
@@ -82,7 +188,96 @@ int main(int argc, char **argv)
 
   try
   {
+    if (! cpuName.empty())
+    {
+      auto cpu = cpuNamed(cpuName);
+      if (! cpu.hasValue())
+      {
+        std::cerr << "[Error] Unknown processor '" << cpuName << "'" << std::endl;
+        return -1;
+      }
+      context.cpu = *cpu;
+    }
+
+    auto format = outputFormatNamed(formatName);
+    if (! format)
+    {
+      std::cerr << "[Error] Unknown output format '" << formatName << "'" << std::endl;
+      return -1;
+    }
+
+    Maybe<DebugInfoFormat> debugInfoFormat;
+    if (! debugInfoName.empty())
+    {
+      debugInfoFormat = debugInfoFormatNamed(debugInfoName);
+      if (! debugInfoFormat.hasValue())
+      {
+        std::cerr << "[Error] Unknown debug info format '" << debugInfoName << "'" << std::endl;
+        return -1;
+      }
+    }
+
+    std::vector<std::pair<std::unique_ptr<SymbolFormat>, std::string>> symbolExports;
+    for (const auto& symbolFile: symbolFiles)
+    {
+      auto symbolFormat = symbolFormatNamed(symbolFile.first);
+      if (! symbolFormat || symbolFile.second.empty())
+      {
+        std::cerr << "[Error] Invalid symbol file '" << symbolFile.first << ":" << symbolFile.second
+                  << "' (expected <fmt>:<file> with a format of text, vice, json or bin)" << std::endl;
+        return -1;
+      }
+      symbolExports.push_back({ std::move(symbolFormat), symbolFile.second });
+    }
+
+    if (interleave < 1 || interleave >= DiskImage::sectorsOnTrack(DiskImage::TrackCount))
+    {
+      std::cerr << "[Error] Invalid sector interleave (" << interleave << ")" << std::endl;
+      return -1;
+    }
+
+    if (! layoutFilename.empty())
+      context.layout.load(layoutFilename);
+    if (objectOutput && context.layout.isEmpty())
+    {
+      std::cerr << "[Error] An object file requires a layout (use -T <file>)" << std::endl;
+      return -1;
+    }
+    context.relocatable = objectOutput;
+    if (singlePass && (optimizeCode || ! context.layout.isEmpty() || objectOutput))
+    {
+      std::cerr << "[Error] --single-pass cannot be combined with -p, -T or --object" << std::endl;
+      return -1;
+    }
+
+    if (precompile && inputFilenames.size() != 1)
+    {
+      std::cerr << "[Error] --precompile takes a single include file" << std::endl;
+      return -1;
+    }
+
     parseFiles(context, inputFilenames);
+    if (context.messages.hasFatalError())
+    {
+      std::cerr << context.messages << std::endl;
+      return -1;
+    }
+
+    // An include file that is precompiled holds nothing but definitions, so there is nothing to assemble.
+    if (precompile)
+    {
+      define(context);
+      PrecompiledFile precompiled(context);
+      if (context.messages.count())
+        std::cerr << context.messages << std::endl;
+      if (context.messages.errorCount())
+        return -1;
+      precompiled.save(precompiledFilename(inputFilenames.front()));
+      return 0;
+    }
+
+    if (optimizeCode)
+      optimize(context, reportToStdout ? &std::cout : nullptr);
 
     if (astToStdout)
     {
@@ -91,26 +286,118 @@ int main(int argc, char **argv)
       return 0;
     }
 
-    define(context);
-    if (! context.messages.hasFatalError())
-      emit(context);
+    auto serialNum = context.symbols.serialNum();
+    if (singlePass)
+      assemble(context);
+    else
+    {
+      if (! optimizeCode)
+        define(context);
+      if (! context.messages.hasFatalError())
+        emit(context);
+    }
+
+    // Leaving out unreachable code moves everything after it, so the source is assembled again.
+    if (! entrySymbols.empty() && ! context.messages.errorCount() &&
+        findUnreachable(std::cout, context, entrySymbols, stripUnreachable))
+    {
+      context.symbols.truncate(serialNum);
+      context.buffers.clear();
+      if (singlePass)
+        assemble(context);
+      else
+      {
+        define(context);
+        if (! context.messages.hasFatalError())
+          emit(context);
+      }
+    }
+    if (! context.messages.errorCount())
+      checkBudgets(context);
+    if ((symbolsToStdout || ! symbolExports.empty() || objectOutput) && ! context.messages.hasFatalError())
+      defineAll(context);
 
     if (context.messages.count())
       std::cerr << context.messages << std::endl;
 
     if (context.messages.errorCount() == 0)
     {
+      // Nothing below changes the statements or the buffers' contents, so the listing is written in the
+      // background while the output files are saved.
+      std::future<void> listing;
+      if (! listingFilename.empty())
+      {
+        listing = std::async(std::launch::async, [&]()
+        {
+          list(joinPath(outputPath, listingFilename), context);
+        });
+      }
+
+      CrunchOptions crunchOptions;
+      if (! decruncher.empty())
+      {
+        auto pos = decruncher.find_first_of(',');
+        crunchOptions.selfExtracting = true;
+        crunchOptions.decruncherAddress = parseAddress(decruncher.substr(0, pos), context);
+        if (pos != std::string::npos)
+          crunchOptions.entry = parseAddress(decruncher.substr(pos + 1), context);
+      }
+
+      if (objectOutput)
+      {
+        ObjectModule module;
+        module.build(context);
+        module.save(joinPath(outputPath, outputFilename.empty() ? objectFilename(inputFilenames.front()) : outputFilename));
+      }
+
+      std::unique_ptr<DiskImage> diskImage;
+      if (! diskImageFilename.empty())
+      {
+        diskImage = std::make_unique<DiskImage>(diskFilename(diskImageFilename));
+        diskImage->setInterleave(interleave);
+      }
+
       for (const auto& buffer: context.buffers)
       {
+        if (objectOutput)
+          break;
+
+        // Code placed entirely in segments leaves the initial buffer unused.
+        if (buffer->isEmpty() && buffer->filename().empty() && context.buffers.size() > 1)
+          continue;
         if (buffer->filename().empty())
           buffer->setFilename(outputFilename);
-        if (! buffer->filename().empty())
-          buffer->save(outputPath, ! suppressLoadLocation);
+        if (buffer->filename().empty())
+          continue;
+
+        std::unique_ptr<CodeBuffer> crunched;
+        if (crunchOutput)
+          crunched = crunch(*buffer, crunchOptions, &std::cout);
+        const auto& output = crunched ? *crunched : *buffer;
+        if (diskImage)
+          diskImage->addFile(diskFilename(output.filename()), output, *format);
+        else
+          format->save(output, outputPath);
+        if (debugInfoFormat.hasValue())
+        {
+          auto extension = *debugInfoFormat == DebugInfoFormat::Text ? ".dbg.txt" : ".dbg";
+          DebugInfo(context, *buffer).save(joinPath(outputPath, buffer->filename() + extension), *debugInfoFormat);
+        }
       }
+      if (diskImage)
+        diskImage->save(joinPath(outputPath, diskImageFilename));
+      if (listing.valid())
+        listing.get();
       if (listingToStdout)
         list(std::cout, context);
+      if (mapToStdout)
+        context.layout.report(std::cout);
       if (symbolsToStdout)
         context.symbols.write(std::cout);
+      for (const auto& symbolExport: symbolExports)
+        symbolExport.first->save(context.symbols, joinPath(outputPath, symbolExport.second));
+      if (! runSymbol.empty())
+        simulate(std::cout, context, runSymbol);
     }
 
     return context.messages.errorCount() ? -1 : 0;
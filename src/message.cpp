@@ -28,6 +28,8 @@ bool operator<(const Message& a, const Message& b) noexcept
   return a.severity == b.severity ? a.pos < b.pos : a.severity >= b.severity;
 }
 
+constexpr int MaxCallers = 4;
+
 std::ostream& operator<<(std::ostream& s, const Message& obj) noexcept
 {
   s << obj.pos << ": ";
@@ -38,6 +40,24 @@ std::ostream& operator<<(std::ostream& s, const Message& obj) noexcept
     s << std::endl;
     s << "  " << obj.pos.line()->text() << std::endl;
     s << "  " << std::string(obj.pos.offset(), ' ') << '^';
+
+    // Only the innermost calls are shown, since runaway recursion would otherwise list every one of them.
+    int shown = 0;
+    for (const auto *caller = obj.pos.line()->caller(); caller; caller = caller->caller())
+    {
+      if (shown ++ == MaxCallers)
+      {
+        int more = 0;
+        for ( ; caller; caller = caller->caller())
+          ++ more;
+        s << std::endl << "  ... and " << more << " more expansion(s)";
+        break;
+      }
+      s << std::endl << "  in the expansion at ";
+      if (! caller->filename().empty())
+        s << caller->filename() << ':';
+      s << caller->lineNumber() << ": " << caller->text();
+    }
   }
   return s;
 }
@@ -53,8 +73,14 @@ MessageList::MessageList() noexcept
 
 void MessageList::add(Severity severity, SourcePos pos, const std::string& summary) noexcept
 {
+  // A later pass, or another use of a definition that failed, can run into the same error again.
   Message message{ severity, pos, summary };
   auto i = std::lower_bound(std::begin(messages_), std::end(messages_), message);
+  for (auto same = i; same != std::end(messages_) && ! (message < *same); ++ same)
+  {
+    if (same->pos == pos && same->summary == summary)
+      return;
+  }
   messages_.insert(i, message);
   if (severity == Severity::Error || severity == Severity::FatalError)
     ++ errorCount_;
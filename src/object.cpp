@@ -0,0 +1,255 @@
+// Copyright (c) 2018 Robert A. Stoerrle
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+// REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+// AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+// INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+// LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+// OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+#include <fstream>
+#include <iterator>
+#include <algorithm>
+#include <cstring>
+#include "object.h"
+#include "file.h"
+#include "context.h"
+
+namespace as64
+{
+
+// An object file starts with a magic number and version, followed by the segments, symbols and fixups.
+// Numbers are little-endian and strings are prefixed with a 16-bit length:
+//
+//   segment:   name, bss (8), size (32), data (size bytes, unless bss)
+//   symbol:    name, segment (16, $ffff if absolute), value (16)
+//   fixup:     segment (16), offset (16), kind (8), term type (8), term segment (16), import name, addend (32)
+constexpr const char *Magic = "AS64OBJ";
+constexpr size_t MagicLength = 7;
+constexpr Byte Version = 1;
+
+// ----------------------------------------------------------------------------
+//      ObjectWriter
+// ----------------------------------------------------------------------------
+
+class ObjectWriter
+{
+public:
+  void byte(Byte value) { data_.push_back(value); }
+  void word(int value) { byte(value); byte(value >> 8); }
+  void dword(int value) { word(value); word(value >> 16); }
+  void string(const std::string& str) { word(str.length()); data_.insert(std::end(data_), std::begin(str), std::end(str)); }
+  void bytes(const std::vector<Byte>& data) { data_.insert(std::end(data_), std::begin(data), std::end(data)); }
+
+  const std::vector<Byte>& data() const noexcept { return data_; }
+
+private:
+  std::vector<Byte> data_;
+};
+
+// ----------------------------------------------------------------------------
+//      ObjectReader
+// ----------------------------------------------------------------------------
+
+class ObjectReader
+{
+public:
+  ObjectReader(const std::string& filename, const std::vector<Byte>& data) noexcept
+    : filename_(filename), data_(data), pos_(0) { }
+
+  Byte byte()
+  {
+    need(1);
+    return data_[pos_++];
+  }
+
+  int word() { int low = byte(); return low | byte() << 8; }
+  int dword() { uint32_t low = word(); return static_cast<int>(low | static_cast<uint32_t>(word()) << 16); }
+
+  std::string string()
+  {
+    int length = word();
+    need(length);
+    pos_ += length;
+    return std::string(reinterpret_cast<const char *>(&data_[pos_ - length]), length);
+  }
+
+  std::vector<Byte> bytes(size_t count)
+  {
+    need(count);
+    pos_ += count;
+    return std::vector<Byte>(std::begin(data_) + pos_ - count, std::begin(data_) + pos_);
+  }
+
+  bool atEnd() const noexcept { return pos_ == data_.size(); }
+
+private:
+  void need(size_t count)
+  {
+    if (data_.size() - pos_ < count)
+      throw ObjectError("Object file '" + filename_ + "' is truncated");
+  }
+
+  std::string filename_;
+  const std::vector<Byte>& data_;
+  size_t pos_;
+};
+
+// ----------------------------------------------------------------------------
+//      ObjectModule
+// ----------------------------------------------------------------------------
+
+void ObjectModule::build(const Context& context)
+{
+  const auto& layoutSegments = context.layout.segments();
+  auto indexOf = [&](const std::string& name)
+  {
+    return std::find_if(std::begin(layoutSegments), std::end(layoutSegments),
+                        [&](const auto& segment) { return segment.name == name; }) - std::begin(layoutSegments);
+  };
+
+  segments.clear();
+  for (size_t i = 0; i < layoutSegments.size(); ++ i)
+  {
+    const auto& segment = layoutSegments[i];
+    segments.push_back({ segment.name, segment.bss, segment.size, {} });
+    const auto& range = context.segmentRanges[i];
+    if (range.isValid())
+    {
+      const auto& data = range.buffer()->data();
+      segments.back().data.assign(std::begin(data) + range.start(), std::begin(data) + range.end());
+      segments.back().data.resize(segment.size);
+    }
+  }
+
+  symbols.clear();
+  context.symbols.forEach([&](const std::string& name, Address addr)
+  {
+    // A symbol defined in terms of an import is only known to the module that defines the import.
+    auto term = context.symbolTerms.find(name);
+    if (term != std::end(context.symbolTerms) && term->second.type == TermType::Import)
+      return;
+    if (term != std::end(context.symbolTerms) && term->second.type == TermType::Segment)
+    {
+      auto index = indexOf(term->second.name);
+      symbols.push_back({ name, static_cast<int>(index), static_cast<Address>(addr - layoutSegments[index].base) });
+    }
+    else
+      symbols.push_back({ name, -1, addr });
+  });
+  std::sort(std::begin(symbols), std::end(symbols), [](const auto& a, const auto& b) { return a.name < b.name; });
+
+  fixups.clear();
+  for (const auto& relocation: context.relocations)
+  {
+    Fixup fixup = { static_cast<int>(indexOf(relocation.segment)), relocation.offset, relocation.kind,
+                    relocation.term.type, 0, "", relocation.addend };
+    if (relocation.term.type == TermType::Segment)
+      fixup.termSegment = indexOf(relocation.term.name);
+    else
+      fixup.import = relocation.term.name;
+    fixups.push_back(fixup);
+  }
+}
+
+bool ObjectModule::save(const std::string& filename) const
+{
+  ObjectWriter writer;
+  for (size_t i = 0; i < MagicLength; ++ i)
+    writer.byte(Magic[i]);
+  writer.byte(Version);
+
+  writer.word(segments.size());
+  for (const auto& segment: segments)
+  {
+    writer.string(segment.name);
+    writer.byte(segment.bss);
+    writer.dword(segment.size);
+    if (! segment.bss)
+      writer.bytes(segment.data);
+  }
+
+  writer.dword(symbols.size());
+  for (const auto& symbol: symbols)
+  {
+    writer.string(symbol.name);
+    writer.word(symbol.segment);
+    writer.word(symbol.value);
+  }
+
+  writer.dword(fixups.size());
+  for (const auto& fixup: fixups)
+  {
+    writer.word(fixup.segment);
+    writer.word(fixup.offset);
+    writer.byte(static_cast<Byte>(fixup.kind));
+    writer.byte(static_cast<Byte>(fixup.termType));
+    writer.word(fixup.termSegment);
+    writer.string(fixup.import);
+    writer.dword(fixup.addend);
+  }
+
+  return saveFile(filename, { { writer.data().data(), writer.data().size() } });
+}
+
+void ObjectModule::load(const std::string& filename)
+{
+  std::ifstream file(filename, std::ios::binary);
+  if (! file)
+    throw ObjectError("Unable to read object file '" + filename + "'");
+  std::vector<Byte> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+  this->filename = filename;
+  ObjectReader reader(filename, data);
+  auto invalid = [&]() { return ObjectError("'" + filename + "' is not an object file for this version of as64"); };
+  if (data.size() < MagicLength + 1 || std::memcmp(data.data(), Magic, MagicLength) || data[MagicLength] != Version)
+    throw invalid();
+  reader.bytes(MagicLength + 1);
+
+  segments.resize(reader.word());
+  for (auto& segment: segments)
+  {
+    segment.name = reader.string();
+    segment.bss = reader.byte();
+    segment.size = reader.dword();
+    if (segment.size > 65536)
+      throw invalid();
+    if (! segment.bss)
+      segment.data = reader.bytes(segment.size);
+  }
+
+  symbols.resize(reader.dword());
+  for (auto& symbol: symbols)
+  {
+    symbol.name = reader.string();
+    symbol.segment = static_cast<int16_t>(reader.word());
+    symbol.value = reader.word();
+    if (symbol.segment >= static_cast<int>(segments.size()))
+      throw invalid();
+  }
+
+  fixups.resize(reader.dword());
+  for (auto& fixup: fixups)
+  {
+    fixup.segment = reader.word();
+    fixup.offset = reader.word();
+    fixup.kind = static_cast<RelocationKind>(reader.byte());
+    fixup.termType = static_cast<TermType>(reader.byte());
+    fixup.termSegment = reader.word();
+    fixup.import = reader.string();
+    fixup.addend = reader.dword();
+    if (fixup.segment >= static_cast<int>(segments.size()) || fixup.termSegment >= static_cast<int>(segments.size()) ||
+        fixup.kind > RelocationKind::High || fixup.termType > TermType::Import)
+      throw invalid();
+  }
+
+  if (! reader.atEnd())
+    throw invalid();
+}
+
+}
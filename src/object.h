@@ -0,0 +1,128 @@
+#ifndef _INCLUDED_AS64_OBJECT_H
+#define _INCLUDED_AS64_OBJECT_H
+
+#include <string>
+#include <vector>
+#include "types.h"
+#include "error.h"
+
+namespace as64
+{
+
+class Context;
+
+// ----------------------------------------------------------------------------
+//      RelocationTerm
+// ----------------------------------------------------------------------------
+
+// The part of a value that is only known once modules are linked: the address of a segment or of a
+// symbol imported from another module.
+enum class TermType
+{
+  Absolute,
+  Segment,
+  Import
+};
+
+struct RelocationTerm
+{
+  RelocationTerm() noexcept : type(TermType::Absolute) { }
+  RelocationTerm(TermType type, const std::string& name) noexcept : type(type), name(name) { }
+
+  bool isAbsolute() const noexcept { return type == TermType::Absolute; }
+  bool operator==(const RelocationTerm& other) const noexcept { return type == other.type && name == other.name; }
+  bool operator!=(const RelocationTerm& other) const noexcept { return ! (*this == other); }
+
+  TermType type;
+  std::string name;
+};
+
+// ----------------------------------------------------------------------------
+//      Relocation
+// ----------------------------------------------------------------------------
+
+enum class RelocationKind
+{
+  Word,
+  Byte,                                       // A whole value that must fit in a byte, such as a zero page address
+  Low,
+  High
+};
+
+// Until a module is linked, its segments sit at the addresses the layout gives them when the module is
+// assembled on its own, and imported symbols sit at ImportAddress, which leaves room for small offsets
+// either way.
+constexpr Address ImportAddress = 0x8000;
+
+struct Relocation
+{
+  std::string segment;
+  Offset offset;                              // Position of the value within its segment
+  RelocationKind kind;
+  RelocationTerm term;
+  int addend;                                 // The value less the provisional address of the term
+};
+
+// ----------------------------------------------------------------------------
+//      ObjectModule
+// ----------------------------------------------------------------------------
+
+// An object module holds each segment's bytes relative to the segment start, every named symbol, and the
+// relocations needed to fix the bytes up once the segments have been placed.
+class ObjectModule
+{
+public:
+  struct Segment
+  {
+    std::string name;
+    bool bss;
+    int size;
+    std::vector<Byte> data;
+  };
+
+  struct Symbol
+  {
+    std::string name;
+    int segment;                              // -1 for an absolute symbol
+    Address value;                            // Offset into the segment, or the absolute value
+  };
+
+  struct Fixup
+  {
+    int segment;
+    Offset offset;
+    RelocationKind kind;
+    TermType termType;
+    int termSegment;
+    std::string import;
+    int addend;
+  };
+
+  void build(const Context& context);
+  bool save(const std::string& filename) const;
+  void load(const std::string& filename);
+
+  std::string filename;
+  std::vector<Segment> segments;
+  std::vector<Symbol> symbols;
+  std::vector<Fixup> fixups;
+};
+
+// ----------------------------------------------------------------------------
+//      ObjectError
+// ----------------------------------------------------------------------------
+
+class ObjectError : public GeneralError
+{
+public:
+  ObjectError(const std::string& message) noexcept : message_(message) { }
+
+  const char *what() const noexcept override { return "Object Error"; }
+  std::string message() const noexcept override { return message_; }
+
+private:
+  std::string message_;
+};
+
+}
+#endif
@@ -0,0 +1,394 @@
+// Copyright (c) 2018 Robert A. Stoerrle
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+// REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+// AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+// INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+// LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+// OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+#include <iostream>
+#include <algorithm>
+#include <unordered_set>
+#include "optimize.h"
+#include "define.h"
+#include "context.h"
+#include "ast.h"
+
+namespace as64
+{
+
+// Instructions that leave N and Z reflecting the new contents of the accumulator.
+static const std::unordered_set<std::string> g_setsFlagsFromAccumulator =
+{
+  "adc", "and", "eor", "lda", "ora", "pla", "sbc", "tax", "tay", "txa", "tya",
+  "alr", "anc", "arr", "isc", "lax", "rla", "rra", "slo", "sre"
+};
+
+// Instructions that leave N and Z alone.
+static const std::unordered_set<std::string> g_preservesFlags =
+{
+  "bcc", "bcs", "beq", "bmi", "bne", "bpl", "bvc", "bvs", "clc", "cld", "cli", "clv", "nop",
+  "pha", "php", "sec", "sed", "sei", "sta", "stx", "sty", "txs", "sax"
+};
+
+static const std::unordered_set<std::string> g_modifiesCarry =
+{
+  "adc", "asl", "cmp", "cpx", "cpy", "jsr", "lsr", "plp", "rol", "ror", "rti", "sbc",
+  "alr", "anc", "arr", "dcp", "isc", "rla", "rra", "sbx", "slo", "sre", "rep", "sep", "xce"
+};
+
+// Instructions after which execution does not fall through to the next statement.
+static const std::unordered_set<std::string> g_endsSequence =
+{
+  "brk", "jmp", "rti", "rts", "bra", "rtl", "stp"
+};
+
+// ----------------------------------------------------------------------------
+//      PeepholePass
+// ----------------------------------------------------------------------------
+
+class PeepholePass : public StatementVisitor
+{
+public:
+  PeepholePass(Context& context);
+
+  void run();
+  bool hasRewrites() const noexcept { return ! rewrites_.empty(); }
+  void report(std::ostream& s) const noexcept;
+
+  void visit(ProgramCounterAssignment& node) override;
+  void visit(ImpliedOperation& node) override;
+  void visit(ImmediateOperation& node) override;
+  void visit(AccumulatorOperation& node) override;
+  void visit(DirectOperation& node) override;
+  void visit(IndirectOperation& node) override;
+  void visit(BranchOperation& node) override;
+  void visit(OriginDirective& node) override;
+  void visit(BufferDirective& node) override;
+  void visit(OffsetBeginDirective& node) override;
+  void visit(OffsetEndDirective& node) override;
+  void visit(ObjectFileDirective& node) override;
+  void visit(ByteDirective& node) override;
+  void visit(WordDirective& node) override;
+  void visit(StringDirective& node) override;
+  void visit(BitmapDirective& node) override;
+  void visit(FillDirective& node) override;
+  void visit(TableDirective& node) override;
+  void visit(IncbinDirective& node) override;
+  void visit(OptimizeDirective& node) override;
+  void visit(CpuDirective& node) override;
+
+  bool before(Statement& node) override;
+  bool uncaught(SourceError& err) override;
+
+private:
+  enum class Carry
+  {
+    Unknown,
+    Clear,
+    Set
+  };
+
+  struct Rewrite
+  {
+    SourcePos pos;
+    std::string summary;
+    ByteLength bytes;
+    int cycles;
+  };
+
+  void breakSequence() noexcept;
+  void update(Operation& node) noexcept;
+  void remove(Statement& node, SourcePos pos, const std::string& summary, ByteLength bytes, int cycles);
+  bool isSameLocation(const DirectOperation& a, const DirectOperation& b) noexcept;
+  bool isVolatile(Address addr, IndexRegister index) const noexcept;
+
+  Context& context_;
+  Operation *prev_;
+  bool flagsFromAccumulator_;
+  Carry carry_;
+  bool trackCarry_;
+  Cpu cpu_;
+  std::unordered_set<const Statement *> removed_;
+  std::vector<Rewrite> rewrites_;
+};
+
+PeepholePass::PeepholePass(Context& context)
+  : context_(context), prev_(nullptr), flagsFromAccumulator_(false), carry_(Carry::Unknown), trackCarry_(false),
+    cpu_(context.cpu)
+{
+}
+
+void PeepholePass::run()
+{
+  context_.statements.accept(*this);
+  context_.statements.remove(removed_);
+}
+
+void PeepholePass::report(std::ostream& s) const noexcept
+{
+  int bytes = 0, cycles = 0;
+  for (const auto& rewrite: rewrites_)
+  {
+    s << rewrite.pos << ": " << rewrite.summary << " (" << rewrite.bytes << " byte(s), "
+      << rewrite.cycles << " cycle(s))" << std::endl;
+    bytes += rewrite.bytes;
+    cycles += rewrite.cycles;
+  }
+  s << rewrites_.size() << " rewrite(s); saved " << bytes << " byte(s), " << cycles << " cycle(s)" << std::endl;
+}
+
+bool PeepholePass::before(Statement& node)
+{
+  if (node.isSkipped())
+    return false;
+
+  // A labeled statement can be reached from elsewhere, so nothing is known about the machine state on entry.
+  context_.pc = node.pc();
+  if (! node.label().isEmpty())
+    breakSequence();
+  return true;
+}
+
+void PeepholePass::visit(ProgramCounterAssignment& node)
+{
+  breakSequence();
+}
+
+void PeepholePass::visit(ImpliedOperation& node)
+{
+  auto name = node.instruction().name();
+  if (name == "rts" && dynamic_cast<DirectOperation *>(prev_) && prev_->instruction().name() == "jsr")
+  {
+    auto& jmp = *instructionNamed("jmp", cpu_);
+    int cycles = cycleCount(prev_->instruction().opcode(AddrMode::Absolute), cpu_) +
+                 cycleCount(node.instruction().opcode(AddrMode::Implied), cpu_) -
+                 cycleCount(jmp.opcode(AddrMode::Absolute), cpu_);
+    prev_->setInstruction(jmp);
+    remove(node, prev_->pos(), "replaced 'jsr' and 'rts' with 'jmp'", 1, cycles);
+    breakSequence();
+    return;
+  }
+
+  if (trackCarry_ && ((name == "clc" && carry_ == Carry::Clear) || (name == "sec" && carry_ == Carry::Set)))
+  {
+    remove(node, node.pos(), "removed redundant '" + name + "'", 1,
+           cycleCount(node.instruction().opcode(AddrMode::Implied), cpu_));
+    return;
+  }
+
+  update(node);
+}
+
+void PeepholePass::visit(ImmediateOperation& node)
+{
+  update(node);
+}
+
+void PeepholePass::visit(AccumulatorOperation& node)
+{
+  update(node);
+  flagsFromAccumulator_ = true;
+}
+
+void PeepholePass::visit(DirectOperation& node)
+{
+  // Reloading the value just stored changes nothing, provided the flags already reflect the accumulator.
+  auto *store = dynamic_cast<DirectOperation *>(prev_);
+  if (node.instruction().name() == "lda" && store && store->instruction().name() == "sta" &&
+      flagsFromAccumulator_ && isSameLocation(*store, node))
+  {
+    auto addr = node.expr().tryEval(context_).value();
+    auto mode = node.instruction().directMode(addr, node.index(), node.forceAbsolute()).value();
+    remove(node, node.pos(), "removed redundant 'lda' following 'sta'", isZeroPage(mode) ? 2 : 3,
+           cycleCount(node.instruction().opcode(mode), cpu_));
+    return;
+  }
+
+  update(node);
+}
+
+void PeepholePass::visit(IndirectOperation& node)
+{
+  update(node);
+}
+
+void PeepholePass::visit(BranchOperation& node)
+{
+  update(node);
+}
+
+void PeepholePass::visit(OriginDirective& node)
+{
+  breakSequence();
+}
+
+void PeepholePass::visit(BufferDirective& node)
+{
+  breakSequence();
+}
+
+void PeepholePass::visit(OffsetBeginDirective& node)
+{
+  breakSequence();
+}
+
+void PeepholePass::visit(OffsetEndDirective& node)
+{
+  breakSequence();
+}
+
+void PeepholePass::visit(ObjectFileDirective& node)
+{
+  breakSequence();
+}
+
+void PeepholePass::visit(ByteDirective& node)
+{
+  breakSequence();
+}
+
+void PeepholePass::visit(WordDirective& node)
+{
+  breakSequence();
+}
+
+void PeepholePass::visit(StringDirective& node)
+{
+  breakSequence();
+}
+
+void PeepholePass::visit(BitmapDirective& node)
+{
+  breakSequence();
+}
+
+void PeepholePass::visit(FillDirective& node)
+{
+  breakSequence();
+}
+
+void PeepholePass::visit(TableDirective& node)
+{
+  breakSequence();
+}
+
+void PeepholePass::visit(IncbinDirective& node)
+{
+  breakSequence();
+}
+
+void PeepholePass::visit(OptimizeDirective& node)
+{
+  // Carry tracking is opt-in because it trusts that branch opcodes are not modified at run time.
+  if (node.option() == "carry")
+  {
+    trackCarry_ = node.isEnabled();
+    carry_ = Carry::Unknown;
+  }
+}
+
+void PeepholePass::visit(CpuDirective& node)
+{
+  cpu_ = node.cpu();
+}
+
+bool PeepholePass::uncaught(SourceError& err)
+{
+  context_.messages.add(err.isFatal() ? Severity::FatalError : Severity::Error, err.pos(), err.message());
+  return ! err.isFatal();
+}
+
+void PeepholePass::breakSequence() noexcept
+{
+  prev_ = nullptr;
+  flagsFromAccumulator_ = false;
+  carry_ = Carry::Unknown;
+}
+
+void PeepholePass::update(Operation& node) noexcept
+{
+  auto name = node.instruction().name();
+  if (g_setsFlagsFromAccumulator.count(name))
+    flagsFromAccumulator_ = true;
+  else if (! g_preservesFlags.count(name))
+    flagsFromAccumulator_ = false;
+
+  if (name == "clc" || name == "bcs")
+    carry_ = Carry::Clear;
+  else if (name == "sec" || name == "bcc")
+    carry_ = Carry::Set;
+  else if (g_modifiesCarry.count(name))
+    carry_ = Carry::Unknown;
+
+  prev_ = &node;
+  if (g_endsSequence.count(name))
+    breakSequence();
+}
+
+void PeepholePass::remove(Statement& node, SourcePos pos, const std::string& summary, ByteLength bytes, int cycles)
+{
+  removed_.insert(&node);
+  rewrites_.push_back({ pos, summary, bytes, cycles });
+}
+
+bool PeepholePass::isSameLocation(const DirectOperation& a, const DirectOperation& b) noexcept
+{
+  if (a.index() != b.index())
+    return false;
+
+  context_.pc = a.pc();
+  auto addrA = a.expr().tryEval(context_);
+  context_.pc = b.pc();
+  auto addrB = b.expr().tryEval(context_);
+  if (! addrA.hasValue() || ! addrB.hasValue() || *addrA != *addrB || isVolatile(*addrA, a.index()))
+    return false;
+
+  // Zero page indexing wraps within the zero page, so both instructions must also use the same mode.
+  auto modeA = a.instruction().directMode(*addrA, a.index(), a.forceAbsolute());
+  auto modeB = b.instruction().directMode(*addrB, b.index(), b.forceAbsolute());
+  return modeA.hasValue() && modeB.hasValue() && isZeroPage(*modeA) == isZeroPage(*modeB);
+}
+
+bool PeepholePass::isVolatile(Address addr, IndexRegister index) const noexcept
+{
+  // Reads from the processor port at $00-$01 and the I/O area at $d000-$dfff need not return
+  // the value last written.
+  int first = addr, last = addr;
+  if (index != IndexRegister::None)
+  {
+    if (addr < 0x100)
+      first = 0;
+    last = std::min(addr + 0xff, 0xffff);
+  }
+  return first <= 0x01 || (last >= 0xd000 && first <= 0xdfff);
+}
+
+void optimize(Context& context, std::ostream *report)
+{
+  // The peephole pass needs the addresses assigned by a complete definition pass, and since removing
+  // code moves everything after it, the definitions are then repeated from scratch.
+  auto serialNum = context.symbols.serialNum();
+  define(context);
+  if (context.messages.errorCount())
+    return;
+
+  PeepholePass pass(context);
+  pass.run();
+  if (report)
+    pass.report(*report);
+
+  if (pass.hasRewrites())
+  {
+    context.symbols.truncate(serialNum);
+    define(context);
+  }
+}
+
+}
@@ -0,0 +1,15 @@
+#ifndef _INCLUDED_AS64_OPTIMIZE_H
+#define _INCLUDED_AS64_OPTIMIZE_H
+
+#include <ostream>
+
+namespace as64
+{
+
+class Context;
+
+void optimize(Context& context, std::ostream *report = nullptr);
+
+
+}
+#endif
@@ -0,0 +1,277 @@
+// Copyright (c) 2018 Robert A. Stoerrle
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+// REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+// AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+// INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+// LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+// OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+#include <sstream>
+#include <algorithm>
+#include <cstdio>
+#include "str.h"
+#include "path.h"
+#include "output.h"
+
+namespace as64
+{
+
+// ----------------------------------------------------------------------------
+//      OutputFormat
+// ----------------------------------------------------------------------------
+
+std::vector<FileChunk> OutputFormat::chunks(const CodeBuffer& buffer, std::string& storage) const
+{
+  std::ostringstream s;
+  write(s, buffer);
+  storage = s.str();
+  return { { storage.data(), storage.size() } };
+}
+
+bool OutputFormat::save(const CodeBuffer& buffer, const std::string& pathPrefix) const
+{
+  std::string storage;
+  return saveFile(joinPath(pathPrefix, buffer.filename()), chunks(buffer, storage));
+}
+
+// ----------------------------------------------------------------------------
+//      PrgFormat / BinFormat
+// ----------------------------------------------------------------------------
+
+class PrgFormat : public OutputFormat
+{
+public:
+  std::string name() const noexcept override { return "prg"; }
+  void write(std::ostream& s, const CodeBuffer& buffer) const override { buffer.write(s, true); }
+  std::vector<FileChunk> chunks(const CodeBuffer& buffer, std::string& storage) const override;
+};
+
+std::vector<FileChunk> PrgFormat::chunks(const CodeBuffer& buffer, std::string& storage) const
+{
+  storage = { static_cast<char>(buffer.origin()), static_cast<char>(buffer.origin() >> 8) };
+  return { { storage.data(), storage.size() }, { buffer.data().data(), buffer.data().size() } };
+}
+
+class BinFormat : public OutputFormat
+{
+public:
+  std::string name() const noexcept override { return "bin"; }
+  void write(std::ostream& s, const CodeBuffer& buffer) const override { buffer.write(s, false); }
+  std::vector<FileChunk> chunks(const CodeBuffer& buffer, std::string& storage) const override
+  {
+    return { { buffer.data().data(), buffer.data().size() } };
+  }
+};
+
+// ----------------------------------------------------------------------------
+//      HexFormat
+// ----------------------------------------------------------------------------
+
+// Intel HEX with 16 byte data records. Addresses never exceed 16 bits, so no extended address records
+// are needed.
+class HexFormat : public OutputFormat
+{
+public:
+  std::string name() const noexcept override { return "hex"; }
+  void write(std::ostream& s, const CodeBuffer& buffer) const override;
+
+private:
+  static void writeRecord(std::ostream& s, Byte type, Address addr, const Byte *data, int length) noexcept;
+};
+
+void HexFormat::write(std::ostream& s, const CodeBuffer& buffer) const
+{
+  constexpr int RecordLength = 16;
+
+  const auto& data = buffer.data();
+  for (size_t offset = 0; offset < data.size(); offset += RecordLength)
+  {
+    int length = std::min<size_t>(RecordLength, data.size() - offset);
+    writeRecord(s, 0x00, buffer.origin() + offset, &data[offset], length);
+  }
+  writeRecord(s, 0x01, 0, nullptr, 0);
+}
+
+void HexFormat::writeRecord(std::ostream& s, Byte type, Address addr, const Byte *data, int length) noexcept
+{
+  char buf[16];
+  Byte checksum = length + (addr >> 8) + addr + type;
+  snprintf(buf, sizeof(buf), ":%02X%04X%02X", length, addr, type);
+  s << buf;
+  for (int i = 0; i < length; ++ i)
+  {
+    snprintf(buf, sizeof(buf), "%02X", data[i]);
+    s << buf;
+    checksum += data[i];
+  }
+  snprintf(buf, sizeof(buf), "%02X", static_cast<Byte>(-checksum));
+  s << buf << "\r\n";
+}
+
+// ----------------------------------------------------------------------------
+//      CrtFormat
+// ----------------------------------------------------------------------------
+
+enum class CartridgeType
+{
+  Normal,
+  MagicDesk,
+  EasyFlash
+};
+
+// Writes a VICE cartridge image. Bank-switched types split the buffer into consecutive banks, each of which
+// is mapped at $8000.
+class CrtFormat : public OutputFormat
+{
+public:
+  CrtFormat(CartridgeType type) noexcept : type_(type) { }
+
+  std::string name() const noexcept override { return "crt"; }
+  void write(std::ostream& s, const CodeBuffer& buffer) const override;
+
+private:
+  static void writeHeader(std::ostream& s, int hardwareType, int exrom, int game, const std::string& name) noexcept;
+  static void writeChip(std::ostream& s, int bank, Address addr, const Byte *data, int length, int size) noexcept;
+
+  CartridgeType type_;
+};
+
+constexpr int BankSize = 0x2000;
+constexpr Address RomL = 0x8000;
+constexpr Address RomH = 0xa000;
+constexpr Address UltimaxRomH = 0xe000;
+
+static void writeBigEndian(std::ostream& s, uint32_t value, int size) noexcept
+{
+  while (size --)
+    s.put(static_cast<char>(value >> (size * 8)));
+}
+
+void CrtFormat::writeHeader(std::ostream& s, int hardwareType, int exrom, int game, const std::string& name) noexcept
+{
+  char title[32] = { 0 };
+  std::copy(std::begin(name), std::begin(name) + std::min<size_t>(name.length(), sizeof(title) - 1), title);
+
+  s.write("C64 CARTRIDGE   ", 16);
+  writeBigEndian(s, 0x40, 4);
+  writeBigEndian(s, 0x0100, 2);
+  writeBigEndian(s, hardwareType, 2);
+  s.put(exrom);
+  s.put(game);
+  writeBigEndian(s, 0, 6);
+  s.write(title, sizeof(title));
+}
+
+// Chips are padded with $ff to their full size, as an unprogrammed ROM would be.
+void CrtFormat::writeChip(std::ostream& s, int bank, Address addr, const Byte *data, int length, int size) noexcept
+{
+  s.write("CHIP", 4);
+  writeBigEndian(s, 0x10 + size, 4);
+  writeBigEndian(s, 0, 2);
+  writeBigEndian(s, bank, 2);
+  writeBigEndian(s, addr, 2);
+  writeBigEndian(s, size, 2);
+  s.write(reinterpret_cast<const char *>(data), length);
+  for (int i = length; i < size; ++ i)
+    s.put(static_cast<char>(0xff));
+}
+
+void CrtFormat::write(std::ostream& s, const CodeBuffer& buffer) const
+{
+  const auto& data = buffer.data();
+  int size = data.size();
+  auto title = toUpperCase(basename(buffer.filename()));
+  char buf[256];
+
+  if (type_ == CartridgeType::Normal)
+  {
+    if (buffer.origin() == UltimaxRomH && size <= BankSize)
+    {
+      writeHeader(s, 0, 1, 0, title);
+      writeChip(s, 0, UltimaxRomH, data.data(), size, BankSize);
+      return;
+    }
+    if (buffer.origin() == RomL && size <= BankSize)
+    {
+      writeHeader(s, 0, 0, 1, title);
+      writeChip(s, 0, RomL, data.data(), size, BankSize);
+      return;
+    }
+    if (buffer.origin() == RomL && size <= 2 * BankSize)
+    {
+      writeHeader(s, 0, 0, 0, title);
+      writeChip(s, 0, RomL, data.data(), size, 2 * BankSize);
+      return;
+    }
+    snprintf(buf, sizeof(buf), "'%s' ($%04x-$%04x) does not fit an 8K or 16K cartridge at $8000 or an Ultimax cartridge at $e000",
+             buffer.filename().c_str(), buffer.origin(), buffer.origin() + std::max(size, 1) - 1);
+    throw OutputFormatError(buf);
+  }
+
+  // Bank-switched data is laid out as one contiguous image, so the origin only has to match the first bank.
+  if (buffer.origin() != RomL)
+  {
+    snprintf(buf, sizeof(buf), "'%s' must start at $8000 to be split into cartridge banks", buffer.filename().c_str());
+    throw OutputFormatError(buf);
+  }
+
+  if (type_ == CartridgeType::MagicDesk)
+  {
+    constexpr int MaxBanks = 128;
+    int banks = std::max(1, (size + BankSize - 1) / BankSize);
+    if (banks > MaxBanks)
+      throw OutputFormatError("'" + buffer.filename() + "' is too large for a Magic Desk cartridge");
+    writeHeader(s, 19, 0, 1, title);
+    for (int bank = 0; bank < banks; ++ bank)
+    {
+      int offset = bank * BankSize;
+      writeChip(s, bank, RomL, data.data() + offset, std::min(BankSize, size - offset), BankSize);
+    }
+    return;
+  }
+
+  // EasyFlash banks are 16K: the first half goes to ROML and the second half, if there is one, to ROMH.
+  constexpr int MaxBanks = 64;
+  int banks = std::max(1, (size + 2 * BankSize - 1) / (2 * BankSize));
+  if (banks > MaxBanks)
+    throw OutputFormatError("'" + buffer.filename() + "' is too large for an EasyFlash cartridge");
+  writeHeader(s, 32, 1, 0, title);
+  for (int bank = 0; bank < banks; ++ bank)
+  {
+    int offset = bank * 2 * BankSize;
+    writeChip(s, bank, RomL, data.data() + offset, std::min(BankSize, size - offset), BankSize);
+    offset += BankSize;
+    if (offset < size)
+      writeChip(s, bank, RomH, data.data() + offset, std::min(BankSize, size - offset), BankSize);
+  }
+}
+
+// ----------------------------------------------------------------------------
+//      Factory
+// ----------------------------------------------------------------------------
+
+std::unique_ptr<OutputFormat> outputFormatNamed(const std::string& name) noexcept
+{
+  auto lowerName = toLowerCase(name);
+  if (lowerName == "prg")
+    return std::make_unique<PrgFormat>();
+  if (lowerName == "bin")
+    return std::make_unique<BinFormat>();
+  if (lowerName == "hex")
+    return std::make_unique<HexFormat>();
+  if (lowerName == "crt" || lowerName == "crt:normal")
+    return std::make_unique<CrtFormat>(CartridgeType::Normal);
+  if (lowerName == "crt:magicdesk")
+    return std::make_unique<CrtFormat>(CartridgeType::MagicDesk);
+  if (lowerName == "crt:easyflash")
+    return std::make_unique<CrtFormat>(CartridgeType::EasyFlash);
+  return nullptr;
+}
+
+}
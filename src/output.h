@@ -0,0 +1,57 @@
+#ifndef _INCLUDED_AS64_OUTPUT_H
+#define _INCLUDED_AS64_OUTPUT_H
+
+#include <string>
+#include <memory>
+#include <vector>
+#include <ostream>
+#include "types.h"
+#include "error.h"
+#include "buffer.h"
+#include "file.h"
+
+namespace as64
+{
+
+// ----------------------------------------------------------------------------
+//      OutputFormat
+// ----------------------------------------------------------------------------
+
+class OutputFormat
+{
+public:
+  virtual ~OutputFormat() noexcept { }
+
+  virtual std::string name() const noexcept = 0;
+  virtual void write(std::ostream& s, const CodeBuffer& buffer) const = 0;
+
+  // Returns the file contents as chunks that refer to the buffer where possible; anything generated is kept
+  // in storage. The default formats the buffer into storage with write.
+  virtual std::vector<FileChunk> chunks(const CodeBuffer& buffer, std::string& storage) const;
+
+  // Returns false if the file already had the same contents and was left alone.
+  bool save(const CodeBuffer& buffer, const std::string& pathPrefix = "") const;
+};
+
+// Recognized names are prg, bin, hex and crt. A cartridge type may follow crt after a colon: normal (the
+// default, which picks 8K, 16K or Ultimax from the size and origin), magicdesk or easyflash.
+std::unique_ptr<OutputFormat> outputFormatNamed(const std::string& name) noexcept;
+
+// ----------------------------------------------------------------------------
+//      OutputFormatError
+// ----------------------------------------------------------------------------
+
+class OutputFormatError : public GeneralError
+{
+public:
+  OutputFormatError(const std::string& message) noexcept : message_(message) { }
+
+  const char *what() const noexcept override { return "Output Format Error"; }
+  std::string message() const noexcept override { return message_; }
+
+private:
+  std::string message_;
+};
+
+}
+#endif
@@ -13,12 +13,16 @@
 // PERFORMANCE OF THIS SOFTWARE.
 
 #include <iostream>
+#include <cstring>
 #include <unordered_map>
+#include <deque>
+#include <iterator>
+#include <algorithm>
 #include "str.h"
-#include "path.h"
 #include "error.h"
 #include "parser.h"
 #include "context.h"
+#include "precompiled.h"
 
 namespace as64
 {
@@ -32,6 +36,40 @@ static bool isSafeFilename(const std::string& filename) noexcept
   return true;
 }
 
+// ----------------------------------------------------------------------------
+//      Macro
+// ----------------------------------------------------------------------------
+
+struct ScannedLine
+{
+  const Line *line;
+  std::vector<Token> tokens;
+};
+
+// The body of a macro is kept as tokens, so that a call only has to substitute the arguments for the
+// parameters instead of scanning the text again.
+struct Macro
+{
+  std::string name;
+  SourcePos pos;
+  std::vector<std::string> params;
+  std::vector<ScannedLine> body;
+};
+
+// The body of a .rept block is kept the same way and expanded once for each iteration, with the counter
+// replaced by the iteration number.
+struct Repetition
+{
+  SourcePos pos;
+  int count;
+  Token counter;
+  std::vector<ScannedLine> body;
+  int nesting;                                // .rept blocks opened and not yet closed within the body
+};
+
+constexpr int MaxMacroDepth = 64;
+constexpr int MaxExpandedLines = 1000000;     // For each line of the source, however deeply it expands
+
 // ----------------------------------------------------------------------------
 //      Parser
 // ----------------------------------------------------------------------------
@@ -46,6 +84,14 @@ public:
   void parse();
 
 private:
+  void parseLine(const Line& line, const std::vector<Token> *tokens);
+  void record(const Line& line, const std::vector<Token> *tokens);
+  void recordRepetition(const Line& line, std::vector<Token>&& tokens);
+  void checkTemporaryLabels(const Repetition& repetition) const;
+  void expand(std::vector<ScannedLine>& lines, const std::vector<ScannedLine>& body, const Line& caller,
+              const std::vector<std::string>& names, const std::vector<std::vector<Token>>& values);
+  void spend(long long count, SourcePos pos);
+  void schedule(std::vector<ScannedLine>&& lines);
   std::unique_ptr<Statement> handleStatement(LineReader& reader);
   std::unique_ptr<Statement> handleInstructionOrDirective(LineReader& reader, const Label& label,
                                                           SourcePos labelPos,bool allowDef);
@@ -64,20 +110,47 @@ private:
   std::unique_ptr<Statement> handleAsc(LineReader& reader, SourcePos pos);
   std::unique_ptr<Statement> handleScr(LineReader& reader, SourcePos pos);
   std::unique_ptr<Statement> handleBitmap(LineReader& reader, SourcePos pos);
+  std::unique_ptr<Statement> handleFill(LineReader& reader, SourcePos pos);
+  std::unique_ptr<Statement> handleTable(LineReader& reader, SourcePos pos);
+  std::unique_ptr<Statement> handleIncbin(LineReader& reader, SourcePos pos);
   std::unique_ptr<Statement> handleSeq(LineReader& reader, SourcePos pos);
+  std::unique_ptr<Statement> handleSeqOnce(LineReader& reader, SourcePos pos);
+  std::unique_ptr<Statement> include(LineReader& reader, SourcePos pos, bool once);
+  bool includePrecompiled(const std::string& filename, bool once, SourcePos pos);
   std::unique_ptr<Statement> handleObj(LineReader& reader, SourcePos pos);
+  std::unique_ptr<Statement> handleSegment(LineReader& reader, SourcePos pos);
   std::unique_ptr<Statement> handleIf(LineReader& reader, SourcePos pos);
   std::unique_ptr<Statement> handleIfdef(LineReader& reader, SourcePos pos);
   std::unique_ptr<Statement> handleElse(LineReader& reader, SourcePos pos);
   std::unique_ptr<Statement> handleEndif(LineReader& reader, SourcePos pos);
   std::unique_ptr<Statement> handleEnd(LineReader& reader, SourcePos pos);
+  std::unique_ptr<Statement> handleOpt(LineReader& reader, SourcePos pos);
+  std::unique_ptr<Statement> handleCpu(LineReader& reader, SourcePos pos);
+  std::unique_ptr<Statement> handleBudget(LineReader& reader, SourcePos pos);
+  std::unique_ptr<Statement> handleEndBudget(LineReader& reader, SourcePos pos);
+  std::unique_ptr<Statement> handleMacro(LineReader& reader, SourcePos pos);
+  std::unique_ptr<Statement> handleEndMacro(LineReader& reader, SourcePos pos);
+  std::unique_ptr<Statement> handleMacroCall(LineReader& reader, const Macro& macro, SourcePos pos);
+  std::unique_ptr<Statement> handleRept(LineReader& reader, SourcePos pos);
+  std::unique_ptr<Statement> handleEndRept(LineReader& reader, SourcePos pos);
   std::unique_ptr<Statement> handleUnsupported(LineReader& reader, SourcePos pos);
+  void addConstant(const Label& label, const Expression& expr);
   std::unique_ptr<Expression> parseExpression(LineReader& reader, bool optional = false);
   std::unique_ptr<ExprNode> parseOperand(LineReader& reader, bool optional = false);
   ByteSelector optionalByteSelector(LineReader& reader);
   IndexRegister optionalIndex(LineReader& reader, SourcePos *pos = nullptr);
 
   Context& context_;
+  Cpu cpu_;
+  int conditionalDepth_;                        // .if and .ifdef blocks open at the current line
+  int expandedLines_;                           // Lines expanded from the current line of the source
+  Context constants_;                           // Symbols already known to be constant while parsing
+  std::unordered_map<std::string, std::unique_ptr<Macro>> macros_;
+  std::unique_ptr<Macro> recording_;            // Macro whose body is being read
+  std::unique_ptr<Repetition> repeating_;       // .rept block whose body is being read
+  std::deque<ScannedLine> pending_;             // Expanded lines, read before the next line of the source
+  std::unordered_map<std::string, std::shared_ptr<const MappedFile>> mappedFiles_;   // By normalized path
+  std::vector<std::unique_ptr<Statement>> precompiled_;      // Added after the line that included them
 
   using DirectiveHandler = std::unique_ptr<Statement> (Parser::*)(LineReader& reader, SourcePos pos);
   static std::unordered_map<std::string, DirectiveHandler> directives_;
@@ -98,9 +171,17 @@ void parseFiles(Context& context, const std::vector<std::string>& filenames)
   parser.parse();
 }
 
+void parseText(Context& context, const std::string& name, const std::string& text)
+{
+  Parser parser(context);
+  context.source.includeText(name, text);
+  parser.parse();
+}
+
 Parser::Parser(Context& context)
-  : context_(context)
+  : context_(context), cpu_(context.cpu), conditionalDepth_(0), expandedLines_(0)
 {
+  context.symbols.forEach([&](const std::string& name, Address addr) { constants_.symbols.set(Label(name), addr); });
 }
 
 void Parser::file(const std::string& filename)
@@ -110,26 +191,263 @@ void Parser::file(const std::string& filename)
 
 void Parser::parse()
 {
-  Line *line;
-  while((line = context_.source.nextLine()) != nullptr)
+  for ( ; ; )
   {
+    ScannedLine scanned{ nullptr, { } };
+    bool expanded = ! pending_.empty();
+    if (expanded)
+    {
+      scanned = std::move(pending_.front());
+      pending_.pop_front();
+    }
+    else if ((scanned.line = context_.source.nextLine()) == nullptr)
+      break;
+    else
+      expandedLines_ = 0;
+
     try
     {
-      LineReader reader(*line);
-      do
+      if (recording_ || repeating_)
+        record(*scanned.line, expanded ? &scanned.tokens : nullptr);
+      else
+        parseLine(*scanned.line, expanded ? &scanned.tokens : nullptr);
+    }
+    catch (SourceError& err)
+    {
+      context_.messages.add(err.isFatal() ? Severity::FatalError : Severity::Error, err.pos(), err.message());
+      if (err.isFatal())
+        break;
+    }
+
+    for (auto& node: precompiled_)
+      context_.statements.add(std::move(node));
+    precompiled_.clear();
+  }
+
+  if (recording_)
+  {
+    if (recording_->name.empty())
+      context_.messages.error(recording_->pos, "Missing '.endm'");
+    else
+      context_.messages.error(recording_->pos, "Missing '.endm' for macro '%s'", recording_->name.c_str());
+    recording_.reset();
+  }
+  if (repeating_)
+  {
+    context_.messages.error(repeating_->pos, "Missing '.endr'");
+    repeating_.reset();
+  }
+}
+
+void Parser::parseLine(const Line& line, const std::vector<Token> *tokens)
+{
+  auto reader = tokens ? LineReader(line, *tokens) : LineReader(line);
+  do
+  {
+    context_.statements.add(handleStatement(reader));
+  }
+  while (reader.optionalPunctuator(':'));
+  auto token = reader.nextToken();
+  if (token.type != TokenType::End)
+    throwSourceError(token.pos, "Unexpected character");
+}
+
+// Lines inside a macro definition or a .rept block are kept for it and stand in the listing as empty
+// statements.
+void Parser::record(const Line& line, const std::vector<Token> *tokens)
+{
+  auto scanned = tokens ? *tokens : tokenize(line);
+  context_.statements.add(std::make_unique<EmptyStatement>(SourcePos(&line)));
+  if (repeating_)
+  {
+    recordRepetition(line, std::move(scanned));
+    return;
+  }
+  if (scanned.size() >= 2 && scanned[0].type == TokenType::Punctuator && scanned[0].punctuator == '.' &&
+      scanned[1].type == TokenType::Identifier)
+  {
+    auto directive = toLowerCase(scanned[1].text);
+    if (directive == "endm")
+    {
+      if (scanned.size() > 2)
+        throwSourceError(scanned[2].pos, "Unexpected character");
+      auto macro = std::move(recording_);
+      if (! macro->name.empty())
+        macros_[macro->name] = std::move(macro);
+      return;
+    }
+    if (directive == "macro")
+      throwSourceError(scanned[1].pos, "A macro cannot be defined inside another macro");
+  }
+  recording_->body.push_back({ &line, std::move(scanned) });
+}
+
+void Parser::recordRepetition(const Line& line, std::vector<Token>&& tokens)
+{
+  if (tokens.size() >= 2 && tokens[0].type == TokenType::Punctuator && tokens[0].punctuator == '.' &&
+      tokens[1].type == TokenType::Identifier)
+  {
+    auto directive = toLowerCase(tokens[1].text);
+    if (directive == "rept")
+      ++ repeating_->nesting;
+    else if (directive == "endr" && repeating_->nesting)
+      -- repeating_->nesting;
+    else if (directive == "endr")
+    {
+      if (tokens.size() > 2)
+        throwSourceError(tokens[2].pos, "Unexpected character");
+
+      auto repetition = std::move(repeating_);
+      if (repetition->count > 1)
+        checkTemporaryLabels(*repetition);
+      std::vector<std::string> names;
+      if (repetition->counter.type == TokenType::Identifier)
+        names.push_back(repetition->counter.text);
+      std::vector<std::vector<Token>> values{ { repetition->counter } };
+      values[0][0].type = TokenType::Number;
+      spend(static_cast<long long>(repetition->body.size()) * repetition->count, repetition->pos);
+      std::vector<ScannedLine> lines;
+      lines.reserve(repetition->body.size() * repetition->count);
+      for (int iteration = 0; iteration < repetition->count; ++ iteration)
       {
-        context_.statements.add(handleStatement(reader));
+        values[0][0].number = iteration;
+        expand(lines, repetition->body, *repetition->pos.line(), names, values);
       }
-      while (reader.optionalPunctuator(':'));
-      auto token = reader.nextToken();
-      if (token.type != TokenType::End)
-        throwSourceError(token.pos, "Unexpected character");
+      schedule(std::move(lines));
+      return;
     }
-    catch (SourceError& err)
+  }
+  repeating_->body.push_back({ &line, std::move(tokens) });
+}
+
+// Every iteration repeats the temporary labels of the body, and since temporary labels are found by address,
+// a reference that goes past the end of the body in either direction would find one from the iteration
+// before or after it. The body is only scanned as tokens, so labels and references that a macro call or
+// a nested .rept block expands to are not seen.
+void Parser::checkTemporaryLabels(const Repetition& repetition) const
+{
+  struct Use
+  {
+    SourcePos pos;
+    int labelDelta;                           // 0 for a label
+    bool forward;                             // A label that a forward reference can find
+    bool backward;                            // A label that a backward reference can find
+  };
+  std::vector<Use> uses;
+  int forwardLabels = 0, backwardLabels = 0;
+
+  for (const auto& scanned: repetition.body)
+  {
+    const auto& tokens = scanned.tokens;
+    for (size_t start = 0, end; start < tokens.size(); start = end + 1)
     {
-      context_.messages.add(Severity::Error, err.pos(), err.message());
+      for (end = start; end < tokens.size() && tokens[end].type != TokenType::End; ++ end)
+      {
+        if (tokens[end].type == TokenType::Punctuator && tokens[end].punctuator == ':')
+          break;
+      }
+
+      // A statement may start with a label, which is followed by an instruction or a directive.
+      auto i = start;
+      if (i < end && tokens[i].type == TokenType::Punctuator && std::strchr("+-/", tokens[i].punctuator))
+      {
+        bool forward = tokens[i].punctuator != '-', backward = tokens[i].punctuator != '+';
+        uses.push_back({ tokens[i].pos, 0, forward, backward });
+        forwardLabels += forward;
+        backwardLabels += backward;
+        ++ i;
+      }
+      else if (i < end && tokens[i].type == TokenType::Identifier && ! instructionNamed(tokens[i].text, cpu_) &&
+               ! macros_.count(tokens[i].text))
+        ++ i;
+      if (i + 1 < end && tokens[i].type == TokenType::Punctuator && tokens[i].punctuator == '.')
+        i += 2;
+      else if (i < end && tokens[i].type == TokenType::Identifier)
+        ++ i;
+
+      // In the operand, a + or - that doesn't follow a value refers to a temporary label.
+      for (auto operand = i; i < end; ++ i)
+      {
+        const auto& token = tokens[i];
+        if (token.type != TokenType::Punctuator || (token.punctuator != '+' && token.punctuator != '-'))
+          continue;
+        if (i > operand)
+        {
+          const auto& prev = tokens[i - 1];
+          if (prev.type != TokenType::Punctuator || std::strchr(")]*", prev.punctuator))
+            continue;
+        }
+        int count = 1;
+        while (count < 3 && i + 1 < end && tokens[i + 1].type == TokenType::Punctuator &&
+               tokens[i + 1].punctuator == token.punctuator)
+        {
+          ++ count;
+          ++ i;
+        }
+        uses.push_back({ token.pos, token.punctuator == '-' ? -count : count, false, false });
+      }
     }
   }
+
+  int before = 0, after = forwardLabels;
+  for (const auto& use: uses)
+  {
+    if (use.labelDelta == 0)
+    {
+      before += use.backward;
+      after -= use.forward;
+    }
+    else if (use.labelDelta > 0 && forwardLabels && use.labelDelta > after)
+      throwSourceError(use.pos, "The temporary label is in the next iteration of the .rept block");
+    else if (use.labelDelta < 0 && backwardLabels && -use.labelDelta > before)
+      throwSourceError(use.pos, "The temporary label is in the previous iteration of the .rept block");
+  }
+}
+
+// Appends a copy of the body to lines, with the tokens of each value in place of its name.
+void Parser::expand(std::vector<ScannedLine>& lines, const std::vector<ScannedLine>& body, const Line& caller,
+                    const std::vector<std::string>& names, const std::vector<std::vector<Token>>& values)
+{
+  for (const auto& scanned: body)
+  {
+    const auto *line = context_.source.expandLine(*scanned.line, caller);
+    std::vector<Token> tokens;
+    tokens.reserve(scanned.tokens.size());
+    for (const auto& token: scanned.tokens)
+    {
+      if (token.type == TokenType::Identifier)
+      {
+        auto i = std::find(std::begin(names), std::end(names), token.text);
+        if (i != std::end(names))
+        {
+          const auto& value = values[i - std::begin(names)];
+          tokens.insert(std::end(tokens), std::begin(value), std::end(value));
+          continue;
+        }
+      }
+      tokens.push_back(token);
+      tokens.back().pos = { line, token.pos.offset() };
+    }
+    lines.push_back({ line, std::move(tokens) });
+  }
+}
+
+// Nesting is limited by depth, but a macro that calls itself twice can still double its expansion at
+// every level, so everything a line of the source expands to counts against a budget. Running out of it
+// stops parsing, as nesting too deeply does, since the rest of the expansion is lost.
+void Parser::spend(long long count, SourcePos pos)
+{
+  if (count > MaxExpandedLines - expandedLines_)
+    throwFatalSourceError(pos, "The expansion is longer than %d lines", MaxExpandedLines);
+  expandedLines_ += static_cast<int>(count);
+}
+
+// The expanded lines go ahead of any lines still pending, so that a call or a .rept block inside an
+// expansion expands in place.
+void Parser::schedule(std::vector<ScannedLine>&& lines)
+{
+  pending_.insert(std::begin(pending_), std::make_move_iterator(std::begin(lines)),
+                  std::make_move_iterator(std::end(lines)));
 }
 
 std::unique_ptr<Statement> Parser::handleStatement(LineReader& reader)
@@ -137,9 +455,12 @@ std::unique_ptr<Statement> Parser::handleStatement(LineReader& reader)
   auto first = reader.nextToken();
   if (first.type == TokenType::Identifier)
   {
-    auto *ins = instructionNamed(first.text);
+    auto *ins = instructionNamed(first.text, cpu_);
     if (ins)
       return handleInstruction(reader, *ins, first.pos);
+    auto macro = macros_.find(first.text);
+    if (macro != std::end(macros_))
+      return handleMacroCall(reader, *macro->second, first.pos);
 
     return handleInstructionOrDirective(reader, first.text, first.pos, true);
   }
@@ -178,13 +499,25 @@ std::unique_ptr<Statement> Parser::handleInstructionOrDirective(LineReader& read
 {
   auto token = reader.nextToken();
   if (allowDef && token.type == TokenType::Punctuator && token.punctuator == '=')
-    return std::make_unique<SymbolDefinition>(labelPos, label, parseExpression(reader));
+  {
+    auto expr = parseExpression(reader);
+    addConstant(label, *expr);
+    return std::make_unique<SymbolDefinition>(labelPos, label, std::move(expr));
+  }
 
   if (token.type == TokenType::Identifier)
   {
-    auto ins = instructionNamed(token.text);
+    auto ins = instructionNamed(token.text, cpu_);
     if (! ins)
-      throwSourceError(token.pos, "Invalid instruction ('%s')", token.text.c_str());
+    {
+      auto macro = macros_.find(token.text);
+      if (macro == std::end(macros_))
+        throwSourceError(token.pos, "Invalid instruction ('%s')", token.text.c_str());
+      auto node = handleMacroCall(reader, *macro->second, token.pos);
+      if (! label.isEmpty())
+        node->setLabel(label);
+      return node;
+    }
     auto node = handleInstruction(reader, *ins, token.pos);
     if (node && ! label.isEmpty())
       node->setLabel(label);
@@ -328,7 +661,20 @@ std::unique_ptr<Statement> Parser::handleByte(LineReader& reader, SourcePos pos)
     args.push_back(parseExpression(reader));
   }
   while (reader.optionalPunctuator(','));
-  return std::make_unique<ByteDirective>(pos, selector, std::move(args));
+
+  // Constants that all fit are kept as the bytes they generate. Anything else is left for code generation,
+  // which also reports values that are out of range.
+  std::vector<Byte> values;
+  values.reserve(args.size());
+  for (const auto& expr: args)
+  {
+    auto constant = expr->value();
+    auto value = constant.hasValue() ? select(selector, *constant) : nullptr;
+    if (! value.hasValue())
+      return std::make_unique<ByteDirective>(pos, selector, std::move(args));
+    values.push_back(*value);
+  }
+  return std::make_unique<ByteDirective>(pos, selector, std::move(values));
 }
 
 std::unique_ptr<Statement> Parser::handleWord(LineReader& reader, SourcePos pos)
@@ -340,7 +686,18 @@ std::unique_ptr<Statement> Parser::handleWord(LineReader& reader, SourcePos pos)
     args.push_back(parseExpression(reader));
   }
   while (reader.optionalPunctuator(','));
-  return std::make_unique<WordDirective>(pos, std::move(args));
+
+  std::vector<Byte> values;
+  values.reserve(args.size() * 2);
+  for (const auto& expr: args)
+  {
+    auto value = expr->value();
+    if (! value.hasValue())
+      return std::make_unique<WordDirective>(pos, std::move(args));
+    values.push_back(*value & 0xff);
+    values.push_back(*value >> 8);
+  }
+  return std::make_unique<WordDirective>(pos, std::move(values));
 }
 
 std::unique_ptr<Statement> Parser::handleAsc(LineReader& reader, SourcePos pos)
@@ -382,15 +739,118 @@ std::unique_ptr<Statement> Parser::handleBitmap(LineReader& reader, SourcePos po
   return std::make_unique<BitmapDirective>(pos, std::move(values));
 }
 
+// .fill count, [<|>]expr[, index] -- the index symbol is i unless another name is given.
+std::unique_ptr<Statement> Parser::handleFill(LineReader& reader, SourcePos pos)
+{
+  auto count = parseExpression(reader);
+  reader.expectPunctuator(',');
+  auto selector = optionalByteSelector(reader);
+  auto value = parseExpression(reader);
+  std::string index = "i";
+  if (reader.optionalPunctuator(','))
+  {
+    auto token = reader.nextToken();
+    if (token.type != TokenType::Identifier)
+      throwSourceError(token.pos, "Expected an index name");
+    index = token.text;
+  }
+  return std::make_unique<FillDirective>(pos, selector, std::move(count), std::move(value), index);
+}
+
+// .table sin|cos, count, amplitude[, offset]
+std::unique_ptr<Statement> Parser::handleTable(LineReader& reader, SourcePos pos)
+{
+  auto token = reader.nextToken();
+  if (token.type != TokenType::Identifier)
+    throwSourceError(token.pos, "Expected a table function");
+  auto function = tableFunctionNamed(token.text);
+  if (! function.hasValue())
+    throwSourceError(token.pos, "Unknown table function '%s'", token.text.c_str());
+  reader.expectPunctuator(',');
+  auto count = parseExpression(reader);
+  reader.expectPunctuator(',');
+  auto amplitude = parseExpression(reader);
+  std::unique_ptr<Expression> offset;
+  if (reader.optionalPunctuator(','))
+    offset = parseExpression(reader);
+  return std::make_unique<TableDirective>(pos, *function, std::move(count), std::move(amplitude), std::move(offset));
+}
+
+// .incbin "filename"[, offset[, length]]
+std::unique_ptr<Statement> Parser::handleIncbin(LineReader& reader, SourcePos pos)
+{
+  auto token = reader.nextToken();
+  if (token.type != TokenType::Literal)
+    throwSourceError(token.pos, "Expected a quoted filename");
+
+  std::shared_ptr<const MappedFile> file;
+  const auto& filename = context_.source.resolve(pos.line()->fileIndex(), token.text);
+  auto mapped = mappedFiles_.find(filename);
+  if (mapped != std::end(mappedFiles_))
+    file = mapped->second;
+  else
+  {
+    try
+    {
+      file = std::make_shared<const MappedFile>(filename);
+    }
+    catch (GeneralError& err)
+    {
+      throwSourceError(token.pos, "%s", err.message().c_str());
+    }
+    mappedFiles_.emplace(filename, file);
+  }
+
+  // The length has to be known before the definition pass can place whatever follows.
+  size_t offset = 0;
+  size_t length = file->size();
+  if (reader.optionalPunctuator(','))
+  {
+    auto expr = parseExpression(reader);
+    auto value = expr->tryEval(context_);
+    if (! value.hasValue())
+      throwSourceError(expr->pos(), "The offset must be a constant");
+    if (*value > file->size())
+      throwSourceError(expr->pos(), "Offset %d is beyond the end of '%s'", *value, token.text.c_str());
+    offset = *value;
+    length = file->size() - offset;
+    if (reader.optionalPunctuator(','))
+    {
+      expr = parseExpression(reader);
+      value = expr->tryEval(context_);
+      if (! value.hasValue())
+        throwSourceError(expr->pos(), "The length must be a constant");
+      if (*value > length)
+        throwSourceError(expr->pos(), "Length %d is beyond the end of '%s'", *value, token.text.c_str());
+      length = *value;
+    }
+  }
+  if (length > 0xffff)
+    throwSourceError(token.pos, "Including %zu bytes of '%s' would exceed 64K", length, token.text.c_str());
+  return std::make_unique<IncbinDirective>(pos, std::move(file), offset, length);
+}
+
 std::unique_ptr<Statement> Parser::handleSeq(LineReader& reader, SourcePos pos)
+{
+  return include(reader, pos, false);
+}
+
+// Like .seq, but a file that has already been included is skipped.
+std::unique_ptr<Statement> Parser::handleSeqOnce(LineReader& reader, SourcePos pos)
+{
+  return include(reader, pos, true);
+}
+
+std::unique_ptr<Statement> Parser::include(LineReader& reader, SourcePos pos, bool once)
 {
   auto token = reader.nextToken();
   if (token.type != TokenType::Literal)
     throwSourceError(token.pos, "Expected a quoted filename");
   try
   {
-    auto filename = joinPath(dirname(pos.filename()), token.text);
-    context_.source.includeFile(filename);
+    const auto& filename = context_.source.resolve(pos.line()->fileIndex(), token.text);
+    if (! includePrecompiled(filename, once, token.pos))
+      context_.source.includeFile(filename, once);
     return std::make_unique<EmptyStatement>(pos);
   }
   catch (GeneralError& err)
@@ -399,6 +859,34 @@ std::unique_ptr<Statement> Parser::handleSeq(LineReader& reader, SourcePos pos)
   }
 }
 
+// A precompiled file stands in for its source when it is newer. One that can't be read is passed over with a
+// warning, and the source is parsed instead.
+bool Parser::includePrecompiled(const std::string& filename, bool once, SourcePos pos)
+{
+  auto pchFilename = precompiledFilename(filename);
+  if (! isNewer(pchFilename, filename))
+    return false;
+
+  std::unique_ptr<PrecompiledFile> precompiled;
+  try
+  {
+    precompiled = std::make_unique<PrecompiledFile>(MappedFile(pchFilename));
+  }
+  catch (GeneralError& err)
+  {
+    context_.messages.warning(pos, "Ignoring '%s' (%s)", pchFilename.c_str(), err.message().c_str());
+    return false;
+  }
+
+  auto fileIndex = context_.source.includeLines(filename, once);
+  if (fileIndex >= 0)
+  {
+    for (auto& node: precompiled->statements(context_.source, fileIndex))
+      precompiled_.push_back(std::move(node));
+  }
+  return true;
+}
+
 std::unique_ptr<Statement> Parser::handleObj(LineReader& reader, SourcePos pos)
 {
   auto token = reader.nextToken();
@@ -409,13 +897,23 @@ std::unique_ptr<Statement> Parser::handleObj(LineReader& reader, SourcePos pos)
   return std::make_unique<ObjectFileDirective>(pos, token.text);
 }
 
+std::unique_ptr<Statement> Parser::handleSegment(LineReader& reader, SourcePos pos)
+{
+  auto token = reader.nextToken();
+  if (token.type != TokenType::Identifier)
+    throwSourceError(token.pos, "Expected a segment name");
+  return std::make_unique<SegmentDirective>(pos, token.text);
+}
+
 std::unique_ptr<Statement> Parser::handleIf(LineReader& reader, SourcePos pos)
 {
+  ++ conditionalDepth_;
   return std::make_unique<IfDirective>(pos, parseExpression(reader));
 }
 
 std::unique_ptr<Statement> Parser::handleIfdef(LineReader& reader, SourcePos pos)
 {
+  ++ conditionalDepth_;
   auto token = reader.nextToken();
   if (token.type != TokenType::Identifier)
     throwSourceError(token.pos, "Expected a symbol name");
@@ -429,6 +927,8 @@ std::unique_ptr<Statement> Parser::handleElse(LineReader& reader, SourcePos pos)
 
 std::unique_ptr<Statement> Parser::handleEndif(LineReader& reader, SourcePos pos)
 {
+  if (conditionalDepth_ > 0)
+    -- conditionalDepth_;
   return std::make_unique<EndifDirective>(pos);
 }
 
@@ -437,6 +937,194 @@ std::unique_ptr<Statement> Parser::handleEnd(LineReader& reader, SourcePos pos)
   return std::make_unique<EndDirective>(pos);
 }
 
+std::unique_ptr<Statement> Parser::handleOpt(LineReader& reader, SourcePos pos)
+{
+  auto token = reader.nextToken();
+  if (token.type != TokenType::Identifier)
+    throwSourceError(token.pos, "Expected an optimization option");
+  auto option = toLowerCase(token.text);
+  bool enabled = option.compare(0, 2, "no") != 0;
+  if (! enabled)
+    option = option.substr(2);
+  if (option != "carry")
+    throwSourceError(token.pos, "Unknown optimization option '%s'", token.text.c_str());
+  return std::make_unique<OptimizeDirective>(pos, option, enabled);
+}
+
+// The parser switches instruction sets as it goes, before conditions are known, so a .cpu that might be
+// skipped would still take effect.
+std::unique_ptr<Statement> Parser::handleCpu(LineReader& reader, SourcePos pos)
+{
+  if (conditionalDepth_ > 0)
+    throwSourceError(pos, "'.cpu' cannot be used inside a conditional block");
+
+  // Processor names such as 6502x scan as a number followed by an identifier.
+  auto token = reader.nextToken();
+  std::string name;
+  if (token.type == TokenType::Number)
+  {
+    name = std::to_string(token.number);
+    auto suffix = reader.nextToken();
+    if (suffix.type == TokenType::Identifier && suffix.pos.offset() == token.pos.offset() + static_cast<int>(name.length()))
+      name += suffix.text;
+    else
+      reader.unget(suffix);
+  }
+  else if (token.type == TokenType::Identifier)
+    name = token.text;
+  else
+    throwSourceError(token.pos, "Expected a processor name");
+
+  auto cpu = cpuNamed(name);
+  if (! cpu.hasValue())
+    throwSourceError(token.pos, "Unknown processor '%s'", name.c_str());
+  cpu_ = *cpu;
+  return std::make_unique<CpuDirective>(pos, cpu_);
+}
+
+std::unique_ptr<Statement> Parser::handleBudget(LineReader& reader, SourcePos pos)
+{
+  return std::make_unique<BudgetBeginDirective>(pos, parseExpression(reader));
+}
+
+std::unique_ptr<Statement> Parser::handleEndBudget(LineReader& reader, SourcePos pos)
+{
+  return std::make_unique<BudgetEndDirective>(pos);
+}
+
+// Macros are defined as the source is parsed, before conditions are known, so a definition that might be
+// skipped is not allowed. The body is read even when the directive is in error, so that its lines are not
+// assembled, but the macro is only defined if it has a name.
+std::unique_ptr<Statement> Parser::handleMacro(LineReader& reader, SourcePos pos)
+{
+  recording_ = std::make_unique<Macro>();
+  recording_->pos = pos;
+  if (conditionalDepth_ > 0)
+    throwSourceError(pos, "A macro cannot be defined inside a conditional block");
+
+  auto token = reader.nextToken();
+  if (token.type != TokenType::Identifier)
+    throwSourceError(token.pos, "Expected a macro name");
+  if (instructionNamed(token.text, cpu_))
+    throwSourceError(token.pos, "'%s' is an instruction", token.text.c_str());
+  if (macros_.count(token.text))
+    throwSourceError(token.pos, "Macro '%s' already exists", token.text.c_str());
+
+  auto& macro = recording_;
+  auto param = reader.nextToken();
+  reader.unget(param);
+  if (param.type != TokenType::End)
+  {
+    do
+    {
+      param = reader.nextToken();
+      if (param.type != TokenType::Identifier)
+        throwSourceError(param.pos, "Expected a parameter name");
+      if (std::find(std::begin(macro->params), std::end(macro->params), param.text) != std::end(macro->params))
+        throwSourceError(param.pos, "Duplicate parameter '%s'", param.text.c_str());
+      macro->params.push_back(param.text);
+    }
+    while (reader.optionalPunctuator(','));
+  }
+
+  macro->name = token.text;
+  return std::make_unique<EmptyStatement>(pos);
+}
+
+std::unique_ptr<Statement> Parser::handleEndMacro(LineReader& reader, SourcePos pos)
+{
+  throwSourceError(pos, "'.endm' without '.macro'");
+}
+
+// The arguments are separated by commas outside of parentheses and end with the statement.
+std::unique_ptr<Statement> Parser::handleMacroCall(LineReader& reader, const Macro& macro, SourcePos pos)
+{
+  std::vector<std::vector<Token>> args;
+  std::vector<Token> rest;
+  int nesting = 0;
+  Token token;
+  while ((token = reader.nextToken()).type != TokenType::End)
+  {
+    if (token.type == TokenType::Punctuator && token.punctuator == ':' && nesting == 0)
+    {
+      while ((token = reader.nextToken()).type != TokenType::End)
+        rest.push_back(token);
+      if (rest.empty())
+        throwSourceError(token.pos, "Expected a statement");
+      break;
+    }
+    if (args.empty())
+      args.emplace_back();
+    if (token.type == TokenType::Punctuator)
+    {
+      if (token.punctuator == ',' && nesting == 0)
+      {
+        if (args.back().empty())
+          throwSourceError(token.pos, "Expected a macro argument");
+        args.emplace_back();
+        continue;
+      }
+      if (token.punctuator == '(')
+        ++ nesting;
+      else if (token.punctuator == ')')
+        -- nesting;
+    }
+    args.back().push_back(token);
+  }
+  if (! args.empty() && args.back().empty())
+    throwSourceError(token.pos, "Expected a macro argument");
+  if (args.size() != macro.params.size())
+  {
+    throwSourceError(pos, "Macro '%s' takes %d argument(s), not %d", macro.name.c_str(),
+                     static_cast<int>(macro.params.size()), static_cast<int>(args.size()));
+  }
+
+  int depth = 0;
+  for (const auto *caller = pos.line(); caller; caller = caller->caller())
+    ++ depth;
+  if (depth > MaxMacroDepth)
+    throwFatalSourceError(pos, "Macro calls are nested too deeply");
+
+  // Whatever followed the call on its line comes after the expansion.
+  spend(static_cast<long long>(macro.body.size()) + 1, pos);
+  std::vector<ScannedLine> lines;
+  lines.reserve(macro.body.size() + 1);
+  expand(lines, macro.body, *pos.line(), macro.params, args);
+  if (! rest.empty())
+    lines.push_back({ pos.line(), std::move(rest) });
+  schedule(std::move(lines));
+  return std::make_unique<MacroCall>(pos, macro.name);
+}
+
+std::unique_ptr<Statement> Parser::handleRept(LineReader& reader, SourcePos pos)
+{
+  // The body is read even when the directive is in error, so that its '.endr' is not reported as well.
+  repeating_ = std::make_unique<Repetition>();
+  repeating_->pos = pos;
+  repeating_->count = 0;
+  repeating_->counter.type = TokenType::End;
+  repeating_->nesting = 0;
+
+  auto expr = parseExpression(reader);
+  auto count = expr->tryEval(constants_);
+  if (! count.hasValue())
+    throwSourceError(expr->pos(), "The repeat count must be a constant or a symbol defined as one before it");
+  if (reader.optionalPunctuator(','))
+  {
+    auto counter = reader.nextToken();
+    if (counter.type != TokenType::Identifier)
+      throwSourceError(counter.pos, "Expected a counter name");
+    repeating_->counter = counter;
+  }
+  repeating_->count = *count;
+  return std::make_unique<EmptyStatement>(pos);
+}
+
+std::unique_ptr<Statement> Parser::handleEndRept(LineReader& reader, SourcePos pos)
+{
+  throwSourceError(pos, "'.endr' without '.rept'");
+}
+
 std::unique_ptr<Statement> Parser::handleUnsupported(LineReader& reader, SourcePos pos)
 {
   Token token;
@@ -449,6 +1137,34 @@ std::unique_ptr<Statement> Parser::handleUnsupported(LineReader& reader, SourceP
   return std::make_unique<EmptyStatement>(pos);
 }
 
+// The repeat count of a .rept block is needed while the source is parsed, so it can only refer to
+// definitions that came before it, outside of any conditional block, whose values were known by then.
+// Anything that refers to the program counter is left out, since it has no address yet.
+void Parser::addConstant(const Label& label, const Expression& expr)
+{
+  if (conditionalDepth_ > 0 || ! label.isSymbolic())
+    return;
+  bool relative = false;
+  expr.walk([&](const ExprNode& node)
+  {
+    if (dynamic_cast<const ExprProgramCounter *>(&node) || dynamic_cast<const ExprTemporarySymbol *>(&node))
+      relative = true;
+  });
+  if (relative)
+    return;
+
+  // Errors are left for the definition pass to report.
+  try
+  {
+    auto value = expr.tryEval(constants_);
+    if (value.hasValue())
+      constants_.symbols.set(label, *value);
+  }
+  catch (SourceError&)
+  {
+  }
+}
+
 std::unique_ptr<Expression> Parser::parseExpression(LineReader& reader, bool optional)
 {
   // Expressions are evaluated strictly left to right, with no operator precedence,
@@ -590,13 +1306,26 @@ std::unordered_map<std::string, Parser::DirectiveHandler> Parser::directives_ =
   { "asc",                  &Parser::handleAsc },
   { "scr",                  &Parser::handleScr },
   { "bitmap",               &Parser::handleBitmap },
+  { "fill",                 &Parser::handleFill },
+  { "table",                &Parser::handleTable },
+  { "incbin",               &Parser::handleIncbin },
   { "seq",                  &Parser::handleSeq },
+  { "seqonce",              &Parser::handleSeqOnce },
   { "obj",                  &Parser::handleObj },
+  { "segment",              &Parser::handleSegment },
   { "if",                   &Parser::handleIf },
   { "ifdef",                &Parser::handleIfdef },
   { "else",                 &Parser::handleElse },
   { "ife",                  &Parser::handleEndif },
   { "end",                  &Parser::handleEnd },
+  { "opt",                  &Parser::handleOpt },
+  { "cpu",                  &Parser::handleCpu },
+  { "budget",               &Parser::handleBudget },
+  { "endbudget",            &Parser::handleEndBudget },
+  { "macro",                &Parser::handleMacro },
+  { "endm",                 &Parser::handleEndMacro },
+  { "rept",                 &Parser::handleRept },
+  { "endr",                 &Parser::handleEndRept },
   { "dvi",                  &Parser::handleUnsupported },
   { "dvo",                  &Parser::handleUnsupported },
   { "burst",                &Parser::handleUnsupported },
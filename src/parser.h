@@ -11,6 +11,7 @@ class Context;
 
 void parseFile(Context& context, const std::string& filename);
 void parseFiles(Context& context, const std::vector<std::string>& filenames);
+void parseText(Context& context, const std::string& name, const std::string& text);
 
 }
 #endif
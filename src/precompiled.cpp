@@ -0,0 +1,209 @@
+// Copyright (c) 2018 Robert A. Stoerrle
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+// REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+// AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+// INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+// LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+// OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+#include <cstring>
+#include "file.h"
+#include "context.h"
+#include "define.h"
+#include "ast.h"
+#include "precompiled.h"
+
+namespace as64
+{
+
+static const char g_magic[] = "AS64PCH";      // Written with its terminating NUL
+constexpr int Version = 1;
+
+std::string precompiledFilename(const std::string& filename) noexcept
+{
+  return filename + ".pch";
+}
+
+static void appendNumber(std::string& out, unsigned value)
+{
+  do
+  {
+    auto byte = value & 0x7f;
+    value >>= 7;
+    out += static_cast<char>(value ? byte | 0x80 : byte);
+  }
+  while (value);
+}
+
+static void appendString(std::string& out, const std::string& str)
+{
+  appendNumber(out, static_cast<unsigned>(str.length()));
+  out += str;
+}
+
+// ----------------------------------------------------------------------------
+//      Decoder
+// ----------------------------------------------------------------------------
+
+class Decoder
+{
+public:
+  Decoder(const uint8_t *data, size_t size) noexcept : p_(data), end_(data + size) { }
+
+  unsigned number();
+  std::string string();
+
+private:
+  [[noreturn]] void truncated() const { throw PrecompiledFileError("The precompiled file is truncated"); }
+
+  const uint8_t *p_;
+  const uint8_t *end_;
+};
+
+unsigned Decoder::number()
+{
+  unsigned value = 0;
+  for (int shift = 0; shift < 32; shift += 7)
+  {
+    if (p_ == end_)
+      truncated();
+    auto byte = *p_ ++;
+    value |= static_cast<unsigned>(byte & 0x7f) << shift;
+    if (! (byte & 0x80))
+      return value;
+  }
+  throw PrecompiledFileError("The precompiled file contains an invalid number");
+}
+
+std::string Decoder::string()
+{
+  auto length = number();
+  if (length > static_cast<size_t>(end_ - p_))
+    truncated();
+  std::string str(reinterpret_cast<const char *>(p_), length);
+  p_ += length;
+  return str;
+}
+
+// ----------------------------------------------------------------------------
+//      PrecompiledFile
+// ----------------------------------------------------------------------------
+
+// Only statements from the file itself are looked at; a .seq in it is already an error of its own.
+PrecompiledFile::PrecompiledFile(Context& context)
+{
+  for (const auto& node: context.statements)
+  {
+    const auto *line = node->pos().line();
+    if (line->fileIndex() != 0)
+      continue;
+
+    if (dynamic_cast<const EmptyStatement *>(node.get()) && node->label().isEmpty() && tokenize(*line).empty())
+      continue;
+
+    const auto *definition = dynamic_cast<const SymbolDefinition *>(node.get());
+    if (! definition || ! definition->label().isSymbolic())
+    {
+      context.messages.error(node->pos(), "Only symbol definitions can be precompiled");
+      continue;
+    }
+
+    // A definition that refers to the program counter has a different value wherever the file is included.
+    bool relative = false;
+    definition->expr().walk([&](const ExprNode& expr)
+    {
+      if (dynamic_cast<const ExprProgramCounter *>(&expr) || dynamic_cast<const ExprTemporarySymbol *>(&expr))
+        relative = true;
+    });
+
+    const auto& name = definition->label().name();
+    try
+    {
+      auto value = relative ? nullptr : lookupSymbol(context, name);
+      if (! value.hasValue())
+      {
+        context.messages.error(node->pos(), "The value of '%s' must be constant to be precompiled", name.c_str());
+        continue;
+      }
+      definitions_.push_back({ line->lineNumber(), node->pos().offset(), definition->expr().pos().offset(),
+                               *value, name, line->text() });
+    }
+    catch (SourceError& err)
+    {
+      context.messages.add(Severity::Error, err.pos(), err.message());
+    }
+  }
+}
+
+PrecompiledFile::PrecompiledFile(const MappedFile& file)
+{
+  if (file.size() < sizeof(g_magic) + 1 || std::memcmp(file.data(), g_magic, sizeof(g_magic)) != 0)
+    throw PrecompiledFileError("Not a precompiled file");
+  if (file.data()[sizeof(g_magic)] != Version)
+    throw PrecompiledFileError("The precompiled file is from another version of as64");
+
+  Decoder decoder(file.data() + sizeof(g_magic) + 1, file.size() - sizeof(g_magic) - 1);
+  auto count = decoder.number();
+  for (unsigned index = 0; index < count; ++ index)
+  {
+    Definition definition;
+    definition.lineNumber = decoder.number();
+    definition.nameOffset = decoder.number();
+    definition.valueOffset = decoder.number();
+    definition.value = decoder.number();
+    definition.name = decoder.string();
+    definition.text = decoder.string();
+    definitions_.push_back(std::move(definition));
+  }
+}
+
+void PrecompiledFile::write(std::string& out) const
+{
+  out.append(g_magic, sizeof(g_magic));
+  out += static_cast<char>(Version);
+  appendNumber(out, static_cast<unsigned>(definitions_.size()));
+  int lineNumber = 0;
+  for (const auto& definition: definitions_)
+  {
+    appendNumber(out, static_cast<unsigned>(definition.lineNumber));
+    appendNumber(out, static_cast<unsigned>(definition.nameOffset));
+    appendNumber(out, static_cast<unsigned>(definition.valueOffset));
+    appendNumber(out, definition.value);
+    appendString(out, definition.name);
+    appendString(out, definition.lineNumber == lineNumber ? std::string() : definition.text);
+    lineNumber = definition.lineNumber;
+  }
+}
+
+bool PrecompiledFile::save(const std::string& filename) const
+{
+  std::string contents;
+  write(contents);
+  return saveFile(filename, { { contents.data(), contents.size() } });
+}
+
+// Definitions that shared a line in the source share it again.
+std::vector<std::unique_ptr<Statement>> PrecompiledFile::statements(SourceStream& source, int fileIndex) const
+{
+  std::vector<std::unique_ptr<Statement>> statements;
+  statements.reserve(definitions_.size());
+  const Line *line = nullptr;
+  for (const auto& definition: definitions_)
+  {
+    if (! line || line->lineNumber() != definition.lineNumber)
+      line = source.addLine(fileIndex, definition.lineNumber, std::string(definition.text));
+    SourcePos pos(line, definition.valueOffset);
+    auto expr = std::make_unique<Expression>(pos, std::make_unique<ExprConstant>(pos, definition.value));
+    statements.push_back(std::make_unique<SymbolDefinition>(SourcePos(line, definition.nameOffset),
+                                                            Label(definition.name), std::move(expr)));
+  }
+  return statements;
+}
+
+}
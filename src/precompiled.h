@@ -0,0 +1,81 @@
+#ifndef _INCLUDED_AS64_PRECOMPILED_H
+#define _INCLUDED_AS64_PRECOMPILED_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include "types.h"
+#include "error.h"
+
+namespace as64
+{
+
+class Context;
+class SourceStream;
+class Statement;
+class MappedFile;
+
+// The precompiled form of an include file is kept beside it, with .pch appended to its name.
+std::string precompiledFilename(const std::string& filename) noexcept;
+
+// ----------------------------------------------------------------------------
+//      PrecompiledFile
+// ----------------------------------------------------------------------------
+
+// The symbol definitions of an include file, with their values already worked out, so that the file
+// doesn't have to be read and parsed again by every program that includes it.
+//
+// The file starts with "AS64PCH\0" and a version byte (1), followed by unsigned LEB128 numbers: the
+// definition count, and then for each definition its line number, the offsets of its name and its value
+// in the line, its value, its name as a length and its bytes, and the text of its line the same way. The
+// text is left empty for a definition on the same line as the one before it.
+class PrecompiledFile
+{
+public:
+  // Collects the definitions from a file that has been parsed on its own. Anything else in the file, and
+  // any definition whose value isn't constant, is reported as an error in the context's messages.
+  explicit PrecompiledFile(Context& context);
+
+  // Reads a file written by save. Throws a PrecompiledFileError if it is damaged or from another version.
+  explicit PrecompiledFile(const MappedFile& file);
+
+  void write(std::string& out) const;
+
+  // Returns false if the file already had the same contents and was left alone.
+  bool save(const std::string& filename) const;
+
+  // Makes a statement for each definition, on lines added to the source stream for the given file.
+  std::vector<std::unique_ptr<Statement>> statements(SourceStream& source, int fileIndex) const;
+
+private:
+  struct Definition
+  {
+    int lineNumber;
+    int nameOffset;
+    int valueOffset;
+    Address value;
+    std::string name;
+    std::string text;
+  };
+
+  std::vector<Definition> definitions_;
+};
+
+// ----------------------------------------------------------------------------
+//      PrecompiledFileError
+// ----------------------------------------------------------------------------
+
+class PrecompiledFileError : public GeneralError
+{
+public:
+  PrecompiledFileError(const std::string& message) noexcept : message_(message) { }
+
+  const char *what() const noexcept override { return "Precompiled File Error"; }
+  std::string message() const noexcept override { return message_; }
+
+private:
+  std::string message_;
+};
+
+}
+#endif
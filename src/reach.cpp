@@ -0,0 +1,382 @@
+// Copyright (c) 2018 Robert A. Stoerrle
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+// REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+// AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+// INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+// LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+// OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+#include <iostream>
+#include <cstdio>
+#include <unordered_map>
+#include <unordered_set>
+#include "reach.h"
+#include "context.h"
+#include "ast.h"
+
+namespace as64
+{
+
+// ----------------------------------------------------------------------------
+//      ReachabilityPass
+// ----------------------------------------------------------------------------
+
+// The source is divided into regions, each starting at a symbolic label and running up to the next one.
+// A region reaches every region that one of its operands or data values refers to, whether by label, by
+// temporary label or through a symbol definition, and it reaches the region after it unless it ends in
+// data or in an instruction that never continues with the next one. Directives that control assembly are
+// never left out, so whatever they refer to is always reachable.
+class ReachabilityPass : public StatementVisitor
+{
+public:
+  ReachabilityPass(Context& context);
+
+  void run();
+  void mark(const std::vector<std::string>& entries);
+  void report(std::ostream& s) const noexcept;
+  bool omit();
+
+  void visit(SymbolDefinition& node) override;
+  void visit(ProgramCounterAssignment& node) override;
+  void visit(ImmediateOperation& node) override;
+  void visit(DirectOperation& node) override;
+  void visit(IndirectOperation& node) override;
+  void visit(BranchOperation& node) override;
+  void visit(OriginDirective& node) override;
+  void visit(BufferDirective& node) override;
+  void visit(OffsetBeginDirective& node) override;
+  void visit(ByteDirective& node) override;
+  void visit(WordDirective& node) override;
+  void visit(FillDirective& node) override;
+  void visit(TableDirective& node) override;
+  void visit(IfDirective& node) override;
+  void visit(IfdefDirective& node) override;
+  void visit(BudgetBeginDirective& node) override;
+
+  bool before(Statement& node) override;
+  bool uncaught(SourceError& err) override;
+
+private:
+  struct Region
+  {
+    std::string name;                         // Empty for whatever comes before the first label
+    SourcePos pos;
+    std::vector<Statement *> statements;
+    std::vector<std::string> names;
+    std::vector<Address> addrs;
+    bool fallsThrough;
+    bool reachable;
+  };
+
+  void refer(const Expression& expr);
+  void refer(const Expression& expr, Region& region);
+  void pin(const Expression& expr);
+  void follow(const std::string& name, std::vector<int>& targets, std::unordered_set<std::string>& seen) const;
+  ByteLength size(const Region& region) const noexcept;
+
+  Context& context_;
+  std::vector<Region> regions_;
+  std::unordered_map<std::string, int> labels_;
+  std::unordered_map<std::string, const SymbolDefinition *> definitions_;
+};
+
+ReachabilityPass::ReachabilityPass(Context& context)
+  : context_(context)
+{
+}
+
+void ReachabilityPass::run()
+{
+  regions_.push_back({ "", {}, {}, {}, {}, true, true });
+  context_.statements.accept(*this);
+
+  for (auto& region: regions_)
+  {
+    for (auto i = region.statements.rbegin(); i != region.statements.rend(); ++ i)
+    {
+      if (auto *op = dynamic_cast<Operation *>(*i))
+      {
+        static const std::unordered_set<std::string> endings = { "jmp", "jml", "rts", "rtl", "rti", "brk", "bra", "brl" };
+        region.fallsThrough = endings.count(op->instruction().name()) == 0;
+        break;
+      }
+      if ((*i)->range().length())
+      {
+        region.fallsThrough = false;
+        break;
+      }
+    }
+  }
+}
+
+bool ReachabilityPass::before(Statement& node)
+{
+  if (node.isSkipped())
+    return false;
+
+  context_.pc = node.pc();
+  if (node.label().isSymbolic() && ! dynamic_cast<SymbolDefinition *>(&node))
+  {
+    labels_[node.label().name()] = regions_.size();
+    regions_.push_back({ node.label().name(), node.pos(), {}, {}, {}, true, false });
+  }
+  regions_.back().statements.push_back(&node);
+  return true;
+}
+
+void ReachabilityPass::visit(SymbolDefinition& node)
+{
+  definitions_[node.label().name()] = &node;
+}
+
+void ReachabilityPass::visit(ProgramCounterAssignment& node)
+{
+  pin(node.expr());
+}
+
+void ReachabilityPass::visit(ImmediateOperation& node)
+{
+  refer(node.expr());
+}
+
+void ReachabilityPass::visit(DirectOperation& node)
+{
+  refer(node.expr());
+}
+
+void ReachabilityPass::visit(IndirectOperation& node)
+{
+  refer(node.expr());
+}
+
+void ReachabilityPass::visit(BranchOperation& node)
+{
+  refer(node.expr());
+}
+
+void ReachabilityPass::visit(OriginDirective& node)
+{
+  pin(node.expr());
+}
+
+void ReachabilityPass::visit(BufferDirective& node)
+{
+  refer(node.expr());
+}
+
+void ReachabilityPass::visit(OffsetBeginDirective& node)
+{
+  pin(node.expr());
+}
+
+void ReachabilityPass::visit(ByteDirective& node)
+{
+  for (const auto& expr: node)
+    refer(*expr);
+}
+
+void ReachabilityPass::visit(WordDirective& node)
+{
+  for (const auto& expr: node)
+    refer(*expr);
+}
+
+void ReachabilityPass::visit(FillDirective& node)
+{
+  refer(node.count());
+  refer(node.value());
+}
+
+void ReachabilityPass::visit(TableDirective& node)
+{
+  refer(node.count());
+  refer(node.amplitude());
+  if (node.offset())
+    refer(*node.offset());
+}
+
+void ReachabilityPass::visit(IfDirective& node)
+{
+  pin(node.expr());
+}
+
+void ReachabilityPass::visit(IfdefDirective& node)
+{
+  regions_.front().names.push_back(node.name());
+}
+
+void ReachabilityPass::visit(BudgetBeginDirective& node)
+{
+  pin(node.expr());
+}
+
+bool ReachabilityPass::uncaught(SourceError& err)
+{
+  context_.messages.add(err.isFatal() ? Severity::FatalError : Severity::Error, err.pos(), err.message());
+  return ! err.isFatal();
+}
+
+void ReachabilityPass::refer(const Expression& expr)
+{
+  refer(expr, regions_.back());
+}
+
+// The region before the first label is always kept, so it stands for the directives that are too.
+void ReachabilityPass::pin(const Expression& expr)
+{
+  refer(expr, regions_.front());
+}
+
+void ReachabilityPass::refer(const Expression& expr, Region& region)
+{
+  expr.walk([&](const ExprNode& node)
+  {
+    if (auto *symbol = dynamic_cast<const ExprSymbol *>(&node))
+      region.names.push_back(symbol->name());
+    else if (dynamic_cast<const ExprTemporarySymbol *>(&node))
+    {
+      auto value = node.eval(context_, false);
+      if (value)
+        region.addrs.push_back(*value->value());
+    }
+  });
+}
+
+// A name leads to the region of its label, or, for a symbol definition, to the regions of everything
+// the definition refers to.
+void ReachabilityPass::follow(const std::string& name, std::vector<int>& targets, std::unordered_set<std::string>& seen) const
+{
+  if (! seen.insert(name).second)
+    return;
+
+  auto label = labels_.find(name);
+  if (label != std::end(labels_))
+  {
+    targets.push_back(label->second);
+    return;
+  }
+
+  auto definition = definitions_.find(name);
+  if (definition == std::end(definitions_))
+    return;
+  definition->second->expr().walk([&](const ExprNode& node)
+  {
+    if (auto *symbol = dynamic_cast<const ExprSymbol *>(&node))
+      follow(symbol->name(), targets, seen);
+  });
+}
+
+void ReachabilityPass::mark(const std::vector<std::string>& entries)
+{
+  std::vector<int> work;
+  for (const auto& entry: entries)
+  {
+    std::unordered_set<std::string> seen;
+    auto count = work.size();
+    follow(entry, work, seen);
+    if (work.size() == count)
+      throw ReachabilityError("Entry symbol '" + entry + "' is not a label");
+  }
+
+  // The code before the first label can only be entered by loading it, so it is always kept.
+  work.push_back(0);
+  for (auto& region: regions_)
+    region.reachable = false;
+
+  while (! work.empty())
+  {
+    auto index = work.back();
+    work.pop_back();
+    auto& region = regions_[index];
+    if (region.reachable)
+      continue;
+    region.reachable = true;
+
+    if (region.fallsThrough && index + 1 < static_cast<int>(regions_.size()))
+      work.push_back(index + 1);
+    std::unordered_set<std::string> seen;
+    for (const auto& name: region.names)
+      follow(name, work, seen);
+
+    // A temporary label is found by its address in the regions that cover it.
+    for (auto addr: region.addrs)
+    {
+      for (size_t i = 0; i < regions_.size(); ++ i)
+      {
+        const auto& statements = regions_[i].statements;
+        if (! statements.empty() && statements.front()->pc() <= addr && addr < statements.front()->pc() + size(regions_[i]))
+          work.push_back(i);
+      }
+    }
+  }
+}
+
+ByteLength ReachabilityPass::size(const Region& region) const noexcept
+{
+  int bytes = 0;
+  for (const auto *node: region.statements)
+    bytes += node->range().length();
+  return bytes;
+}
+
+void ReachabilityPass::report(std::ostream& s) const noexcept
+{
+  int count = 0, bytes = 0;
+  for (const auto& region: regions_)
+  {
+    if (region.reachable)
+      continue;
+
+    char buf[64];
+    auto length = size(region);
+    auto start = region.statements.front()->pc();
+    if (length)
+      snprintf(buf, sizeof(buf), "$%04x-$%04x", start, start + length - 1);
+    else
+      snprintf(buf, sizeof(buf), "$%04x", start);
+    s << region.pos << ": '" << region.name << "' at " << buf << " is unreachable (" << length << " byte(s))" << std::endl;
+    ++ count;
+    bytes += length;
+  }
+  s << count << " unreachable region(s); " << bytes << " byte(s)" << std::endl;
+}
+
+// Only the statements that produce code or data are removed, along with their labels; directives that
+// control assembly stay where they are.
+bool ReachabilityPass::omit()
+{
+  std::unordered_set<const Statement *> removed;
+  for (const auto& region: regions_)
+  {
+    if (region.reachable)
+      continue;
+    for (const auto *node: region.statements)
+    {
+      if (dynamic_cast<const Operation *>(node) || dynamic_cast<const ByteDirective *>(node) ||
+          dynamic_cast<const WordDirective *>(node) || dynamic_cast<const StringDirective *>(node) ||
+          dynamic_cast<const BitmapDirective *>(node) || dynamic_cast<const BufferDirective *>(node) ||
+          dynamic_cast<const FillDirective *>(node) || dynamic_cast<const TableDirective *>(node) ||
+          dynamic_cast<const IncbinDirective *>(node))
+        removed.insert(node);
+    }
+  }
+  context_.statements.remove(removed);
+  return ! removed.empty();
+}
+
+bool findUnreachable(std::ostream& s, Context& context, const std::vector<std::string>& entries, bool omit)
+{
+  ReachabilityPass pass(context);
+  pass.run();
+  pass.mark(entries);
+  pass.report(s);
+  return omit && pass.omit();
+}
+
+}
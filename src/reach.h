@@ -0,0 +1,36 @@
+#ifndef _INCLUDED_AS64_REACH_H
+#define _INCLUDED_AS64_REACH_H
+
+#include <string>
+#include <vector>
+#include <ostream>
+#include "error.h"
+
+namespace as64
+{
+
+class Context;
+
+// ----------------------------------------------------------------------------
+//      ReachabilityError
+// ----------------------------------------------------------------------------
+
+class ReachabilityError : public GeneralError
+{
+public:
+  ReachabilityError(const std::string& message) noexcept : message_(message) { }
+
+  const char *what() const noexcept override { return "Reachability Error"; }
+  std::string message() const noexcept override { return message_; }
+
+private:
+  std::string message_;
+};
+
+// Writes a report of the labeled regions of code and data that cannot be reached from any of the entry
+// symbols. With omit set, the statements of those regions are also removed; the return value says whether
+// anything was removed, in which case the source has to be defined and emitted again.
+bool findUnreachable(std::ostream& s, Context& context, const std::vector<std::string>& entries, bool omit);
+
+}
+#endif
@@ -0,0 +1,650 @@
+// Copyright (c) 2018 Robert A. Stoerrle
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+// REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+// AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+// INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+// LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+// OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+#include <iostream>
+#include <algorithm>
+#include <cstdio>
+#include "simulator.h"
+#include "define.h"
+#include "context.h"
+#include "str.h"
+
+namespace as64
+{
+
+constexpr Byte FlagC = 0x01;
+constexpr Byte FlagZ = 0x02;
+constexpr Byte FlagI = 0x04;
+constexpr Byte FlagD = 0x08;
+constexpr Byte FlagB = 0x10;
+constexpr Byte FlagU = 0x20;
+constexpr Byte FlagV = 0x40;
+constexpr Byte FlagN = 0x80;
+
+// ----------------------------------------------------------------------------
+//      Simulator
+// ----------------------------------------------------------------------------
+
+Simulator::Simulator(Cpu cpu) noexcept
+  : cpu_(cpu), memory_(0x10000), a_(0), x_(0), y_(0), s_(0xff), p_(FlagU | FlagI), pc_(0), addr_(0),
+    mode_(AddrMode::Implied), pageCrossed_(false), extraCycles_(0), topStack_(0xff), halted_(false),
+    cycles_(0), instructions_(0), executions_(0x10000), cyclesAt_(0x10000)
+{
+  // The decoder is derived from the assembler's own instruction table so that the two cannot disagree.
+  // An NMOS part executes the undocumented opcodes whether or not the assembler was told about them.
+  for (auto& entry: decode_)
+    entry = { nullptr, AddrMode::Implied };
+  forEachInstruction(isCmos(cpu) ? cpu : Cpu::Mos6502X, [&](const Instruction& ins)
+  {
+    auto i = handlers_.find(ins.name());
+    if (i == std::end(handlers_))
+      return;
+    for (size_t mode = 0; mode < AddrModeCount; ++ mode)
+    {
+      auto op = ins.opcode(static_cast<AddrMode>(mode));
+      if (isValid(op))
+        decode_[op] = { i->second, static_cast<AddrMode>(mode) };
+    }
+  });
+}
+
+void Simulator::load(const CodeBuffer& buffer) noexcept
+{
+  for (ByteLength offset = 0; offset < buffer.size(); ++ offset)
+    memory_[static_cast<Address>(buffer.origin() + offset)] = buffer[offset];
+}
+
+void Simulator::run(Address addr, uint64_t maxCycles)
+{
+  call(addr);
+  while (! halted_)
+  {
+    step();
+    if (cycles_ > maxCycles)
+    {
+      char buf[128];
+      snprintf(buf, sizeof(buf), "Simulation stopped at $%04x after exceeding %llu cycles", pc_,
+               static_cast<unsigned long long>(maxCycles));
+      throw SimulationError(buf);
+    }
+  }
+}
+
+void Simulator::call(Address addr) noexcept
+{
+  pc_ = addr;
+  topStack_ = s_;
+  halted_ = false;
+}
+
+int Simulator::step()
+{
+  auto pc = pc_;
+  auto op = memory_[pc_++];
+  const auto& entry = decode_[op];
+  if (! entry.handler)
+  {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "Cannot simulate opcode $%02x at $%04x", op, pc);
+    throw SimulationError(buf);
+  }
+
+  extraCycles_ = 0;
+  resolve(entry.mode);
+  (this->*entry.handler)();
+
+  int cycles = cycleCount(op, cpu_) + extraCycles_;
+  if (pageCrossed_ && hasPageCrossingPenalty(op, cpu_))
+    ++ cycles;
+  cycles_ += cycles;
+  ++ instructions_;
+  ++ executions_[pc];
+  cyclesAt_[pc] += cycles;
+  return cycles;
+}
+
+void Simulator::resolve(AddrMode mode) noexcept
+{
+  mode_ = mode;
+  pageCrossed_ = false;
+  switch (mode)
+  {
+    case AddrMode::Immediate:
+      addr_ = pc_++;
+      break;
+
+    case AddrMode::Relative:
+    {
+      auto delta = static_cast<SByte>(memory_[pc_++]);
+      addr_ = pc_ + delta;
+      pageCrossed_ = (addr_ & 0xff00) != (pc_ & 0xff00);
+      break;
+    }
+
+    case AddrMode::Absolute:
+      addr_ = readWord(pc_);
+      pc_ += 2;
+      break;
+
+    case AddrMode::AbsoluteX:
+    case AddrMode::AbsoluteY:
+    {
+      Address base = readWord(pc_);
+      pc_ += 2;
+      addr_ = base + (mode == AddrMode::AbsoluteX ? x_ : y_);
+      pageCrossed_ = (addr_ & 0xff00) != (base & 0xff00);
+      break;
+    }
+
+    case AddrMode::ZeroPage:
+      addr_ = memory_[pc_++];
+      break;
+
+    case AddrMode::ZeroPageX:
+      addr_ = static_cast<Byte>(memory_[pc_++] + x_);
+      break;
+
+    case AddrMode::ZeroPageY:
+      addr_ = static_cast<Byte>(memory_[pc_++] + y_);
+      break;
+
+    case AddrMode::Indirect:
+    {
+      // The NMOS part never carries into the high byte of the pointer.
+      Address ptr = readWord(pc_);
+      pc_ += 2;
+      if (isCmos(cpu_))
+        addr_ = readWord(ptr);
+      else
+        addr_ = memory_[ptr] | (memory_[(ptr & 0xff00) | static_cast<Byte>(ptr + 1)] << 8);
+      break;
+    }
+
+    case AddrMode::AbsoluteIndexedIndirect:
+      addr_ = readWord(readWord(pc_) + x_);
+      pc_ += 2;
+      break;
+
+    case AddrMode::ZeroPageIndirect:
+    {
+      Byte zp = memory_[pc_++];
+      addr_ = memory_[zp] | (memory_[static_cast<Byte>(zp + 1)] << 8);
+      break;
+    }
+
+    case AddrMode::IndexedIndirect:
+    {
+      Byte zp = memory_[pc_++] + x_;
+      addr_ = memory_[zp] | (memory_[static_cast<Byte>(zp + 1)] << 8);
+      break;
+    }
+
+    case AddrMode::IndirectIndexed:
+    {
+      Byte zp = memory_[pc_++];
+      Address base = memory_[zp] | (memory_[static_cast<Byte>(zp + 1)] << 8);
+      addr_ = base + y_;
+      pageCrossed_ = (addr_ & 0xff00) != (base & 0xff00);
+      break;
+    }
+
+    default:
+      break;
+  }
+}
+
+Byte Simulator::operand() const noexcept
+{
+  return mode_ == AddrMode::Accumulator ? a_ : memory_[addr_];
+}
+
+void Simulator::store(Byte value) noexcept
+{
+  if (mode_ == AddrMode::Accumulator)
+    a_ = value;
+  else
+    memory_[addr_] = value;
+}
+
+Address Simulator::readWord(Address addr) const noexcept
+{
+  return memory_[addr] | (memory_[static_cast<Address>(addr + 1)] << 8);
+}
+
+Byte Simulator::setNZ(Byte value) noexcept
+{
+  setFlag(FlagZ, value == 0);
+  setFlag(FlagN, (value & 0x80) != 0);
+  return value;
+}
+
+void Simulator::branch(bool condition) noexcept
+{
+  if (condition)
+  {
+    extraCycles_ = pageCrossed_ ? 2 : 1;
+    pc_ = addr_;
+  }
+  pageCrossed_ = false;
+}
+
+void Simulator::compare(Byte reg) noexcept
+{
+  auto value = operand();
+  setFlag(FlagC, reg >= value);
+  setNZ(reg - value);
+}
+
+void Simulator::add(Byte value) noexcept
+{
+  int carry = flag(FlagC) ? 1 : 0;
+  int sum = a_ + value + carry;
+  if (flag(FlagD))
+  {
+    int lo = (a_ & 0x0f) + (value & 0x0f) + carry;
+    if (lo > 9)
+      lo += 6;
+    int hi = (a_ >> 4) + (value >> 4) + (lo > 0x0f ? 1 : 0);
+    setFlag(FlagZ, (sum & 0xff) == 0);
+    setFlag(FlagN, (hi & 0x08) != 0);
+    setFlag(FlagV, (~(a_ ^ value) & (a_ ^ (hi << 4)) & 0x80) != 0);
+    if (hi > 9)
+      hi += 6;
+    setFlag(FlagC, hi > 0x0f);
+    a_ = (hi << 4) | (lo & 0x0f);
+    if (cpu_ == Cpu::Wdc65C02)
+    {
+      setNZ(a_);
+      ++ extraCycles_;
+    }
+    return;
+  }
+  setFlag(FlagC, sum > 0xff);
+  setFlag(FlagV, (~(a_ ^ value) & (a_ ^ sum) & 0x80) != 0);
+  a_ = setNZ(sum);
+}
+
+void Simulator::subtract(Byte value) noexcept
+{
+  int borrow = flag(FlagC) ? 0 : 1;
+  int diff = a_ - value - borrow;
+  setFlag(FlagC, diff >= 0);
+  setFlag(FlagV, ((a_ ^ value) & (a_ ^ diff) & 0x80) != 0);
+  setNZ(diff);
+  if (flag(FlagD))
+  {
+    int lo = (a_ & 0x0f) - (value & 0x0f) - borrow;
+    int hi = (a_ >> 4) - (value >> 4);
+    if (lo & 0x10)
+    {
+      lo -= 6;
+      -- hi;
+    }
+    if (hi & 0x10)
+      hi -= 6;
+    a_ = (hi << 4) | (lo & 0x0f);
+    if (cpu_ == Cpu::Wdc65C02)
+    {
+      setNZ(a_);
+      ++ extraCycles_;
+    }
+    return;
+  }
+  a_ = diff;
+}
+
+void Simulator::adc() { add(operand()); }
+void Simulator::and_() { a_ = setNZ(a_ & operand()); }
+void Simulator::bcc() { branch(! flag(FlagC)); }
+void Simulator::bcs() { branch(flag(FlagC)); }
+void Simulator::beq() { branch(flag(FlagZ)); }
+void Simulator::bmi() { branch(flag(FlagN)); }
+void Simulator::bne() { branch(! flag(FlagZ)); }
+void Simulator::bpl() { branch(! flag(FlagN)); }
+void Simulator::bvc() { branch(! flag(FlagV)); }
+void Simulator::bvs() { branch(flag(FlagV)); }
+void Simulator::clc() { setFlag(FlagC, false); }
+void Simulator::cld() { setFlag(FlagD, false); }
+void Simulator::cli() { setFlag(FlagI, false); }
+void Simulator::clv() { setFlag(FlagV, false); }
+void Simulator::cmp() { compare(a_); }
+void Simulator::cpx() { compare(x_); }
+void Simulator::cpy() { compare(y_); }
+void Simulator::dec() { store(setNZ(operand() - 1)); }
+void Simulator::dex() { x_ = setNZ(x_ - 1); }
+void Simulator::dey() { y_ = setNZ(y_ - 1); }
+void Simulator::eor() { a_ = setNZ(a_ ^ operand()); }
+void Simulator::inc() { store(setNZ(operand() + 1)); }
+void Simulator::inx() { x_ = setNZ(x_ + 1); }
+void Simulator::iny() { y_ = setNZ(y_ + 1); }
+void Simulator::jmp() { pc_ = addr_; }
+void Simulator::lda() { a_ = setNZ(operand()); }
+void Simulator::ldx() { x_ = setNZ(operand()); }
+void Simulator::ldy() { y_ = setNZ(operand()); }
+void Simulator::nop() { }
+void Simulator::ora() { a_ = setNZ(a_ | operand()); }
+void Simulator::pha() { push(a_); }
+void Simulator::php() { push(p_ | FlagB | FlagU); }
+void Simulator::pla() { a_ = setNZ(pull()); }
+void Simulator::plp() { p_ = pull() | FlagU; }
+void Simulator::sbc() { subtract(operand()); }
+void Simulator::sec() { setFlag(FlagC, true); }
+void Simulator::sed() { setFlag(FlagD, true); }
+void Simulator::sei() { setFlag(FlagI, true); }
+void Simulator::sta() { store(a_); }
+void Simulator::stx() { store(x_); }
+void Simulator::sty() { store(y_); }
+void Simulator::tax() { x_ = setNZ(a_); }
+void Simulator::tay() { y_ = setNZ(a_); }
+void Simulator::tsx() { x_ = setNZ(s_); }
+void Simulator::txa() { a_ = setNZ(x_); }
+void Simulator::txs() { s_ = x_; }
+void Simulator::tya() { a_ = setNZ(y_); }
+
+void Simulator::asl()
+{
+  auto value = operand();
+  setFlag(FlagC, (value & 0x80) != 0);
+  store(setNZ(value << 1));
+}
+
+void Simulator::lsr()
+{
+  auto value = operand();
+  setFlag(FlagC, (value & 0x01) != 0);
+  store(setNZ(value >> 1));
+}
+
+void Simulator::rol()
+{
+  auto value = operand();
+  Byte result = (value << 1) | (flag(FlagC) ? 0x01 : 0);
+  setFlag(FlagC, (value & 0x80) != 0);
+  store(setNZ(result));
+}
+
+void Simulator::ror()
+{
+  auto value = operand();
+  Byte result = (value >> 1) | (flag(FlagC) ? 0x80 : 0);
+  setFlag(FlagC, (value & 0x01) != 0);
+  store(setNZ(result));
+}
+
+void Simulator::bit()
+{
+  auto value = operand();
+  setFlag(FlagZ, (a_ & value) == 0);
+  if (mode_ == AddrMode::Immediate)
+    return;
+  setFlag(FlagN, (value & 0x80) != 0);
+  setFlag(FlagV, (value & 0x40) != 0);
+}
+
+void Simulator::brk()
+{
+  // A brk ends the simulation instead of vectoring through $fffe.
+  halted_ = true;
+}
+
+void Simulator::jsr()
+{
+  Address ret = pc_ - 1;
+  push(ret >> 8);
+  push(ret);
+  pc_ = addr_;
+}
+
+void Simulator::rts()
+{
+  if (s_ == topStack_)
+  {
+    halted_ = true;
+    return;
+  }
+  Address ret = pull();
+  ret |= pull() << 8;
+  pc_ = ret + 1;
+}
+
+void Simulator::rti()
+{
+  p_ = pull() | FlagU;
+  Address ret = pull();
+  ret |= pull() << 8;
+  pc_ = ret;
+}
+
+void Simulator::alr()
+{
+  a_ &= operand();
+  setFlag(FlagC, (a_ & 0x01) != 0);
+  a_ = setNZ(a_ >> 1);
+}
+
+void Simulator::anc()
+{
+  a_ = setNZ(a_ & operand());
+  setFlag(FlagC, flag(FlagN));
+}
+
+void Simulator::arr()
+{
+  Byte value = a_ & operand();
+  a_ = setNZ((value >> 1) | (flag(FlagC) ? 0x80 : 0));
+  setFlag(FlagC, (a_ & 0x40) != 0);
+  setFlag(FlagV, ((a_ >> 6) ^ (a_ >> 5)) & 0x01);
+}
+
+void Simulator::dcp()
+{
+  store(operand() - 1);
+  compare(a_);
+}
+
+void Simulator::isc()
+{
+  store(operand() + 1);
+  subtract(operand());
+}
+
+void Simulator::lax()
+{
+  a_ = x_ = setNZ(operand());
+}
+
+void Simulator::rla()
+{
+  rol();
+  a_ = setNZ(a_ & operand());
+}
+
+void Simulator::rra()
+{
+  ror();
+  add(operand());
+}
+
+void Simulator::sax()
+{
+  store(a_ & x_);
+}
+
+void Simulator::sbx()
+{
+  Byte value = operand();
+  Byte ax = a_ & x_;
+  setFlag(FlagC, ax >= value);
+  x_ = setNZ(ax - value);
+}
+
+void Simulator::slo()
+{
+  asl();
+  a_ = setNZ(a_ | operand());
+}
+
+void Simulator::sre()
+{
+  lsr();
+  a_ = setNZ(a_ ^ operand());
+}
+
+void Simulator::bra() { branch(true); }
+void Simulator::phx() { push(x_); }
+void Simulator::phy() { push(y_); }
+void Simulator::plx() { x_ = setNZ(pull()); }
+void Simulator::ply() { y_ = setNZ(pull()); }
+void Simulator::stz() { store(0); }
+
+void Simulator::trb()
+{
+  auto value = operand();
+  setFlag(FlagZ, (a_ & value) == 0);
+  store(value & ~a_);
+}
+
+void Simulator::tsb()
+{
+  auto value = operand();
+  setFlag(FlagZ, (a_ & value) == 0);
+  store(value | a_);
+}
+
+std::unordered_map<std::string, Simulator::Handler> Simulator::handlers_ =
+{
+  { "adc", &Simulator::adc },   { "and", &Simulator::and_ },  { "asl", &Simulator::asl },   { "bcc", &Simulator::bcc },
+  { "bcs", &Simulator::bcs },   { "beq", &Simulator::beq },   { "bit", &Simulator::bit },   { "bmi", &Simulator::bmi },
+  { "bne", &Simulator::bne },   { "bpl", &Simulator::bpl },   { "brk", &Simulator::brk },   { "bvc", &Simulator::bvc },
+  { "bvs", &Simulator::bvs },   { "clc", &Simulator::clc },   { "cld", &Simulator::cld },   { "cli", &Simulator::cli },
+  { "clv", &Simulator::clv },   { "cmp", &Simulator::cmp },   { "cpx", &Simulator::cpx },   { "cpy", &Simulator::cpy },
+  { "dec", &Simulator::dec },   { "dex", &Simulator::dex },   { "dey", &Simulator::dey },   { "eor", &Simulator::eor },
+  { "inc", &Simulator::inc },   { "inx", &Simulator::inx },   { "iny", &Simulator::iny },   { "jmp", &Simulator::jmp },
+  { "jsr", &Simulator::jsr },   { "lda", &Simulator::lda },   { "ldx", &Simulator::ldx },   { "ldy", &Simulator::ldy },
+  { "lsr", &Simulator::lsr },   { "nop", &Simulator::nop },   { "ora", &Simulator::ora },   { "pha", &Simulator::pha },
+  { "php", &Simulator::php },   { "pla", &Simulator::pla },   { "plp", &Simulator::plp },   { "rol", &Simulator::rol },
+  { "ror", &Simulator::ror },   { "rti", &Simulator::rti },   { "rts", &Simulator::rts },   { "sbc", &Simulator::sbc },
+  { "sec", &Simulator::sec },   { "sed", &Simulator::sed },   { "sei", &Simulator::sei },   { "sta", &Simulator::sta },
+  { "stx", &Simulator::stx },   { "sty", &Simulator::sty },   { "tax", &Simulator::tax },   { "tay", &Simulator::tay },
+  { "tsx", &Simulator::tsx },   { "txa", &Simulator::txa },   { "txs", &Simulator::txs },   { "tya", &Simulator::tya },
+  { "alr", &Simulator::alr },   { "anc", &Simulator::anc },   { "arr", &Simulator::arr },   { "dcp", &Simulator::dcp },
+  { "isc", &Simulator::isc },   { "lax", &Simulator::lax },   { "rla", &Simulator::rla },   { "rra", &Simulator::rra },
+  { "sax", &Simulator::sax },   { "sbx", &Simulator::sbx },   { "slo", &Simulator::slo },   { "sre", &Simulator::sre },
+  { "bra", &Simulator::bra },   { "phx", &Simulator::phx },   { "phy", &Simulator::phy },   { "plx", &Simulator::plx },
+  { "ply", &Simulator::ply },   { "stz", &Simulator::stz },   { "trb", &Simulator::trb },   { "tsb", &Simulator::tsb }
+};
+
+// ----------------------------------------------------------------------------
+//      Profile
+// ----------------------------------------------------------------------------
+
+static Cpu cpuAt(const Context& context, const Statement *node) noexcept
+{
+  auto cpu = context.cpu;
+  for (const auto& statement: context.statements)
+  {
+    if (statement.get() == node)
+      break;
+    const auto *directive = dynamic_cast<const CpuDirective *>(statement.get());
+    if (directive && ! directive->isSkipped())
+      cpu = directive->cpu();
+  }
+  return cpu;
+}
+
+void simulate(std::ostream& s, Context& context, const std::string& entry)
+{
+  auto start = lookupSymbol(context, entry);
+  if (! start.hasValue())
+    throw SimulationError("Undefined entry symbol '" + entry + "'");
+
+  // The entry point is simulated on the processor selected where its label is defined.
+  const Statement *entryNode = nullptr;
+  for (const auto& node: context.statements)
+  {
+    if (node->label().isSymbolic() && node->label().name() == entry && ! node->isSkipped())
+    {
+      entryNode = node.get();
+      break;
+    }
+  }
+
+  Simulator sim(cpuAt(context, entryNode));
+  for (const auto& buffer: context.buffers)
+    sim.load(*buffer);
+  sim.run(*start);
+
+  // Both tables are sorted by cost, with ties left in source order.
+  struct LineProfile
+  {
+    uint64_t executions;
+    uint64_t cycles;
+    std::string location;
+    std::string text;
+  };
+  std::vector<LineProfile> lines;
+
+  struct LabelProfile
+  {
+    std::string name;
+    uint64_t entries;
+    uint64_t cycles;
+  };
+  std::vector<LabelProfile> labels;
+  for (const auto& node: context.statements)
+  {
+    if (node->isSkipped())
+      continue;
+    if (node->label().isSymbolic() && node->range().length())
+      labels.push_back({ node->label().name(), sim.executions(node->pc()), 0 });
+    if (! dynamic_cast<Operation *>(node.get()) || ! sim.executions(node->pc()))
+      continue;
+
+    auto cycles = sim.cyclesAt(node->pc());
+    if (! labels.empty())
+      labels.back().cycles += cycles;
+    lines.push_back({ sim.executions(node->pc()), cycles,
+                      node->pos().filename() + ':' + std::to_string(node->pos().lineNumber()), trim(node->sourceText()) });
+  }
+
+  auto byCycles = [](const auto& a, const auto& b) { return a.cycles > b.cycles; };
+  std::stable_sort(std::begin(lines), std::end(lines), byCycles);
+  std::stable_sort(std::begin(labels), std::end(labels), byCycles);
+
+  char buf[1024];
+  s << "Executed " << sim.instructions() << " instruction(s) in " << sim.cycles() << " cycle(s)" << std::endl;
+  s << std::endl;
+  snprintf(buf, sizeof(buf), "%12s %12s  %-24s %s\n", "count", "cycles", "location", "source");
+  s << buf;
+  for (const auto& line: lines)
+  {
+    snprintf(buf, sizeof(buf), "%12llu %12llu  %-24s %s\n", static_cast<unsigned long long>(line.executions),
+             static_cast<unsigned long long>(line.cycles), line.location.c_str(), line.text.c_str());
+    s << buf;
+  }
+
+  s << std::endl;
+  snprintf(buf, sizeof(buf), "%12s %12s  %s\n", "entries", "cycles", "label");
+  s << buf;
+  for (const auto& label: labels)
+  {
+    if (! label.cycles)
+      continue;
+    snprintf(buf, sizeof(buf), "%12llu %12llu  %s\n", static_cast<unsigned long long>(label.entries),
+             static_cast<unsigned long long>(label.cycles), label.name.c_str());
+    s << buf;
+  }
+}
+
+}
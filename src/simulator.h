@@ -0,0 +1,124 @@
+#ifndef _INCLUDED_AS64_SIMULATOR_H
+#define _INCLUDED_AS64_SIMULATOR_H
+
+#include <string>
+#include <vector>
+#include <ostream>
+#include <unordered_map>
+#include "types.h"
+#include "error.h"
+#include "buffer.h"
+#include "instruction.h"
+
+namespace as64
+{
+
+class Context;
+
+// ----------------------------------------------------------------------------
+//      Simulator
+// ----------------------------------------------------------------------------
+
+class Simulator
+{
+public:
+  Simulator(Cpu cpu = Cpu::Mos6502X) noexcept;
+
+  void load(const CodeBuffer& buffer) noexcept;
+  Byte read(Address addr) const noexcept { return memory_[addr]; }
+  void write(Address addr, Byte value) noexcept { memory_[addr] = value; }
+
+  Byte a() const noexcept { return a_; }
+  Byte x() const noexcept { return x_; }
+  Byte y() const noexcept { return y_; }
+  Byte s() const noexcept { return s_; }
+  Address pc() const noexcept { return pc_; }
+  bool isHalted() const noexcept { return halted_; }
+
+  // Executes from addr as though the code had been called with jsr, stopping at a brk or at the rts
+  // that returns from the top frame.
+  void run(Address addr, uint64_t maxCycles = 100000000);
+  void call(Address addr) noexcept;
+  int step();
+
+  uint64_t cycles() const noexcept { return cycles_; }
+  uint64_t instructions() const noexcept { return instructions_; }
+  uint64_t executions(Address addr) const noexcept { return executions_[addr]; }
+  uint64_t cyclesAt(Address addr) const noexcept { return cyclesAt_[addr]; }
+
+private:
+  using Handler = void (Simulator::*)();
+
+  struct Decoded
+  {
+    Handler handler;
+    AddrMode mode;
+  };
+
+  void resolve(AddrMode mode) noexcept;
+  Byte operand() const noexcept;
+  void store(Byte value) noexcept;
+  Address readWord(Address addr) const noexcept;
+  void push(Byte value) noexcept { memory_[0x100 + s_--] = value; }
+  Byte pull() noexcept { return memory_[0x100 + ++ s_]; }
+  void setFlag(Byte flag, bool value) noexcept { p_ = value ? (p_ | flag) : (p_ & ~flag); }
+  bool flag(Byte flag) const noexcept { return (p_ & flag) != 0; }
+  Byte setNZ(Byte value) noexcept;
+  void branch(bool condition) noexcept;
+  void compare(Byte reg) noexcept;
+  void add(Byte value) noexcept;
+  void subtract(Byte value) noexcept;
+
+  void adc(); void and_(); void asl(); void bcc(); void bcs(); void beq(); void bit(); void bmi();
+  void bne(); void bpl(); void brk(); void bvc(); void bvs(); void clc(); void cld(); void cli();
+  void clv(); void cmp(); void cpx(); void cpy(); void dec(); void dex(); void dey(); void eor();
+  void inc(); void inx(); void iny(); void jmp(); void jsr(); void lda(); void ldx(); void ldy();
+  void lsr(); void nop(); void ora(); void pha(); void php(); void pla(); void plp(); void rol();
+  void ror(); void rti(); void rts(); void sbc(); void sec(); void sed(); void sei(); void sta();
+  void stx(); void sty(); void tax(); void tay(); void tsx(); void txa(); void txs(); void tya();
+
+  void alr(); void anc(); void arr(); void dcp(); void isc(); void lax(); void rla(); void rra();
+  void sax(); void sbx(); void slo(); void sre();
+
+  void bra(); void phx(); void phy(); void plx(); void ply(); void stz(); void trb(); void tsb();
+
+  Cpu cpu_;
+  Decoded decode_[256];
+  std::vector<Byte> memory_;
+  Byte a_, x_, y_, s_, p_;
+  Address pc_;
+  Address addr_;
+  AddrMode mode_;
+  bool pageCrossed_;
+  int extraCycles_;
+  Byte topStack_;
+  bool halted_;
+
+  uint64_t cycles_;
+  uint64_t instructions_;
+  std::vector<uint64_t> executions_;
+  std::vector<uint64_t> cyclesAt_;
+
+  static std::unordered_map<std::string, Handler> handlers_;
+};
+
+// ----------------------------------------------------------------------------
+//      SimulationError
+// ----------------------------------------------------------------------------
+
+class SimulationError : public GeneralError
+{
+public:
+  SimulationError(const std::string& message) noexcept : message_(message) { }
+
+  const char *what() const noexcept override { return "Simulation Error"; }
+  std::string message() const noexcept override { return message_; }
+
+private:
+  std::string message_;
+};
+
+void simulate(std::ostream& s, Context& context, const std::string& entry);
+
+}
+#endif
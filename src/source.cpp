@@ -20,6 +20,7 @@
 #include "error.h"
 #include "source.h"
 #include "path.h"
+#include "file.h"
 
 namespace as64
 {
@@ -28,8 +29,8 @@ namespace as64
 //      Line
 // ----------------------------------------------------------------------------
 
-Line::Line(SourceStream& stream, int fileIndex, int lineNumber, std::string&& text) noexcept
-  : stream_(stream), fileIndex_(fileIndex), lineNumber_(lineNumber), text_(std::move(text))
+Line::Line(SourceStream& stream, int fileIndex, int lineNumber, std::string&& text, const Line *caller) noexcept
+  : stream_(stream), fileIndex_(fileIndex), lineNumber_(lineNumber), text_(std::move(text)), caller_(caller)
 {
 }
 
@@ -38,7 +39,7 @@ std::string Line::filename() const noexcept
   return stream_.filename(fileIndex_);
 }
 
-std::string Line::shortFilename() const noexcept
+const std::string& Line::shortFilename() const noexcept
 {
   return stream_.shortFilename(fileIndex_);
 }
@@ -57,21 +58,102 @@ bool operator<(const Line& a, const Line& b) noexcept
 //      SourceStream
 // ----------------------------------------------------------------------------
 
-void SourceStream::includeFile(const std::string& filename)
+// Returns false if the file is only to be included once and has been already.
+bool SourceStream::includeFile(const std::string& filename, bool once)
 {
   auto normalizedFilename = normalizePath(filename);
+  if (alreadyIncluded(normalizedFilename, once))
+    return false;
 
   auto input = std::make_unique<std::ifstream>(normalizedFilename);
   if (! input->is_open())
     throw SystemError(normalizedFilename);
 
-  if (std::find_if(std::begin(files_), std::end(files_),
-                [=](const auto& info) { return info.filename == normalizedFilename; }) != std::end(files_))
-    throw DuplicateIncludeError(normalizedFilename);
-
   int fileIndex = files_.size();
-  files_.push_back({ normalizedFilename, basename(normalizedFilename) });
+  addFile(normalizedFilename, basename(normalizedFilename));
+  included_.insert(normalizedFilename);
   sources_.emplace(fileIndex, std::move(input));
+  return true;
+}
+
+int SourceStream::includeLines(const std::string& filename, bool once)
+{
+  auto normalizedFilename = normalizePath(filename);
+  if (alreadyIncluded(normalizedFilename, once))
+    return -1;
+
+  int fileIndex = files_.size();
+  addFile(normalizedFilename, basename(normalizedFilename));
+  included_.insert(normalizedFilename);
+  return fileIndex;
+}
+
+const Line *SourceStream::addLine(int fileIndex, int lineNumber, std::string&& text)
+{
+  lines_.push_back(std::make_unique<Line>(*this, fileIndex, lineNumber, std::move(text)));
+  return lines_.back().get();
+}
+
+// Including a file a second time is an error, unless it is only to be included once, in which case this
+// returns true.
+bool SourceStream::alreadyIncluded(const std::string& filename, bool once) const
+{
+  if (! included_.count(filename))
+    return false;
+  if (once)
+    return true;
+  throw DuplicateIncludeError(filename);
+}
+
+void SourceStream::includeText(const std::string& name, const std::string& text)
+{
+  int fileIndex = files_.size();
+  addFile(name, name);
+  sources_.emplace(fileIndex, std::make_unique<std::istringstream>(text));
+}
+
+const Line *SourceStream::expandLine(const Line& line, const Line& caller)
+{
+  lines_.push_back(std::make_unique<Line>(*this, line.fileIndex(), line.lineNumber(), std::string(line.text()), &caller));
+  return lines_.back().get();
+}
+
+void SourceStream::addIncludePath(const std::string& path)
+{
+  includePaths_.push_back(normalizePath(path));
+}
+
+// A name that can't be found anywhere resolves to the file beside the one that refers to it, so that the
+// error reported when it is opened names that file.
+const std::string& SourceStream::resolve(int fileIndex, const std::string& name)
+{
+  const auto& directory = files_[fileIndex].directory;
+  auto key = directory + '\n' + name;
+  auto resolved = resolved_.find(key);
+  if (resolved != std::end(resolved_))
+    return resolved->second;
+
+  bool absolute = ! name.empty() && name[0] == PATH_SEPARATOR;
+  auto filename = absolute ? normalizePath(name) : joinPath(directory, name);
+  if (! absolute && ! isRegularFile(filename))
+  {
+    for (const auto& path: includePaths_)
+    {
+      auto candidate = joinPath(path, name);
+      if (isRegularFile(candidate))
+      {
+        filename = std::move(candidate);
+        break;
+      }
+    }
+  }
+  return resolved_.emplace(std::move(key), std::move(filename)).first->second;
+}
+
+void SourceStream::addFile(const std::string& filename, const std::string& shortFilename)
+{
+  files_.push_back({ filename, shortFilename, dirname(filename) });
+  longestShortFilename_ = std::max(longestShortFilename_, shortFilename.length());
 }
 
 Line *SourceStream::nextLine()
@@ -183,11 +265,17 @@ std::ostream& operator<<(std::ostream& s, const Token& token) noexcept
 // ----------------------------------------------------------------------------
 
 LineReader::LineReader(const Line& line) noexcept
-  : line_(line), offset_(0)
+  : line_(line), offset_(0), tokens_(nullptr), index_(0)
 {
   unget_.type = TokenType::End;               // Indicates no token to unget
 }
 
+LineReader::LineReader(const Line& line, const std::vector<Token>& tokens) noexcept
+  : line_(line), offset_(static_cast<int>(line.length())), tokens_(&tokens), index_(0)
+{
+  unget_.type = TokenType::End;
+}
+
 Token LineReader::nextToken()
 {
   if (unget_.type != TokenType::End)
@@ -197,6 +285,9 @@ Token LineReader::nextToken()
     return token;
   }
 
+  if (tokens_ && index_ < tokens_->size())
+    return (*tokens_)[index_ ++];
+
   int c;
   while (std::isspace(c = get()))
   {
@@ -336,6 +427,16 @@ void LineReader::unget(Token& token) noexcept
   unget_ = token;
 }
 
+std::vector<Token> tokenize(const Line& line)
+{
+  std::vector<Token> tokens;
+  LineReader reader(line);
+  Token token;
+  while ((token = reader.nextToken()).type != TokenType::End)
+    tokens.push_back(std::move(token));
+  return tokens;
+}
+
 // ----------------------------------------------------------------------------
 //      SourceError
 // ----------------------------------------------------------------------------
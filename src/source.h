@@ -6,6 +6,8 @@
 #include <istream>
 #include <stack>
 #include <vector>
+#include <unordered_set>
+#include <unordered_map>
 #include "types.h"
 #include "error.h"
 
@@ -21,16 +23,21 @@ class SourceStream;
 class Line
 {
 public:
-  Line(SourceStream& stream, int fileIndex, int lineNumber, std::string&& text) noexcept;
+  Line(SourceStream& stream, int fileIndex, int lineNumber, std::string&& text, const Line *caller = nullptr) noexcept;
 
   std::string filename() const noexcept;
-  std::string shortFilename() const noexcept;
+  const std::string& shortFilename() const noexcept;
+  int fileIndex() const noexcept { return fileIndex_; }
   int lineNumber() const noexcept { return lineNumber_; }
 
   size_t length() const noexcept { return text_.length(); }
-  std::string text() const noexcept { return text_; }
+  const std::string& text() const noexcept { return text_; }
   char operator[](int index) const noexcept { return text_[index]; }
 
+  // A line produced by a macro expansion is a copy of the macro's line that refers back to the line with
+  // the call, which may itself be part of an expansion.
+  const Line *caller() const noexcept { return caller_; }
+
   friend bool operator==(const Line& a, const Line& b) noexcept;
   friend bool operator<(const Line& a, const Line& b) noexcept;
 
@@ -39,6 +46,7 @@ private:
   int fileIndex_;
   int lineNumber_;
   std::string text_;
+  const Line *caller_;
 };
 
 // ----------------------------------------------------------------------------
@@ -49,17 +57,30 @@ class SourceStream
 {
 public:
   Line *nextLine();
-  void includeFile(const std::string& filename);
+  bool includeFile(const std::string& filename, bool once = false);
+  void includeText(const std::string& name, const std::string& text);
+  const Line *expandLine(const Line& line, const Line& caller);
+
+  // Includes a file whose lines are added one at a time rather than read from it, such as one that has been
+  // precompiled. Returns its file index, or -1 if it is only to be included once and has been already.
+  int includeLines(const std::string& filename, bool once = false);
+  const Line *addLine(int fileIndex, int lineNumber, std::string&& text);
+
+  // A relative name is looked for beside the file that refers to it, and then in each include path in turn.
+  // Resolutions are remembered for each directory, so a name is only searched for once.
+  void addIncludePath(const std::string& path);
+  const std::string& resolve(int fileIndex, const std::string& name);
 
   std::string filename(int fileIndex) const noexcept { return files_[fileIndex].filename; }
-  std::string shortFilename(int fileIndex) const noexcept { return files_[fileIndex].shortFilename; }
+  const std::string& shortFilename(int fileIndex) const noexcept { return files_[fileIndex].shortFilename; }
+  size_t longestShortFilename() const noexcept { return longestShortFilename_; }
 
 private:
   struct FileInfo
   {
     std::string filename;
     std::string shortFilename;
-
+    std::string directory;
   };
 
   struct Source
@@ -74,7 +95,14 @@ private:
 
   std::stack<Source> sources_;
   std::vector<FileInfo> files_;
+  std::unordered_set<std::string> included_;                  // Normalized filenames
+  std::vector<std::string> includePaths_;
+  std::unordered_map<std::string, std::string> resolved_;     // By directory and name, separated by a newline
   std::vector<std::unique_ptr<Line>> lines_;
+  size_t longestShortFilename_ = 0;
+
+  void addFile(const std::string& filename, const std::string& shortFilename);
+  bool alreadyIncluded(const std::string& filename, bool once) const;
 };
 
 // ----------------------------------------------------------------------------
@@ -146,6 +174,9 @@ class LineReader
 public:
   LineReader(const Line& line) noexcept;
 
+  // Reads previously scanned tokens instead of the text of the line.
+  LineReader(const Line& line, const std::vector<Token>& tokens) noexcept;
+
   Token nextToken();
   void expectPunctuator(char c);
   bool optionalPunctuator(char c);
@@ -160,8 +191,13 @@ private:
   const Line& line_;
   int offset_;
   Token unget_;
+  const std::vector<Token> *tokens_;
+  size_t index_;
 };
 
+// Scans the whole line, up to but not including the end token.
+std::vector<Token> tokenize(const Line& line);
+
 // ----------------------------------------------------------------------------
 //      SourceError
 // ----------------------------------------------------------------------------
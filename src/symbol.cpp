@@ -14,9 +14,8 @@
 
 #include <iostream>
 #include <algorithm>
-#include <cstdio>
-#include "str.h"
 #include "symbol.h"
+#include "symexport.h"
 
 namespace as64
 {
@@ -30,7 +29,7 @@ SymbolTable::SymbolTable()
 {
 }
 
-bool SymbolTable::set(const Label& label, Address addr) noexcept
+bool SymbolTable::set(const Label& label, Address addr, int serialNum) noexcept
 {
   switch (label.type())
   {
@@ -39,7 +38,7 @@ bool SymbolTable::set(const Label& label, Address addr) noexcept
       auto i = symbols_.find(label.name());
       if (i != std::end(symbols_))
         return false;
-      symbols_[label.name()] = { addr, nextSerialNum_ ++ };
+      symbols_[label.name()] = { addr, serialNum < 0 ? nextSerialNum_ ++ : serialNum };
       return true;
     }
 
@@ -90,7 +89,8 @@ Maybe<Address> SymbolTable::get(Address addr, int labelDelta) const noexcept
       -- i;
     while (labelDelta && i != std::end(temps_))
     {
-      ++ i;
+      if (++ i == std::end(temps_))
+        break;
       if (i->type == LabelType::Temporary || i->type == LabelType::TemporaryForward)
         -- labelDelta;
     }
@@ -113,32 +113,48 @@ Maybe<Address> SymbolTable::get(Address addr, int labelDelta) const noexcept
   return nullptr;
 }
 
-void SymbolTable::write(std::ostream& s) const noexcept
+void SymbolTable::truncate(int serialNum) noexcept
 {
-  // Sort the symbols into original declaration order.
-  std::vector<std::pair<std::string, Symbol>> entries;
-  entries.reserve(symbols_.size());
-  size_t longestName = 0;
-  for (const auto& symbol: symbols_)
+  for (auto i = std::begin(symbols_); i != std::end(symbols_); )
   {
-    if (symbol.first.length() > longestName)
-      longestName = symbol.first.length();
-    entries.push_back({ symbol.first, symbol.second });
+    if (i->second.serialNum >= serialNum)
+      i = symbols_.erase(i);
+    else
+      ++ i;
   }
-  std::sort(std::begin(entries), std::end(entries), [](const auto& a, const auto& b)
+  temps_.clear();
+  nextSerialNum_ = serialNum;
+}
+
+void SymbolTable::forEach(const std::function<void (const std::string& name, Address addr)>& f) const
+{
+  for (const auto& symbol: symbols_)
+    f(symbol.first, symbol.second.address);
+}
+
+void SymbolTable::forEach(SymbolOrder order,
+                          const std::function<void (const std::string& name, Address addr)>& f) const
+{
+  std::vector<const std::pair<const std::string, Symbol> *> entries;
+  entries.reserve(symbols_.size());
+  for (const auto& symbol: symbols_)
+    entries.push_back(&symbol);
+  std::sort(std::begin(entries), std::end(entries), [&](const auto a, const auto b)
   {
-    return a.second.serialNum < b.second.serialNum;
+    if (order == SymbolOrder::Declaration)
+      return a->second.serialNum < b->second.serialNum;
+    return a->second.address < b->second.address || (a->second.address == b->second.address && a->first < b->first);
   });
 
-  if (longestName % 2)
-    ++ longestName;
-  longestName += 2;
-  for (const auto& entry: entries)
-  {
-    char addrText[16];
-    std::snprintf(addrText, sizeof(addrText), "%04x", entry.second.address);
-    s << padRight(entry.first, longestName) << "= $" << addrText << std::endl;
-  }
+  for (const auto entry: entries)
+    f(entry->first, entry->second.address);
+}
+
+void SymbolTable::write(std::ostream& s) const noexcept
+{
+  std::string text;
+  symbolFormatNamed("text")->write(text, *this);
+  s.write(text.data(), text.size());
 }
 
 }
@@ -4,12 +4,20 @@
 #include <vector>
 #include <unordered_map>
 #include <utility>
+#include <string>
+#include <functional>
 #include <ostream>
 #include "types.h"
 
 namespace as64
 {
 
+enum class SymbolOrder
+{
+  Declaration,
+  Address
+};
+
 // ----------------------------------------------------------------------------
 //      SymbolTable
 // ----------------------------------------------------------------------------
@@ -19,15 +27,27 @@ class SymbolTable
 public:
   SymbolTable();
 
-  // Returns false if a symbol already exists with the given label.
-  bool set(const Label& label, Address addr) noexcept;
+  // Returns false if a symbol already exists with the given label. A symbol takes the next serial number,
+  // unless one was reserved for it earlier.
+  bool set(const Label& label, Address addr, int serialNum = -1) noexcept;
   bool set(const std::pair<Label, Address>& symbol) noexcept { return set(symbol.first, symbol.second); }
 
   bool exists(const std::string& name) const noexcept { return symbols_.find(name) != std::end(symbols_); }
   Maybe<Address> get(const std::string& name) const noexcept;
   Maybe<Address> get(Address addr, int labelDelta) const noexcept;
 
+  // Discards every symbol numbered serialNum or later, along with all temporary labels, so that
+  // definitions can be repeated after the statement list has changed.
+  int serialNum() const noexcept { return nextSerialNum_; }
+  int reserveSerialNum() noexcept { return nextSerialNum_ ++; }
+  void truncate(int serialNum) noexcept;
+
   void write(std::ostream& s) const noexcept;
+  void forEach(const std::function<void (const std::string& name, Address addr)>& f) const;
+
+  // Visits the symbols in the given order without copying them; symbols at the same address are ordered
+  // by name.
+  void forEach(SymbolOrder order, const std::function<void (const std::string& name, Address addr)>& f) const;
 
 private:
   struct Symbol
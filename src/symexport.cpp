@@ -0,0 +1,221 @@
+// Copyright (c) 2018 Robert A. Stoerrle
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+// REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+// AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+// INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+// LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+// OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+#include <cstdint>
+#include "str.h"
+#include "file.h"
+#include "symexport.h"
+
+namespace as64
+{
+
+namespace
+{
+
+void appendHex(std::string& out, Address addr, bool upperCase)
+{
+  const char *digits = upperCase ? "0123456789ABCDEF" : "0123456789abcdef";
+  for (int shift = 12; shift >= 0; shift -= 4)
+    out += digits[(addr >> shift) & 0x0f];
+}
+
+void appendDecimal(std::string& out, unsigned value)
+{
+  char digits[10];
+  int count = 0;
+  do
+  {
+    digits[count ++] = static_cast<char>('0' + value % 10);
+    value /= 10;
+  } while (value);
+  while (count)
+    out += digits[-- count];
+}
+
+void storeLittleEndian(std::string& out, size_t& pos, uint32_t value, int size)
+{
+  for (int index = 0; index < size; ++ index)
+    out[pos ++] = static_cast<char>((value >> (index * 8)) & 0xff);
+}
+
+// ----------------------------------------------------------------------------
+//      TextFormat
+// ----------------------------------------------------------------------------
+
+class TextFormat : public SymbolFormat
+{
+public:
+  std::string name() const noexcept override { return "text"; }
+  void write(std::string& out, const SymbolTable& symbols) const override;
+};
+
+void TextFormat::write(std::string& out, const SymbolTable& symbols) const
+{
+  size_t longestName = 0;
+  symbols.forEach([&](const auto& name, Address addr)
+  {
+    if (name.length() > longestName)
+      longestName = name.length();
+  });
+  if (longestName % 2)
+    ++ longestName;
+  longestName += 2;
+
+  symbols.forEach(SymbolOrder::Declaration, [&](const auto& name, Address addr)
+  {
+    out += name;
+    out.append(longestName - name.length(), ' ');
+    out += "= $";
+    appendHex(out, addr, false);
+    out += '\n';
+  });
+}
+
+// ----------------------------------------------------------------------------
+//      ViceFormat
+// ----------------------------------------------------------------------------
+
+class ViceFormat : public SymbolFormat
+{
+public:
+  std::string name() const noexcept override { return "vice"; }
+  void write(std::string& out, const SymbolTable& symbols) const override;
+};
+
+void ViceFormat::write(std::string& out, const SymbolTable& symbols) const
+{
+  symbols.forEach(SymbolOrder::Address, [&](const auto& name, Address addr)
+  {
+    out += "al C:";
+    appendHex(out, addr, false);
+    out += " .";
+    out += name;
+    out += '\n';
+  });
+}
+
+// ----------------------------------------------------------------------------
+//      JsonFormat
+// ----------------------------------------------------------------------------
+
+class JsonFormat : public SymbolFormat
+{
+public:
+  std::string name() const noexcept override { return "json"; }
+  void write(std::string& out, const SymbolTable& symbols) const override;
+};
+
+void JsonFormat::write(std::string& out, const SymbolTable& symbols) const
+{
+  bool first = true;
+  out += "{\n  \"symbols\": [";
+  symbols.forEach(SymbolOrder::Declaration, [&](const auto& name, Address addr)
+  {
+    out += first ? "\n    { \"name\": \"" : ",\n    { \"name\": \"";
+    first = false;
+    for (auto ch: name)
+    {
+      if (ch == '"' || ch == '\\')
+        out += '\\';
+      if (static_cast<unsigned char>(ch) < 0x20)
+      {
+        out += "\\u00";
+        out += "0123456789abcdef"[(ch >> 4) & 0x0f];
+        out += "0123456789abcdef"[ch & 0x0f];
+      }
+      else
+        out += ch;
+    }
+    out += "\", \"address\": ";
+    appendDecimal(out, addr);
+    out += " }";
+  });
+  out += first ? "]\n}\n" : "\n  ]\n}\n";
+}
+
+// ----------------------------------------------------------------------------
+//      BinFormat
+// ----------------------------------------------------------------------------
+
+class BinFormat : public SymbolFormat
+{
+public:
+  std::string name() const noexcept override { return "bin"; }
+  void write(std::string& out, const SymbolTable& symbols) const override;
+
+private:
+  static constexpr size_t HeaderSize = 16;
+  static constexpr size_t EntrySize = 8;
+};
+
+void BinFormat::write(std::string& out, const SymbolTable& symbols) const
+{
+  size_t count = 0, namesSize = 0;
+  symbols.forEach([&](const auto& name, Address addr)
+  {
+    ++ count;
+    namesSize += name.length() + 1;
+  });
+
+  // The file is sized up front, so that the entries and the names go straight into their final places in
+  // the same walk.
+  auto base = out.size();
+  auto nameOffset = HeaderSize + count * EntrySize;
+  out.resize(base + nameOffset + namesSize);
+  out.replace(base, 8, "AS64SYM", 8);
+  auto pos = base + 8;
+  storeLittleEndian(out, pos, 1, 2);
+  storeLittleEndian(out, pos, 0, 2);
+  storeLittleEndian(out, pos, static_cast<uint32_t>(count), 4);
+
+  symbols.forEach(SymbolOrder::Address, [&](const auto& name, Address addr)
+  {
+    if (name.length() > 0xffff)
+      throw SymbolFormatError("Symbol '" + name + "' is too long for the binary index");
+    storeLittleEndian(out, pos, addr, 2);
+    storeLittleEndian(out, pos, static_cast<uint32_t>(name.length()), 2);
+    storeLittleEndian(out, pos, static_cast<uint32_t>(nameOffset), 4);
+    name.copy(&out[base + nameOffset], name.length());
+    nameOffset += name.length() + 1;
+  });
+}
+
+}
+
+// ----------------------------------------------------------------------------
+//      SymbolFormat
+// ----------------------------------------------------------------------------
+
+bool SymbolFormat::save(const SymbolTable& symbols, const std::string& filename) const
+{
+  std::string contents;
+  write(contents, symbols);
+  return saveFile(filename, { { contents.data(), contents.size() } });
+}
+
+std::unique_ptr<SymbolFormat> symbolFormatNamed(const std::string& name) noexcept
+{
+  auto lowerName = toLowerCase(name);
+  if (lowerName == "text")
+    return std::make_unique<TextFormat>();
+  if (lowerName == "vice")
+    return std::make_unique<ViceFormat>();
+  if (lowerName == "json")
+    return std::make_unique<JsonFormat>();
+  if (lowerName == "bin")
+    return std::make_unique<BinFormat>();
+  return nullptr;
+}
+
+}
@@ -0,0 +1,56 @@
+#ifndef _INCLUDED_AS64_SYMEXPORT_H
+#define _INCLUDED_AS64_SYMEXPORT_H
+
+#include <string>
+#include <memory>
+#include "error.h"
+#include "symbol.h"
+
+namespace as64
+{
+
+// ----------------------------------------------------------------------------
+//      SymbolFormat
+// ----------------------------------------------------------------------------
+
+class SymbolFormat
+{
+public:
+  virtual ~SymbolFormat() noexcept { }
+
+  virtual std::string name() const noexcept = 0;
+
+  // Appends the formatted symbol table to out, one symbol at a time.
+  virtual void write(std::string& out, const SymbolTable& symbols) const = 0;
+
+  // Returns false if the file already had the same contents and was left alone.
+  bool save(const SymbolTable& symbols, const std::string& filename) const;
+};
+
+// Recognized names are text (the -s listing), vice (a VICE monitor label file), json and bin. The bin index
+// is meant to be mapped into memory by a debugger; all of its fields are little-endian:
+//
+//   0   "AS64SYM\0"
+//   8   uint16 version (1), uint16 reserved, uint32 count
+//   16  count entries of uint16 address, uint16 name length, uint32 name offset, sorted by address
+//   ..  the names, each terminated by a zero byte; offsets are from the start of the file
+std::unique_ptr<SymbolFormat> symbolFormatNamed(const std::string& name) noexcept;
+
+// ----------------------------------------------------------------------------
+//      SymbolFormatError
+// ----------------------------------------------------------------------------
+
+class SymbolFormatError : public GeneralError
+{
+public:
+  SymbolFormatError(const std::string& message) noexcept : message_(message) { }
+
+  const char *what() const noexcept override { return "Symbol Format Error"; }
+  std::string message() const noexcept override { return message_; }
+
+private:
+  std::string message_;
+};
+
+}
+#endif
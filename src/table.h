@@ -22,6 +22,9 @@ public:
   const T *get(const std::string& name) const noexcept;
   T *get(const std::string& name) noexcept;
 
+  const auto begin() const { return data_.begin(); }
+  const auto end() const { return data_.end(); }
+
   template<class... Args> void emplace(const std::string& name, Args&&... args) noexcept
   {
     data_.emplace(std::piecewise_construct,